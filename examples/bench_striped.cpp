@@ -0,0 +1,70 @@
+// ioscript_bench_striped: throughput of Process::send_striped over K channels into Python
+//
+//     ioscript_bench_striped [bytes ...]
+//
+// Each measurement sends one object of the given size and waits for the interpreter to have
+// reassembled it with iosc_recv_striped and exited.  Defaults to 256 MiB and 1 GiB.
+
+#include "ioscript/ioscript.h"
+#include "ioscript/python.h"
+
+#include <cstdlib>
+#include <cstring>
+
+using namespace iosc;
+
+namespace {
+
+// Python normally runs only once its standard input has closed, which is after all data has been sent.
+// This one runs the code sent up to a '#run' line straight away, so that it receives while we send.
+struct StreamingPython {
+	static constexpr const char* cmd = "exec python -c 'import sys; exec(\"\".join(iter(sys.stdin.readline, \"#run\\n\")))'";
+};
+
+double seconds(std::chrono::steady_clock::duration d)
+{
+	return std::chrono::duration<double>(d).count();
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	std::vector<std::size_t> sizes;
+	for (int i=1; i<argc; i++)
+		sizes.push_back(std::strtoull(argv[i], nullptr, 0));
+	if (sizes.empty())
+		sizes = { std::size_t(256) << 20, std::size_t(1) << 30 };
+
+	const unsigned stripes[] = { 1, 2, 4, 8 };
+
+	std::printf("%14s", "bytes");
+	for (unsigned k : stripes)
+		std::printf(" %9s%-2u GB/s", "K=", k);
+	std::printf("\n");
+
+	for (std::size_t n : sizes)
+	{
+		std::vector<char> buffer(n, 1);
+
+		std::printf("%14zu", n);
+		for (unsigned k : stripes)
+		{
+			Process<StreamingPython> process(NUM_OPEN_CHANNELS);
+			PythonHeader{}(process);
+			process << "buf = iosc_recv_striped(0, " << k << ", " << n << ")\n"
+			        << "assert len(buf) == " << n << " and buf[-1] == 1\n"
+			        << "#run" << std::endl;
+
+			auto t0 = std::chrono::steady_clock::now();
+			process.send_striped(0, k, buffer.data(), n);
+			process.wait();
+			double t = seconds(std::chrono::steady_clock::now() - t0);
+
+			std::printf(" %16.3f", n / t * 1e-9);
+			std::fflush(stdout);
+		}
+		std::printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,73 @@
+// ioscript_bench: plain write() against zero-copy Process::send() for large contiguous payloads
+//
+//     ioscript_bench [bytes ...]
+//
+// The subprocess is a shell that drains the channel into /dev/null, so only the cost of moving the
+// bytes into the pipe and out again is measured.  Defaults to payloads of 64 KiB to 1 GiB.
+
+#include "ioscript/ioscript.h"
+
+#include <cstdlib>
+#include <cstring>
+
+using namespace iosc;
+
+namespace {
+
+// popen() runs its command through `sh -c`: exec, so no other shell holds on to the channel
+struct Shell { static constexpr const char* cmd = "exec sh"; };
+
+double seconds(std::chrono::steady_clock::duration d)
+{
+	return std::chrono::duration<double>(d).count();
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	std::vector<std::size_t> sizes;
+	for (int i=1; i<argc; i++)
+		sizes.push_back(std::strtoull(argv[i], nullptr, 0));
+	if (sizes.empty())
+		sizes = { std::size_t(64) << 10, std::size_t(1) << 20, std::size_t(16) << 20, std::size_t(256) << 20, std::size_t(1) << 30 };
+
+	Process<Shell> process(1);
+	const auto& channel = process.channels()[0];
+	if (channel.fd_r > 9 || channel.fd_w > 9) {
+		std::cerr << "ioscript_bench: channel file descriptors out of reach of sh" << std::endl;
+		return 1;
+	}
+	// The shell holds on to the write end too, and would never see the end of the data without this
+	process.out() << "exec " << channel.fd_w << ">&-; cat <&" << channel.fd_r << " >/dev/null" << std::endl;
+
+	std::printf("%14s %12s %12s %12s %12s\n", "bytes", "write (s)", "GB/s", "send (s)", "GB/s");
+	for (std::size_t n : sizes)
+	{
+		void* buffer = nullptr;
+		if (posix_memalign(&buffer, 4096, n) != 0) {
+			std::cerr << "ioscript_bench: can't allocate " << n << " bytes" << std::endl;
+			return 1;
+		}
+		std::memset(buffer, 1, n);
+
+		// Repeat small payloads so each measurement covers at least 256 MiB
+		std::size_t reps = std::max<std::size_t>(1, (std::size_t(256) << 20) / n);
+
+		auto t0 = std::chrono::steady_clock::now();
+		for (std::size_t r=0; r<reps; r++) {
+			process.data_out(0).write(static_cast<const char*>(buffer), n);
+			process.sent(0).wait();
+		}
+		double tWrite = seconds(std::chrono::steady_clock::now() - t0) / reps;
+
+		t0 = std::chrono::steady_clock::now();
+		for (std::size_t r=0; r<reps; r++)
+			process.send(0, buffer, n).wait();
+		double tSend = seconds(std::chrono::steady_clock::now() - t0) / reps;
+
+		std::printf("%14zu %12.6f %12.3f %12.6f %12.3f\n", n, tWrite, n / tWrite * 1e-9, tSend, n / tSend * 1e-9);
+		std::free(buffer);
+	}
+	return 0;
+}
@@ -0,0 +1,103 @@
+#include "ioscript/ioscript.h"
+#include "ioscript/python.h"
+#include "ioscript/aggregate.h"
+
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace iosc;
+
+namespace {
+
+// A type of our own to bind, as vector<double> is bound elsewhere in the examples
+struct Samples : vector<double> {
+	using vector<double>::vector;
+};
+
+struct Sample {
+	float x;
+	float y;
+};
+
+// What arrives from a Histogram<Bars> stage: the counts and the range they cover
+struct Bars
+{
+	void operator()(Process<Python>& python, const histogram& hist) const
+	{
+		python << R"(
+import matplotlib.pyplot as plt
+counts = list(map(int, iosc_in[0].readline().split()))
+)"
+		<< "plt.bar([" << hist.lo << " + (i + 0.5) * " << hist.width() << " for i in range(len(counts))], counts, "
+		<< hist.width() << ")\n";
+		for (auto count : hist.counts) {
+			python.data_out(0) << count << ' ';
+		}
+		python.data_out(0) << endl;
+	}
+
+	template <typename T>
+	void operator()(Process<Python>& python, const T& obj) const {}
+};
+
+// And from a Density<Image> stage, a grid of counts indexed [y][x]
+struct Image
+{
+	void operator()(Process<Python>& python, const histogram2d& grid) const
+	{
+		python << R"(
+import matplotlib.pyplot as plt
+rows = [list(map(int, iosc_in[0].readline().split())) for _ in range()" << grid.size() << R"()]
+)"
+		<< "plt.imshow(rows, origin='lower', extent=(" << grid.xlo << ", " << grid.xhi << ", "
+		<< grid.ylo << ", " << grid.yhi << "), aspect='auto')\n";
+		for (size_t i=0; i<grid.size(); i++) {
+			for (size_t j=0; j<grid[i].size(); j++) {
+				python.data_out(0) << grid[i][j] << ' ';
+			}
+			python.data_out(0) << '\n';
+		}
+		python.data_out(0) << flush;
+	}
+
+	template <typename T>
+	void operator()(Process<Python>& python, const T& obj) const {}
+};
+
+struct SaveFig {
+	const char* filename;
+	void operator()(Process<Python>& python) const {
+		python << "plt.savefig('" << filename << "')\n"
+		       << "plt.clf()" << endl;
+	}
+};
+
+} // namespace
+
+template <> struct iosc::binds_to<Samples>        { using type = variant<Histogram<Bars>>; };
+template <> struct iosc::binds_to<vector<Sample>> { using type = variant<Density<Image>>; };
+
+void example_aggregate()
+{
+	using MyTypes = std::tuple<Samples, vector<Sample>>;
+
+	std::mt19937 gen(1);
+	std::normal_distribution<> normal(0, 1);
+	Samples samples(10000000);
+	for (auto& v : samples) {
+		v = normal(gen);
+	}
+	vector<Sample> points(samples.size());
+	for (size_t i=0; i<points.size(); i++) {
+		points[i] = Sample{float(samples[i]), float(samples[i] * 0.5 + normal(gen))};
+	}
+
+	Script<Python,MyTypes> script;
+
+	// 100 counts are sent instead of 10^7 samples
+	script.run(Histogram<Bars>{100, -4, 4}, samples, SaveFig{"aggregate_histogram.png"});
+
+	// A 200 x 100 grid instead of 10^7 points
+	script.run(Density<Image>{200, 100}, points, SaveFig{"aggregate_density.png"});
+}
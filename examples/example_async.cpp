@@ -0,0 +1,51 @@
+#include "ioscript/ioscript.h"
+#include "ioscript/python.h"
+#include "ioscript/async.h"
+
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace iosc;
+
+namespace {
+
+struct Frame
+{
+	int worker;
+	int frame;
+	void operator()(Process<Python>& python) const {
+		python << "print('worker " << worker << " is at frame " << frame << "')" << endl;
+	}
+};
+
+} // namespace
+
+void example_async()
+{
+	using MyTypes = std::tuple<>;
+
+	// Any thread may call debugScript().run(...) - the call returns immediately and the
+	// Python subprocesses are driven from a separate thread
+	vector<thread> workers;
+	for (int w=0; w<4; w++) {
+		workers.emplace_back([w] {
+			for (int i=0; i<10000; i++) {
+				// Only the most recent frame per worker is run, the rest are coalesced
+				debugScript<Python,MyTypes>().runLatest(w, Frame{w, i});
+			}
+		});
+	}
+	for (auto& worker : workers) {
+		worker.join();
+	}
+
+	auto& script = debugScript<Python,MyTypes>();
+	script.flush();
+
+	auto stats = script.stats();
+	clog << "(example_async) " << stats.executed << " run, "
+	     << stats.coalesced << " coalesced, "
+	     << stats.dropped << " dropped, max latency "
+	     << stats.maxLatencyNs / 1000000.0 << " ms" << endl;
+}
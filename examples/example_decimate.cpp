@@ -0,0 +1,78 @@
+#include "ioscript/ioscript.h"
+#include "ioscript/python.h"
+#include "ioscript/decimate.h"
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace iosc;
+
+namespace {
+
+struct LineChart
+{
+	void operator()(Process<Python>& python, const vector<double>& obj) const
+	{
+		python << R"(
+import matplotlib.pyplot as plt
+y = list(map(float, iosc_in[0].readline().split()))
+plt.plot(y)
+)";
+		for (auto elem : obj) {
+			python.data_out(0) << elem << ' ';
+		}
+		python.data_out(0) << endl;
+	}
+
+	// What arrives from a Decimate<LineChart> stage: the retained samples along with their original index
+	void operator()(Process<Python>& python, const sampled_series<double>& obj) const
+	{
+		python << R"(
+import matplotlib.pyplot as plt
+x = list(map(int, iosc_in[0].readline().split()))
+y = list(map(float, iosc_in[1].readline().split()))
+plt.plot(x, y)
+)";
+		for (size_t i=0; i<obj.size(); i++) {
+			python.data_out(0) << obj.x[i] << ' ';
+			python.data_out(1) << obj.y[i] << ' ';
+		}
+		python.data_out(0) << endl;
+		python.data_out(1) << endl;
+	}
+};
+
+struct SaveFig {
+	const char* filename;
+	void operator()(Process<Python>& python) const {
+		python << "plt.savefig('" << filename << "')" << endl;
+	}
+};
+
+} // namespace
+
+template <> struct iosc::binds_to<vector<double>> { using type = variant<LineChart, Decimate<LineChart>>; };
+
+void example_decimate()
+{
+	using MyTypes = std::tuple<vector<double>>;
+
+	// A noisy signal far longer than any figure is wide
+	std::mt19937 gen(1);
+	std::normal_distribution<> noise(0, 0.1);
+	vector<double> signal(10000000);
+	for (size_t i=0; i<signal.size(); i++) {
+		signal[i] = std::sin(i * 1e-6) + noise(gen);
+	}
+	signal[6543210] = 3.0;   // A single spike min/max decimation is guaranteed to keep
+
+	Script<Python,MyTypes> script;
+
+	// ~2 x 1920 points are sent instead of 10^7
+	script.run(Decimate<LineChart>{1920}, signal, SaveFig{"decimate_minmax.png"});
+
+	// LTTB keeps exactly 1000 points
+	script.run(Decimate<LineChart>{1000, Decimate<LineChart>::LTTB}, signal, SaveFig{"decimate_lttb.png"});
+}
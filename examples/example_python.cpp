@@ -148,10 +148,28 @@ void sendBarData(Process<Python>& python, const std::map<int,int>& obj)
 // Type 3. Use both forms of `operator()`.
 // In this example the one-argument form handles initialization local to the bar chart.
 // The two argument form is then left to define reocurring behaviour for each argument (each bar plot).
+// The code common to every bar plot is defined once per run, so each plot just sends a call and its data.
 struct BarChart
 {
 	int numPlots = 1;
 
+	static const char* definition()
+	{
+		return
+R"(
+def bar_chart():
+    global plotNum
+    x = map(int, iosc_in[0].readline().split())
+    y = map(int, iosc_in[1].readline().split())
+
+    width = 1.0/numPlots
+    xPos = plotNum * width
+
+    plt.bar([a+xPos for a in x], y, width-0.1, color=cols[plotNum])
+    plotNum += 1
+)";
+	}
+
 	void operator()(Process<Python>& python) const
 	{
 		python <<
@@ -166,17 +184,8 @@ plotNum = 0
 	template <typename T>
 	void operator()(Process<Python>& python, const T& obj) const
 	{
-        python <<
-R"(
-x = map(int, iosc_in[0].readline().split())
-y = map(int, iosc_in[1].readline().split())
-
-width = 1.0/numPlots
-xPos = plotNum * width
+		python << "bar_chart()\n";
 
-plt.bar([a+xPos for a in x], y, width-0.1, color=cols[plotNum])
-plotNum += 1
-)";
 		// An additional indirection to handle sending data based on type
 		sendBarData(python, obj);
 	}
@@ -0,0 +1,76 @@
+// ioscriptd: run the Python code of many applications on one pool of warm interpreters
+//
+//     ioscriptd [--pool <n>] [--preload <file>] socket
+//
+// Applications use it by setting ProcessOptions::server to the socket path.  The preload file is run
+// once by each interpreter when started, e.g. to import numpy and matplotlib ahead of the first run.
+// Stops on SIGINT or SIGTERM.
+
+#include "ioscript/ioscript.h"
+#include "ioscript/python.h"
+#include "ioscript/server.h"
+
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+using namespace iosc;
+
+namespace {
+
+InterpreterServer<Python>* server = nullptr;
+
+void onSignal(int)
+{
+	if (server)
+		server->stop();
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	ServerOptions options;
+	const char* preload = nullptr;
+	const char* path = nullptr;
+
+	for (int i=1; i<argc; i++) {
+		if (!strcmp(argv[i], "--pool") && i+1 < argc)
+			options.pool = std::atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--preload") && i+1 < argc)
+			preload = argv[++i];
+		else
+			path = argv[i];
+	}
+	if (!path) {
+		std::cerr << "usage: " << argv[0] << " [--pool <n>] [--preload <file>] socket" << std::endl;
+		return 1;
+	}
+
+	if (preload) {
+		std::ifstream file(preload);
+		if (!file) {
+			std::cerr << "ioscriptd: can't read " << preload << std::endl;
+			return 1;
+		}
+		std::ostringstream code;
+		code << file.rdbuf();
+		options.preload = code.str();
+	}
+
+	InterpreterServer<Python> daemon(path, options);
+	if (!daemon.good())
+		return 1;
+
+	server = &daemon;
+	std::signal(SIGINT, onSignal);
+	std::signal(SIGTERM, onSignal);
+	std::signal(SIGPIPE, SIG_IGN);
+
+	std::cerr << "ioscriptd: serving " << options.pool << " interpreters on " << path << std::endl;
+	daemon.serve();
+	server = nullptr;
+	return 0;
+}
@@ -5,6 +5,9 @@ void example_python();
 void example_gnuplot();
 void example_process();
 void example_readme();
+void example_decimate();
+void example_aggregate();
+void example_async();
 
 int main()
 {
@@ -14,6 +17,9 @@ int main()
 	example_gnuplot();
 	example_process();
 	example_readme();
+	example_decimate();
+	example_aggregate();
+	example_async();
 
 	return 0;
 }
@@ -0,0 +1,54 @@
+// ioscript_replay: replay a bundle recorded with `Script::record()` against a fresh interpreter
+//
+//     ioscript_replay [--realtime] [--cmd <command>] bundle
+//
+// Each run is replayed with the command it was recorded with, unless overridden with --cmd,
+// and its wall time (first write until the interpreter exits) is printed to stderr.
+
+#include "ioscript/ioscript.h"
+#include "ioscript/replay.h"
+
+#include <cstring>
+
+using namespace iosc;
+
+namespace {
+
+// A runtime type whose command is only known once the bundle has been read
+struct Recorded { static const char* cmd; };
+const char* Recorded::cmd = "";
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	bool realtime = false;
+	const char* cmd = nullptr;
+	const char* path = nullptr;
+
+	for (int i=1; i<argc; i++) {
+		if (!strcmp(argv[i], "--realtime"))
+			realtime = true;
+		else if (!strcmp(argv[i], "--cmd") && i+1 < argc)
+			cmd = argv[++i];
+		else
+			path = argv[i];
+	}
+	if (!path) {
+		std::cerr << "usage: " << argv[0] << " [--realtime] [--cmd <command>] bundle" << std::endl;
+		return 1;
+	}
+
+	BundleReader bundle(path);
+	if (!bundle.good())
+		return 1;
+
+	BundleReader::Run run;
+	for (unsigned n=0; bundle.nextRun(run); n++) {
+		Recorded::cmd = cmd ? cmd : run.cmd.c_str();
+		auto t = replayRun<Recorded>(bundle, run, realtime);
+		std::cerr << "run " << n << " (" << Recorded::cmd << "): "
+		          << std::chrono::duration<double, std::milli>(t).count() << " ms" << std::endl;
+	}
+	return 0;
+}
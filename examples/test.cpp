@@ -1,10 +1,33 @@
 #include <iostream>
 #include <vector>
 #include <map>
+#include <list>
+#include <array>
+#include <fstream>
+#include <sstream>
+#include <cassert>
+#include <cmath>
+#include <numeric>
+#include <cstring>
+#include <cstdio>
+#include <limits>
+#include <thread>
 
 #include "ioscript/ioscript.h"
 #include "ioscript/gnuplot.h"
 #include "ioscript/python.h"
+#include "ioscript/decimate.h"
+#include "ioscript/aggregate.h"
+#include "ioscript/serialize.h"
+#include "ioscript/lazy.h"
+#include "ioscript/view.h"
+#include "ioscript/server.h"
+#include "ioscript/encode.h"
+#include "ioscript/delta.h"
+#include "ioscript/mapped.h"
+#include "ioscript/fanout.h"
+#include "ioscript/async.h"
+#include "ioscript/replay.h"
 
 using namespace std;
 using namespace iosc;
@@ -22,6 +45,27 @@ static_assert(variant_element_index<double, iosc::variant<int,char,float>>::valu
 static_assert( is_variant<variant<int,float>>::value,"");
 static_assert(!is_variant<std::nullptr_t>::value, "");
 
+static_assert( first_is_options<ProcessOptions,int>::value, "");
+static_assert( first_is_options<const ProcessOptions&>::value, "");
+static_assert(!first_is_options<int,ProcessOptions>::value, "");
+static_assert(!first_is_options<>::value, "");
+
+struct KeyedStyle {
+	void operator()(Process<Gnuplot>&) const {}
+	std::string headerKey() const { return "style"; }
+};
+
+static_assert( has_header_key<KeyedStyle>::value, "");
+static_assert(!has_header_key<int>::value, "");
+
+struct DefinedStyle {
+	static const char* definition() { return "def style(): pass\n"; }
+	void operator()(Process<Gnuplot>&) const {}
+};
+
+static_assert( has_definition<DefinedStyle>::value, "");
+static_assert(!has_definition<KeyedStyle>::value, "");
+
 struct CanvasStyle {
 	void operator()(Process<Gnuplot>&) const {}
 };
@@ -43,6 +87,31 @@ static_assert( is_script_snippet<CanvasStyle,Gnuplot>::value, "");
 static_assert(!is_script_snippet<ObjectStyle,Gnuplot>::value, "");
 static_assert(!is_script_snippet<DataObject,Gnuplot>::value, "");
 
+// A decimation stage is an object snippet, and a script snippet only if what it wraps is
+static_assert( is_object_snippet<Decimate<ObjectStyle>,Gnuplot>::value, "");
+static_assert(!is_script_snippet<Decimate<ObjectStyle>,Gnuplot>::value, "");
+static_assert( is_script_snippet<Decimate<CanvasStyle>,Gnuplot>::value, "");
+
+static_assert( is_flat_series<std::vector<float>>::value, "");
+static_assert(!is_flat_series<std::map<int,int>>::value, "");
+static_assert( is_flat_grid<std::array<std::array<int,4>,3>>::value, "");
+
+static_assert( is_xy_series<std::vector<std::pair<int,double>>>::value, "");
+static_assert( is_xy_series<std::vector<std::array<float,2>>>::value, "");
+static_assert(!is_xy_series<std::vector<double>>::value, "");
+
+static_assert( has_element_format<double>::value, "");
+static_assert( has_element_format<std::pair<int,double>>::value, "");
+static_assert(!has_element_format<std::string>::value, "");
+static_assert( is_contiguous_block<std::vector<float>>::value, "");
+static_assert(!is_contiguous_block<std::list<float>>::value, "");
+static_assert(!is_contiguous_block<std::vector<bool>>::value, "");
+#if __cplusplus >= 201703L
+struct Sample { float t; double v; };
+static_assert(detail::field_count<Sample>::value == 2, "");
+static_assert( is_raw_format<element_format<Sample>>::value, "");
+#endif
+
 struct A {};
 struct B {};
 struct C {};
@@ -64,6 +133,13 @@ static_assert( has_related_snippet<vector<int>>::value, "");
 static_assert( has_related_snippet<vector<float>>::value, "");
 static_assert(!has_related_snippet<char>::value, "");
 
+using MySnippets = snippets_from_types<MyTypes>::type;
+static_assert( is_object_range<list<map<int,int>>, MySnippets>::value, "");
+static_assert( is_object_range<list<variant<vector<int>,map<int,int>>>, MySnippets>::value, "");
+static_assert( is_object_range<object_range<vector<int>*>, MySnippets>::value, "");
+static_assert(!is_object_range<vector<vector<int>>, MySnippets>::value, "");   // Bound as a vector
+static_assert(!is_object_range<list<char>, MySnippets>::value, "");
+
 
 // Function object requirements
 
@@ -80,8 +156,1054 @@ struct Snippet
 template <> struct binds_to<int> { using type = variant<Snippet>; };
 using RequirementsTestTypes = std::tuple<int>;
 
+struct Reading { std::string text; };
+
+struct EchoReading
+{
+	void operator()(Process<Python>& python, const Reading& reading) const {
+		python << "iosc_out.write(iosc_in[0].read(" << reading.text.size() << ").encode())\n";
+		python.data_out(0) << reading.text << std::flush;
+	}
+};
+
+template <> struct binds_to<Reading> { using type = variant<EchoReading>; };
+
+// The output a run captured, as text
+std::string text(const RunResult& result)
+{
+	return std::string(reinterpret_cast<const char*>(result.output.data()), result.output.size());
+}
+
+struct Tally { int status; };
+
+// Counts its calls, then exits with the status given
+struct ExitTally
+{
+	static int calls;
+	void operator()(Process<Python>& python, const Tally& tally) const {
+		calls++;
+		python << "import sys\nsys.exit(" << tally.status << ")\n";
+	}
+};
+int ExitTally::calls = 0;
+
+template <> struct binds_to<Tally> { using type = variant<ExitTally>; };
+
+// Producers on several threads: every value arrives once, and each producer's in the order pushed
+void testRing()
+{
+	const unsigned producers = 4;
+	const std::uint64_t count = 100000;
+	mpsc_ring<std::uint64_t> ring(64);
+
+	std::vector<std::thread> threads;
+	for (unsigned t=0; t<producers; t++) {
+		threads.emplace_back([&ring, t, count] {
+			for (std::uint64_t i=0; i<count; i++) {
+				while (!ring.push((std::uint64_t(t) << 32) | i))
+					std::this_thread::yield();
+			}
+		});
+	}
+
+	std::vector<std::uint64_t> next(producers, 0);
+	for (std::uint64_t received = 0; received < producers * count; ) {
+		std::uint64_t v;
+		if (!ring.pop(v)) {
+			std::this_thread::yield();
+			continue;
+		}
+		unsigned t = unsigned(v >> 32);
+		assert(t < producers && (v & 0xffffffff) == next[t]);
+		next[t]++;
+		received++;
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	std::uint64_t v;
+	assert(!ring.pop(v));
+	for (unsigned t=0; t<producers; t++)
+		assert(next[t] == count);
+}
+
+struct Mark { int value; };
+
+// Records the marks run, on the consumer thread
+struct RecordMark
+{
+	static std::vector<int> marks;
+	void operator()(Process<Python>& python, const Mark& mark) const {
+		marks.push_back(mark.value);
+		python << "pass\n";
+	}
+};
+std::vector<int> RecordMark::marks;
+
+template <> struct binds_to<Mark> { using type = variant<RecordMark>; };
+
+// Requests from several threads all run; runLatest runs only the newest of those queued together
+void testAsync()
+{
+	ProcessOptions options;
+	options.output = true;
+	AsyncScript<Python,std::tuple<Reading,Mark>> script(options);
+
+	std::vector<std::string> outputs;    // Appended to on the consumer thread
+	std::vector<std::thread> threads;
+	for (int t=0; t<3; t++) {
+		threads.emplace_back([&script, &outputs, t] {
+			for (int i=0; i<3; i++) {
+				bool queued = script.runThen([&outputs](RunResult&& r) {
+					outputs.emplace_back(reinterpret_cast<const char*>(r.output.data()), r.output.size());
+				}, Reading{std::to_string(t * 3 + i)});
+				assert(queued);
+			}
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+	script.flush();
+
+	// flush() returns once all of them have run
+	std::sort(outputs.begin(), outputs.end());
+	assert((outputs == std::vector<std::string>{"0", "1", "2", "3", "4", "5", "6", "7", "8"}));
+
+	// Hold the consumer up, so the marks are taken together
+	script.runThen([](RunResult&&) { std::this_thread::sleep_for(std::chrono::milliseconds(200)); }, Mark{0});
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	for (int i=1; i<=5; i++)
+		assert(script.runLatest(7, Mark{i}));
+	script.flush();
+
+	assert((RecordMark::marks == std::vector<int>{0, 5}));
+	auto stats = script.stats();
+	assert(stats.enqueued == 15 && stats.executed == 11 && stats.coalesced == 4 && stats.dropped == 0);
+}
+
+// Each object of a range is dispatched to its snippet, in order, and those of variants to their own
+void testRanges()
+{
+	ProcessOptions options;
+	options.output = true;
+	Script<Python,std::tuple<Reading,Mark>> script(options);
+
+	std::vector<Reading> readings{{"a"}, {"b"}, {"c"}};
+	assert(text(script.run(readings)) == "abc");
+	assert(text(script.run(Reading{"<"}, readings, Reading{">"})) == "<abc>");
+	assert(text(script.run(each(readings.begin() + 1, readings.end()))) == "bc");
+
+	RecordMark::marks.clear();
+	std::vector<variant<Reading,Mark>> mixed{Reading{"x"}, Mark{1}, Reading{"y"}, Mark{2}};
+	assert(text(script.run(mixed)) == "xy");
+	assert((RecordMark::marks == std::vector<int>{1, 2}));
+}
+
+// A repeated run is answered from the cache, with the output of the first
+void testMemoize()
+{
+	ProcessOptions options;
+	options.output = true;
+	Script<Python,std::tuple<Reading>> script(options);
+	script.memoize(1 << 20, 2);
+
+	assert(text(script.run(Reading{"first"})) == "first");
+	assert(text(script.run(Reading{"first"})) == "first");
+	assert(text(script.run(Reading{"second"})) == "second");
+	assert(text(script.run(Reading{"third"})) == "third");    // Evicts "first"
+	assert(text(script.run(Reading{"first"})) == "first");
+
+	RunCache::Stats stats = script.memoStats();
+	assert(stats.hits == 1 && stats.misses == 4 && stats.evictions == 2 && stats.entries == 2);
+
+	// A run larger than what's held is sent by calling its snippets again, and cached all the same
+	Script<Python,std::tuple<Reading>> large(options);
+	large.memoize(1 << 20, 2, 1000);
+	const std::string longText(5000, 'x');
+	assert(text(large.run(Reading{longText})) == longText);
+	assert(text(large.run(Reading{longText})) == longText);
+	assert(text(large.run(Reading{"short"})) == "short");
+	assert(large.memoStats().hits == 1 && large.memoStats().misses == 2);
+
+	// The snippets of a run are called once, whether it's then sent or not
+	Script<Python,std::tuple<Tally>> tallies(options);
+	tallies.memoize(1 << 20);
+	tallies.run(Tally{0});
+	tallies.run(Tally{0});
+	assert(ExitTally::calls == 2 && tallies.memoStats().hits == 1);
+
+	// A failed run isn't kept
+	tallies.run(Tally{2});
+	tallies.run(Tally{2});
+	assert(ExitTally::calls == 4 && tallies.memoStats().hits == 1 && tallies.memoStats().entries == 1);
+}
+
+// Each pass over a lazy series produces it again from the start
+void testLazySeries()
+{
+	auto squares = generate<long>(1000, [](std::size_t i) { return long(i * i); }, 64);
+	long sum = 0;
+	for (long v : squares)
+		sum += v;
+	assert(sum == 332833500);
+
+	std::size_t chunks = 0, count = 0;
+	squares.forEachChunk([&](const long*, std::size_t n) { chunks++; count += n; });
+	assert(chunks == 16 && count == 1000);
+
+	std::list<int> values = {1, 2, 3};
+	auto doubled = lazy_range<double>(values.begin(), values.end());
+	assert(!doubled.sized() && doubled.size() == 3 && doubled.size() == 3);
+}
+
+struct Setting
+{
+	std::string name;
+	int value;
+	void operator()(Process<Python>& python) const { python << name << " = " << value << "\n"; }
+	std::string headerKey() const { return name; }
+};
+
+struct Note
+{
+	const char* text;
+	void operator()(Process<Python>& python) const { python << "# " << text << "\n"; }
+};
+
+// Never replaced in a header
+struct Remark : Note
+{
+	std::string headerKey() const { return ""; }
+};
+
+// Snippets sharing one definition, which counts the times it's run
+struct Counted
+{
+	static const char* definition() { return "iosc_defined = globals().get('iosc_defined', 0) + 1\n"; }
+	void operator()(Process<Python>& python) const { python << "iosc_out.write(b'%d' % iosc_defined)\n"; }
+};
+
+struct CountedA : Counted {};
+struct CountedB : Counted {};
+
+// The Python header needs nothing beyond the standard library: numpy only once a value is read
+void testWithoutNumpy()
+{
+	char dir[] = "/tmp/ioscript_test_XXXXXX";
+	assert(mkdtemp(dir));
+	std::string module = std::string(dir) + "/numpy.py";
+	std::ofstream(module) << "raise ImportError('no numpy here')\n";
+	const char* path = getenv("PYTHONPATH");
+	std::string saved = path ? path : "";
+	setenv("PYTHONPATH", dir, 1);
+	{
+		ProcessOptions options;
+		options.output = true;
+		Script<Python,std::tuple<Reading>> script(options);
+		RunResult r = script.run(Reading{"plain"});
+		assert(std::string(reinterpret_cast<const char*>(r.output.data()), r.output.size()) == "plain");
+	}
+	if (path)
+		setenv("PYTHONPATH", saved.c_str(), 1);
+	else
+		unsetenv("PYTHONPATH");
+	unlink(module.c_str());
+	rmdir(dir);
+}
+
+struct Blobs { std::string path; std::string a, b; };
+
+// Appends what arrives on channels 0 and 1 to a file, so that a replay can be checked too
+struct SaveBlobs
+{
+	void operator()(Process<Python>& python, const Blobs& blobs) const {
+		python << "with open('" << blobs.path << "', 'ab') as f:\n"
+		          "    f.write(iosc_in[0].buffer.read(" << blobs.a.size() << "))\n"
+		          "    f.write(iosc_in[1].buffer.read(" << blobs.b.size() << "))\n";
+		python.data_out(0) << blobs.a << std::flush;
+		python.data_out(1) << blobs.b << std::flush;
+	}
+};
+
+template <> struct binds_to<Blobs> { using type = variant<SaveBlobs>; };
+
+std::string readFile(const std::string& path)
+{
+	std::ifstream in(path, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// A runtime whose command is only known from a bundle, as in ioscript_replay
+struct Recorded { static const char* cmd; };
+const char* Recorded::cmd = "";
+
+// A recorded run holds the bytes sent on each channel, and replaying it sends them again.  A truncated
+// or corrupt bundle ends the reading, without asking for memory its lengths claim.
+void testRecordReplay()
+{
+	std::string base = "/tmp/ioscript_test_" + std::to_string(getpid());
+	std::string bundle = base + ".bundle", saved = base + ".saved";
+	Blobs blobs{saved, std::string(3000, 'a') + "end", "second channel"};
+	{
+		Script<Python,std::tuple<Blobs>> script;
+		assert(script.record(bundle));
+		script.run(blobs);
+	}
+	assert(readFile(saved) == blobs.a + blobs.b);
+
+	std::vector<std::string> channels;
+	{
+		BundleReader reader(bundle);
+		BundleReader::Run run;
+		assert(reader.nextRun(run) && run.cmd == Python::cmd && run.layout.size() == NUM_OPEN_CHANNELS);
+		BundleReader::Event ev;
+		while (reader.nextEvent(ev)) {
+			if (ev.kind != Recorder::Data)
+				continue;
+			if (channels.size() <= ev.stream)
+				channels.resize(ev.stream + 1);
+			channels[ev.stream] += ev.bytes;
+		}
+		assert(!reader.nextRun(run));
+	}
+	assert(channels.size() == 2 && channels[0] == blobs.a && channels[1] == blobs.b);
+
+	unlink(saved.c_str());
+	assert(replay<Python>(bundle) == 1);
+	assert(readFile(saved) == blobs.a + blobs.b);
+
+	auto events = [](const std::string& path) {
+		BundleReader reader(path);
+		BundleReader::Run run;
+		BundleReader::Event ev;
+		unsigned count = 0;
+		while (reader.nextRun(run))
+			for (count++; reader.nextEvent(ev); count++) {}
+		return count;
+	};
+	std::string bytes = readFile(bundle), broken = base + ".broken";
+	auto write = [&broken](const std::string& content) { std::ofstream(broken, std::ios::binary) << content; };
+
+	write(bytes.substr(0, bytes.size() - 5));
+	assert(events(broken) > 0);
+
+	// The length of the first record, and then the channel count of the run it describes
+	std::string corrupt = bytes;
+	std::uint64_t huge = std::uint64_t(1) << 60;
+	std::memcpy(&corrupt[8 + 13], &huge, sizeof(huge));
+	write(corrupt);
+	assert(events(broken) == 0);
+
+	corrupt = bytes;
+	std::uint32_t channelCount = 0xffffffff;
+	std::memcpy(&corrupt[8 + 21 + std::strlen(Python::cmd) + 1], &channelCount, sizeof(channelCount));
+	write(corrupt);
+	assert(events(broken) == 0);
+
+	// An incremental run is recorded with the bootstrap that reads its frames, so ioscript_replay can run it
+	unlink(saved.c_str());
+	{
+		ProcessOptions options;
+		options.incremental = true;
+		Script<Python,std::tuple<Blobs>> script(options);
+		assert(script.record(bundle));
+		script.run(blobs);
+	}
+	unlink(saved.c_str());
+	{
+		BundleReader reader(bundle);
+		BundleReader::Run run;
+		assert(reader.nextRun(run) && run.incremental && run.cmd == incremental_cmd<Python>::cmd());
+		Recorded::cmd = run.cmd.c_str();
+		replayRun<Recorded>(reader, run);
+	}
+	assert(readFile(saved) == blobs.a + blobs.b);
+
+	unlink(broken.c_str());
+	unlink(bundle.c_str());
+	unlink(saved.c_str());
+}
+
+struct Interleaved { unsigned channels; unsigned rounds; };
+
+// 1000 bytes, tagged with the channel and round
+std::string interleavedPiece(unsigned c, unsigned r)
+{
+	char tag[8];
+	std::snprintf(tag, sizeof(tag), "%02u:%02u|", c, r);
+	return tag + std::string(994, char('a' + (c + r) % 26));
+}
+
+// Writes a piece to every channel in turn, a frame each, and has Python read the channels last first
+struct ReadInterleaved
+{
+	void operator()(Process<Python>& python, const Interleaved& x) const {
+		std::size_t bytes = x.rounds * interleavedPiece(0, 0).size();
+		python << "parts = {}\n"
+		          "for c in reversed(range(" << x.channels << ")):\n"
+		          "    parts[c] = iosc_in[c].read_bytes(" << bytes << ")\n"
+		          "iosc_out.write(b''.join(parts[c] for c in range(" << x.channels << ")))\n";
+		for (unsigned r=0; r<x.rounds; r++)
+			for (unsigned c=0; c<x.channels; c++)
+				python.data_out(c) << interleavedPiece(c, r) << std::flush;
+	}
+};
+
+template <> struct binds_to<Interleaved> { using type = variant<ReadInterleaved>; };
+
+// More channels than are opened by default share the one pipe, their frames interleaved
+void testMultiplexed()
+{
+	ProcessOptions options;
+	options.output = true;
+	options.multiplexed = true;
+	options.incremental = true;
+	Script<Python,std::tuple<Interleaved>> script(options);
+
+	Interleaved x{24, 4};
+	RunResult r = script.run(x);
+	std::string expected;
+	for (unsigned c=0; c<x.channels; c++)
+		for (unsigned k=0; k<x.rounds; k++)
+			expected += interleavedPiece(c, k);
+	assert(std::string(reinterpret_cast<const char*>(r.output.data()), r.output.size()) == expected);
+}
+
+// A ticket is done once the subprocess has read up to it: channel 1 gates each read of channel 0.
+// A page-aligned buffer is handed over in place; any other is copied, and its ticket is done at once.
+void testSendTicket()
+{
+	const std::size_t n = 1 << 16;
+	void* aligned = nullptr;
+	assert(posix_memalign(&aligned, 4096, n + 4096) == 0);
+	char* buffer = static_cast<char*>(aligned);
+	for (std::size_t i=0; i<n + 4096; i++)
+		buffer[i] = char(i * 7);
+
+	ProcessOptions options;
+	options.output = true;
+	options.incremental = true;
+	Process<Python> python(2, options);
+	PythonHeader{}(python);
+	python << "gate, data = iosc_in[1].buffer, iosc_in[0].buffer\n"
+	          "for _ in range(2):\n"
+	          "    gate.read(1)\n"
+	          "    iosc_out.write(data.read(" << n << "))\n";
+
+	send_ticket inPlace = python.send(0, buffer, n);
+#ifdef __linux__
+	assert(!inPlace.done());
+#endif
+	python.data_out(1) << 'g' << std::flush;
+	inPlace.wait();
+	assert(inPlace.done());
+
+	send_ticket copied = python.send(0, buffer + 1, n);
+	send_ticket sent = python.sent(0);
+	assert(copied.done() && !sent.done());
+	python.data_out(1) << 'g' << std::flush;
+	sent.wait();
+
+	python.wait();
+	std::string expected = std::string(buffer, n) + std::string(buffer + 1, n);
+	auto& out = python.output();
+	assert(std::string(reinterpret_cast<const char*>(out.data()), out.size()) == expected);
+	free(aligned);
+}
+
+// A buffer striped over several channels, in chunks that don't divide it, is reassembled byte for byte,
+// whether each channel has a pipe or they share one
+void testStriped(bool multiplexed)
+{
+	const std::size_t n = 100003, chunk = 4096;
+	const unsigned k = 3;
+	std::vector<char> buffer(n);
+	for (std::size_t i=0; i<n; i++)
+		buffer[i] = char(i * 7 + (i >> 12));
+
+	ProcessOptions options;
+	options.output = true;
+	options.incremental = true;
+	options.multiplexed = multiplexed;
+	Process<Python> python(1 + k, options);
+	PythonHeader{}(python);
+	python << "buf = iosc_recv_striped(1, " << k << ", " << n << ", " << chunk << ")\n"
+	          "bad = [i for i in range(" << n << ") if buf[i] != (i * 7 + (i >> 12)) & 255]\n"
+	          "iosc_out.write(b'%d %d' % (len(buf), bad[0] if bad else -1))\n";
+	python.send_striped(1, k, buffer.data(), n, chunk);
+	python.wait();
+
+	auto& out = python.output();
+	assert(std::string(reinterpret_cast<const char*>(out.data()), out.size()) == std::to_string(n) + " -1");
+}
+
+// A header entry is replaced by the next of its type or key, which goes last, and an empty key never replaces
+void testHeader()
+{
+	Script<Python,std::tuple<Reading>> script;
+	const std::size_t entries = script.headerEntries();
+	const std::string before = script.headerCode();
+
+	script.addToHeader(Setting{"a", 1}, Note{"one"}, Setting{"b", 2});
+	script.addToHeader(Setting{"a", 3}, Note{"two"});
+	assert(script.headerEntries() == entries + 3);
+	assert(script.headerCode() == before + "b = 2\na = 3\n# two\n");
+
+	script.addToHeader(Setting{"b", 2}, Remark{"x"}, Remark{"x"});
+	assert(script.headerCode() == before + "a = 3\n# two\nb = 2\n# x\n# x\n");
+
+	script.setHeader("b", Note{"three"});
+	assert(script.headerCode() == before + "a = 3\n# two\n# x\n# x\n# three\n");
+	script.removeFromHeader("a");
+	assert(script.headerEntries() == entries + 4 && script.headerCode() == before + "# two\n# x\n# x\n# three\n");
+}
+
+// A definition is sent once per run, however many snippets share it, and not at all once in the header
+void testDefinition()
+{
+	ProcessOptions options;
+	options.output = true;
+	Script<Python,std::tuple<Reading>> script(options);
+	assert(text(script.run(CountedA{}, CountedB{}, CountedA{})) == "111");
+
+	script.addToHeader(CountedA{});
+	assert(script.headerCode().find(Counted::definition()) == script.headerCode().rfind(Counted::definition()));
+	assert(text(script.run(CountedB{}, CountedA{})) == "111");
+
+	// It outlives the header entry it came with
+	Script<Python,std::tuple<Reading>> keyed(options);
+	keyed.setHeader("counted", CountedA{});
+	keyed.addToHeader(CountedB{});
+	keyed.removeFromHeader("counted");
+	assert(text(keyed.run(CountedA{})) == "11");
+}
+
+// NaNs are passed over by min/max decimation, and a bucket of nothing else keeps one for the gap
+template <typename T>
+void testDecimateNaN()
+{
+	const T nan = std::numeric_limits<T>::quiet_NaN();
+	std::vector<T> y(1000);
+	for (std::size_t i=0; i<y.size(); i++)
+		y[i] = T(i % 100);
+	for (std::size_t i=0; i<y.size(); i += 7)
+		y[i] = nan;
+	std::fill(y.begin() + 300, y.begin() + 400, nan);
+	y[100] = nan;
+	y[250] = T(-5);
+
+	sampled_series<T> out;
+	decimate_minmax(y.data(), y.size(), 10, out);
+	assert(out.size() == 19);
+	for (std::size_t k=0; k<out.size(); k++) {
+		std::size_t b = out.x[k] / 100;
+		if (b == 3) {
+			assert(out.x[k] == 300 && std::isnan(out.y[k]));
+			continue;
+		}
+		// The pair of the bucket, in order: its smallest and largest numbers
+		T lo = std::numeric_limits<T>::infinity(), hi = -lo;
+		for (std::size_t i=b*100; i<b*100+100; i++) {
+			if (!std::isnan(y[i])) {
+				lo = std::min(lo, y[i]);
+				hi = std::max(hi, y[i]);
+			}
+		}
+		assert(k + 1 < out.size() && out.x[k + 1] / 100 == b && out.x[k] < out.x[k + 1]);
+		assert(std::min(out.y[k], out.y[k + 1]) == lo && std::max(out.y[k], out.y[k + 1]) == hi);
+		assert(out.y[k] == y[out.x[k]] && out.y[k + 1] == y[out.x[k + 1]]);
+		k++;
+	}
+}
+
+// A run served by a pool interpreter sees the preload, and returns its output as a local one would
+void testServer()
+{
+	std::string path = "/tmp/ioscript_test_" + std::to_string(getpid()) + ".sock";
+	ServerOptions serverOptions;
+	serverOptions.pool = 1;
+	serverOptions.preload = "greeting = 'served '\n";
+	InterpreterServer<Python> server(path, serverOptions);
+	server.start();
+
+	ProcessOptions options;
+	options.output = true;
+	options.server = path;
+	{
+		Script<Python,std::tuple<Reading>> script(options);
+		RunResult r = script.run(Reading{"reading"});
+		assert(std::string(reinterpret_cast<const char*>(r.output.data()), r.output.size()) == "reading");
+		assert(r.usage.measured && r.usage.exitCode == 0 && r.usage.maxRssKb > 0);
+	}
+	{
+		Process<Python> python(0, options);
+		python << "import os\nos.write(" << python.fd_out() << ", greeting.encode())\n";
+		python.wait();
+		auto& out = python.output();
+		assert(std::string(reinterpret_cast<const char*>(out.data()), out.size()) == "served ");
+	}
+	{
+		// More data than a pipe holds, sent before the code ends: it's read as it arrives
+		options.incremental = true;
+		Process<Python> python(1, options);
+		python << "import os\nn = 0\nwhile n < 1 << 20: n += len(os.read(" << python.fd_r(0) << ", 1 << 16))\n";
+		python.data_out(0) << std::string(1 << 20, 'x') << std::flush;
+		python << "os.write(" << python.fd_out() << ", b'%d' % n)\n";
+		python.wait();
+		auto& out = python.output();
+		assert(std::string(reinterpret_cast<const char*>(out.data()), out.size()) == "1048576");
+	}
+}
+
+struct Pause {
+	void operator()(Process<Python>& python) const { python << "import time\ntime.sleep(0.05)\n"; }
+};
+
+// Each snippet type's share of a run, as the interpreter timed it
+void testTiming()
+{
+	ProcessOptions options;
+	options.output = true;
+	options.timing = true;
+	Script<Python,std::tuple<Reading>> script(options);
+
+	RunResult r = script.run(Reading{"a"}, Pause{}, Reading{"b"});
+	assert(r.timings.size() == 2);
+	SnippetTiming echo = r.timings[0];
+	SnippetTiming pause = r.timings[1];
+	assert(echo.snippet.find("EchoReading") != std::string::npos && echo.count == 2);
+	assert(pause.snippet.find("Pause") != std::string::npos && pause.count == 1);
+	assert(pause.totalNs >= 50000000 && pause.maxNs == pause.totalNs && echo.maxNs <= echo.totalNs);
+
+	// Ids are kept from run to run
+	r = script.run(Pause{});
+	assert(r.timings.size() == 1 && r.timings[0].snippet == pause.snippet);
+}
+
+struct Spin {
+	void operator()(Process<Python>& python) const {
+		python << "import time\nt = time.process_time()\nwhile time.process_time() - t < 0.05: pass\n";
+	}
+};
+
+struct Exit3 {
+	void operator()(Process<Python>& python) const { python << "import sys\nsys.exit(3)\n"; }
+};
+
+// What each run's subprocess consumed, and the sums by the snippet types each run used
+void testUsage()
+{
+	ProcessOptions options;
+	options.output = true;
+	Script<Python,std::tuple<Reading>> script(options);
+
+	RunResult r = script.run(Reading{"a"}, Spin{});
+	assert(r.usage.measured && r.usage.userSeconds + r.usage.systemSeconds >= 0.05 && r.usage.maxRssKb > 0);
+	script.run(Spin{}, Reading{"b"});
+	r = script.run(Exit3{});
+	assert(r.usage.exitCode == 3 && r.usage.signal == 0);
+
+	const std::vector<SnippetUsage>& usage = script.usage();
+	assert(usage.size() == 2 && usage[0].runs == 2 && usage[0].failed == 0 && usage[0].measured == 2);
+	assert(usage[0].snippets.find("EchoReading + ") != std::string::npos || usage[0].snippets.find(" + EchoReading") != std::string::npos);
+	assert(usage[0].userSeconds + usage[0].systemSeconds >= 0.1);
+	assert(usage[1].snippets.find("Exit3") != std::string::npos && usage[1].runs == 1 && usage[1].failed == 1);
+}
+
+// The kernels agree with counting one value at a time, on one thread or several
+void testAggregate()
+{
+	std::vector<double> values;
+	for (int i=0; i<10000; i++)
+		values.push_back((i * 7919 % 10007) / 1000.0 - 1);    // -1 to 9.006
+	values.push_back(std::nan(""));
+
+	for (unsigned threads : {1u, 3u}) {
+		histogram h;
+		histogram_1d(values.data(), values.size(), 8, 0, 8, h, threads);
+		std::vector<std::uint64_t> counts(8);
+		std::uint64_t below = 1, above = 0;
+		for (int i=0; i<10000; i++) {
+			double v = values[i];
+			(v < 0 ? below : v >= 8 ? above : counts[int(v)])++;
+		}
+		assert(h.counts == counts && h.below == below && h.above == above && h.width() == 1);
+
+		std::vector<float> floats(values.begin(), values.end() - 1);
+		histogram_1d(floats.data(), floats.size(), 10, 0, 0, h, threads);
+		assert(h.lo == -1 && h.above == 0 && h.counts[9] != 0);
+		std::uint64_t total = 0;
+		for (auto count : h.counts)
+			total += count;
+		assert(total == 10000);
+	}
+
+	// A range from the data is that of its finite values, or [0, 1) with everything below it
+	const double inf = std::numeric_limits<double>::infinity();
+	std::vector<double> nonFinite = {std::nan(""), inf, -inf, std::nan("")};
+	histogram h;
+	histogram_1d(nonFinite.data(), nonFinite.size(), 4, 0, 0, h);
+	assert(h.lo == 0 && h.hi == 1 && h.below == 4 && h.above == 0 && h.counts == std::vector<std::uint64_t>(4));
+	nonFinite.push_back(2);
+	nonFinite.push_back(6);
+	histogram_1d(nonFinite.data(), nonFinite.size(), 4, 0, 0, h);
+	assert(h.lo == 2 && h.hi == 6 && h.below == 3 && h.counts[0] == 1 && h.counts[3] == 2);
+	histogram2d edges;
+	histogram_2d(nonFinite.data(), nonFinite.data(), 4, 2, 2, 0, 0, 0, 0, edges);
+	assert(edges.xlo == 0 && edges.yhi == 1 && edges.outside == 4);
+
+	std::vector<std::pair<int,double>> points;
+	for (int i=0; i<100; i++)
+		points.push_back({i % 10, i / 10 + 0.5});
+	histogram2d grid;
+	histogram_2d(&points[0].first, &points[0].second, points.size(), 5, 2, 0, 10, 0, 10, grid, 2,
+	             sizeof(points[0]), sizeof(points[0]));
+	assert(grid.size() == 2 && grid[0].size() == 5 && grid[0][0] == 10 && grid[1][4] == 10 && grid.outside == 0);
+
+	bin_stats<double> stats;
+	bucket_stats(values.data(), 10000, 4, stats, 2);
+	assert(stats.count[0] == 2500 && stats.min[3] >= -1 && stats.max[3] <= 9.006);
+	binned_stats(&points[0].first, &points[0].second, points.size(), 2, 0, 10, stats, 3,
+	             sizeof(points[0]), sizeof(points[0]));
+	assert(stats.count[0] == 50 && stats.mean[0] == 5 && stats.min[1] == 0.5 && stats.max[1] == 9.5);
+}
+
+struct GridShape
+{
+	void operator()(Process<Python>& python, const grid_view<double>& grid) const {
+		python << "a = iosc_read(0)\n"
+		          "iosc_out.write(('%d %d %g %g' % (a.shape + (a[0][0], a[-1][-1]))).encode())\n";
+		serialize(python, 0, grid);
+	}
+};
+
+template <> struct binds_to<grid_view<double>> { using type = variant<GridShape>; };
+
+// Views index the parent's storage, and are sent from it with their shape
+void testViews()
+{
+	std::vector<double> storage(6 * 8);
+	for (std::size_t i=0; i<storage.size(); i++)
+		storage[i] = double(i);
+
+	grid_view<double> grid = view(storage, 6, 8);
+	grid_view<double> window = grid.window(1, 2, 3, 4);
+	assert(window(0, 0) == 10 && window[2][3] == 29 && window.size() == 3 && window[0].size() == 4);
+	assert(window.transposed()(3, 2) == 29 && !window.transposed().rowsContiguous());
+	assert(grid.column(7).size() == 6 && grid.column(7)[5] == 47 && grid.every(2, 3)(2, 2) == 38);
+
+	strided_view<double> column = grid.column(1);
+	assert(std::accumulate(column.begin(), column.end(), 0.0) == 6 + 8 * 15);
+	assert(column.reversed()[0] == 41 && view(storage, 5).size() == 10 && view(storage, 5)[9] == 45);
+
+	ProcessOptions options;
+	options.output = true;
+	Script<Python,std::tuple<grid_view<double>>> script(options);
+	assert(text(script.run(window)) == "3 4 10 29");
+	assert(text(script.run(window.transposed())) == "4 3 10 29");
+
+	// A strided column longer than the gather buffer goes through it in pieces
+	std::vector<double> tall(30000 * 3);
+	std::iota(tall.begin(), tall.end(), 0.0);
+	strided_view<double> middle = view(tall, 30000, 3).column(1);
+	shared_payload sent = payload(middle);
+	std::vector<char> bytes = sent.bytes();
+	assert(bytes.size() == sent.schemaBytes() + middle.size() * sizeof(double));
+	for (std::size_t i=0; i<middle.size(); i++) {
+		double v;
+		std::memcpy(&v, bytes.data() + sent.schemaBytes() + i * sizeof(double), sizeof(double));
+		assert(v == middle[i]);
+	}
+}
+
+struct DecodeBack
+{
+	template <typename T>
+	void operator()(Process<Python>& python, const encoded_series<T>& series) const {
+		python << "iosc_out.write(iosc_read(0).astype('=f8').tobytes())" << std::endl;
+		serialize(python, 0, series);
+	}
+};
+
+template <> struct binds_to<encoded_series<double>>    { using type = variant<DecodeBack>; };
+template <> struct binds_to<encoded_series<long long>> { using type = variant<DecodeBack>; };
+
+// Each encoding decodes in Python to within its error bound
+void testEncodings()
+{
+	std::vector<double> y(10000);
+	std::vector<long long> t(y.size());
+	for (std::size_t i=0; i<y.size(); i++) {
+		y[i] = 1000 * std::sin(i * 0.01) + (i % 7) * 1e-5;
+		t[i] = 1700000000000LL + 3 * i + i % 2;
+	}
+	assert(simd::float_to_half(1.0f) == 0x3c00 && simd::float_to_half(65520.0f) == 0x7c00);
+	assert(simd::float_to_half(5.96e-8f) == 0x0001 && simd::float_to_bfloat16(-2.0f) == 0xc000);
+
+	ProcessOptions options;
+	options.output = true;
+	options.incremental = true;     // Reads the data as it arrives rather than after the end of the code
+	Script<Python,std::tuple<encoded_series<double>,encoded_series<long long>>> script(options);
+
+	auto maxDifference = [&](const auto& series, const auto& values) {
+		std::vector<byte> bytes = script.run(series).output;
+		assert(bytes.size() == values.size() * sizeof(double));
+		double diff = 0;
+		for (std::size_t i=0; i<values.size(); i++) {
+			double v;
+			std::memcpy(&v, bytes.data() + i * sizeof(double), sizeof(double));
+			diff = std::max(diff, std::abs(v - double(values[i])));
+		}
+		return diff;
+	};
+	for (Encoding e : {Encoding::float16(), Encoding::bfloat16(), Encoding::quantized(12), Encoding::quantized(20, -1e3, 1e3)}) {
+		double bound = encode(y, e).maxError();
+		assert(bound < 4 && maxDifference(encode(y, e), y) <= bound);
+	}
+	assert(encode(y, Encoding::quantized(8, -1, 1)).maxError() == std::numeric_limits<double>::infinity());
+	assert(maxDifference(encode(t, Encoding::delta()), t) == 0);
+
+	// Quantized integers decode to the nearest integer
+	std::vector<long long> counts(1001);
+	std::iota(counts.begin(), counts.end(), 0);
+	assert(encode(counts, Encoding::quantized(8)).maxError() == 2);
+	assert(maxDifference(encode(counts, Encoding::quantized(8)), counts) <= 2);
+	assert(encode(counts, Encoding::quantized(12)).maxError() == 0);
+	assert(maxDifference(encode(counts, Encoding::quantized(12)), counts) == 0);
+}
+
+// A long-lived interpreter patches its copy with the chunks that changed, counted here per frame
+void testDeltaFrames()
+{
+	ProcessOptions options;
+	options.output = true;
+	options.incremental = true;
+	Process<Python> python(2, options);
+	PythonHeader{}(python);
+	python << "_iosc_whole = _iosc_patch\n"
+	          "def _iosc_patch(frame, *args):\n"
+	          "    iosc_out.write(frame[3].encode() + b' ')\n"
+	          "    return _iosc_whole(frame, *args)\n";
+	python.commit();
+
+	DeltaFrames frames(1024);
+	python.deltaFrames(&frames);
+	std::vector<double> values(100000, 1.0);
+	for (int frame=0; frame<4; frame++) {
+		values[frame * 1000] += 1;
+		python << "a = iosc_read(0)\n"
+		          "iosc_out.write(b'%g, ' % a.sum())\n";
+		serialize(python, 0, delta("values", values));
+		python.commit();
+	}
+	values.assign(10, 1.0);     // A new size is sent whole
+	python << "iosc_out.write(b'%g' % iosc_read(0).sum())\n";
+	serialize(python, 0, delta("values", values));
+	python.wait();
+
+	std::string text(reinterpret_cast<const char*>(python.output().data()), python.output().size());
+	assert(text == "-1 100001, 1 100002, 1 100003, 1 100004, -1 10");
+	assert(frames.size() == 1 && frames.entry("values").generation == 5);
+}
+
+struct FileSum
+{
+	void operator()(Process<Python>& python, const mapped_file<float>& file) const {
+		python << "a = iosc_read(0)\n"
+		          "iosc_out.write(b'%s %d %g|' % (type(a).__name__.encode(), len(a), a.sum()))" << std::endl;
+		serialize(python, 0, file);
+	}
+};
+
+template <> struct binds_to<mapped_file<float>> { using type = variant<FileSum>; };
+
+// The interpreter maps the file itself, by its path or its descriptor's
+void testMappedFile()
+{
+	char path[] = "/tmp/ioscript_test_XXXXXX";
+	int fd = mkstemp(path);
+	std::vector<float> values(100000);
+	for (std::size_t i=0; i<values.size(); i++)
+		values[i] = float(i % 10);
+	assert(write(fd, values.data(), values.size() * sizeof(float)) == ssize_t(values.size() * sizeof(float)));
+
+	ProcessOptions options;
+	options.output = true;
+	options.incremental = true;
+	Script<Python,std::tuple<mapped_file<float>>> script(options);
+	assert(text(script.run(mapped_file<float>(path), mapped_file<float>(path, 4, 10))) == "memmap 100000 450000|memmap 10 45|");
+
+	// A relative path is made absolute, for an interpreter in another directory
+	std::string relative = "ioscript_test_" + std::to_string(getpid()) + ".f32";
+	std::ofstream(relative, std::ios::binary).write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(float));
+	mapped_file<float> named(relative);
+	assert(named.path()[0] == '/' && named.path().size() > relative.size() && text(script.run(named)) == "memmap 100000 450000|");
+	unlink(relative.c_str());
+	unlink(path);
+#ifdef __linux__
+	assert(text(script.run(mapped_file<float>(fd, 8, 5))) == "memmap 5 20|");
+#endif
+	assert(!mapped_file<float>(path).good());
+	close(fd);
+}
+
+struct SharedSum
+{
+	void operator()(Process<Python>& python, const shared<lazy_series<double>>& series) const {
+		python << "iosc_out.write(b'%g|' % iosc_read(0).sum())" << std::endl;
+		serialize(python, 0, series);
+	}
+};
+
+template <> struct binds_to<shared<lazy_series<double>>> { using type = variant<SharedSum>; };
+
+// A shared object is serialized once, however many runs and Processes it's sent to
+void testFanOut()
+{
+	int calls = 0;
+	shared<lazy_series<double>> series(generate<double>(100000, [&](std::size_t i) { calls++; return double(i % 4); }));
+
+	ProcessOptions options;
+	options.output = true;
+	options.incremental = true;
+	Script<Python,std::tuple<shared<lazy_series<double>>>> first(options), second(options);
+	assert(text(first.run(series)) == "150000|");
+	assert(text(second.run(series, series)) == "150000|150000|");
+	assert(calls == 100000 && series.payload().size() == series.payload().schemaBytes() + 800000);
+
+	Process<Python> a(1, options), b(1, options);
+	for (Process<Python>* python : {&a, &b}) {
+		PythonHeader{}(*python);
+		*python << "iosc_out.write(b'%d' % len(iosc_read(0)))" << std::endl;
+		python->commit();
+	}
+	assert(fan_out(series.payload(), 0, a, b));
+	a.wait();
+	b.wait();
+	assert(std::string(reinterpret_cast<const char*>(b.output().data()), b.output().size()) == "100000");
+	assert(calls == 100000);
+}
+
+#ifdef WITH_EMBEDDED_PYTHON
+
+struct Rows { std::vector<double> values; };
+
+// Written for any Process, so it runs embedded or not
+struct RowSum
+{
+	template <typename P>
+	void operator()(Process<P>& python, const Rows& rows) const {
+		python << "a = iosc_read(0)\n"
+		          "b = iosc_in[1].buffer.read(" << rows.values.size() * sizeof(double) << ")\n"
+		          "iosc_out.write(b'%d %g %g %s' % (len(a), a.sum(), sum(memoryview(b).cast('d')), iosc_in[2].readline().encode()))\n";
+		serialize(python, 0, rows.values);
+		python.send(1, rows.values.data(), rows.values.size() * sizeof(double));
+		python.data_out(2) << "done" << std::endl;
+	}
+};
+
+template <> struct binds_to<Rows> { using type = variant<RowSum>; };
+
+struct Statement
+{
+	const char* code;
+	template <typename P>
+	void operator()(Process<P>& python) const { python << code; }
+};
+
+// Code runs in this process, with fresh globals each run, and the data of send() is read in place
+void testEmbedded()
+{
+	ProcessOptions options;
+	options.output = true;
+	Script<EmbeddedPython,std::tuple<Rows>> script(options);
+
+	Rows rows{std::vector<double>(1000, 0.25)};
+	assert(text(script.run(rows)) == "1000 250 250 done\n");
+	assert(text(script.run(rows, Statement{"iosc_out.write(str('a' in globals()).encode())\n"})) == "1000 250 250 done\nTrue");
+	assert(text(script.run(Statement{"iosc_out.write(str('a' in globals()).encode())\n"})) == "False");
+
+	Process<EmbeddedPython> python(1);
+	python << "import sys\nsys.exit(3)\n";
+	python.wait();
+	assert(python.status() == 3);
+}
+
+#endif
+
+// Check the launch policy reached the subprocess, through /proc
+void testLaunchPolicy()
+{
+#ifdef __linux__
+	cpu_set_t ours;
+	sched_getaffinity(0, sizeof(ours), &ours);
+	int cpu = 0;
+	while (!CPU_ISSET(cpu, &ours))
+		cpu++;
+
+	auto policy = std::make_shared<LaunchPolicy>();
+	policy->cpus = { cpu };
+	policy->scheduler = LaunchPolicy::Idle;
+	ProcessOptions options;
+	options.launch = policy;
+
+	Process<Null> process(1, options);
+	std::string proc = "/proc/" + std::to_string(process.pid());
+
+	// Wait for the exec, after which the policy has been applied
+	auto comm = [](const std::string& dir) { std::string name; std::ifstream(dir + "/comm") >> name; return name; };
+	for (int i=0; i<1000 && comm(proc) == comm("/proc/self"); i++)
+		usleep(1000);
+
+	std::ifstream status(proc + "/status");
+	std::string line, cpus;
+	while (std::getline(status, line))
+		if (line.compare(0, 18, "Cpus_allowed_list:") == 0)
+			cpus = line.substr(line.find_first_not_of(" \t", 18));
+	assert(cpus == std::to_string(cpu));
+
+	// The scheduling policy is the 41st field, counting from the pid
+	std::ifstream stat(proc + "/stat");
+	std::getline(stat, line);
+	std::istringstream fields(line.substr(line.rfind(')') + 2));
+	std::string field;
+	for (int i=3; i<=41; i++)
+		fields >> field;
+	assert(field == std::to_string(SCHED_IDLE));
+#endif
+}
+
 void testing()
 {
 	Script<Python,RequirementsTestTypes> script;
 	script.run(Snippet{});
+
+	testRing();
+	testAsync();
+	testLaunchPolicy();
+	testRanges();
+	testMemoize();
+	testLazySeries();
+	testStriped(false);
+	testStriped(true);
+	testHeader();
+	testDefinition();
+	testRecordReplay();
+	testMultiplexed();
+	testSendTicket();
+	testWithoutNumpy();
+	testDecimateNaN<double>();
+	testDecimateNaN<float>();
+	testServer();
+	testTiming();
+	testUsage();
+	testAggregate();
+	testViews();
+	testEncodings();
+	testDeltaFrames();
+	testMappedFile();
+	testFanOut();
+#ifdef WITH_EMBEDDED_PYTHON
+	testEmbedded();
+#endif
 }
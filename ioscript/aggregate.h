@@ -0,0 +1,608 @@
+#pragma once
+
+#include "ioscript.h"
+#include "decimate.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+namespace iosc {
+
+/// "aggregate.h" ///
+
+// Aggregation on the C++ side: rather than ship 10^9 samples for the interpreter to bin, reduce them to
+// the few kilobytes that are plotted - fixed-width histograms, 2D density grids for heat maps, and
+// per-bucket count, mean, min and max.  The kernels compute bin indices a block at a time with SIMD,
+// and split large inputs across threads that each count into their own bins.  See `Histogram<Snippet>`,
+// `Density<Snippet>` and `BucketStats<Snippet>` at the end of this file for stages in front of a snippet.
+
+// Counts in `bins` equal bins over [lo, hi).  Values outside the range (including NaN, as below) are
+// counted in `below` and `above`, except that when the range is taken from the data, the largest
+// values are counted in the last bin.
+struct histogram
+{
+    double lo = 0;
+    double hi = 0;
+    std::vector<std::uint64_t> counts;
+    std::uint64_t below = 0;
+    std::uint64_t above = 0;
+
+    std::size_t size() const { return counts.size(); }
+    double width() const { return counts.empty() ? 0 : (hi - lo) / counts.size(); }
+    double edge(std::size_t i) const { return lo + i * width(); }    // The lower edge of bin i
+    const std::uint64_t& operator[](std::size_t i) const { return counts[i]; }
+};
+
+// Counts of (x,y) pairs in `rows` x `cols` bins, stored row major with y along the rows, so that
+// grid[i][j] counts the pairs in y bin i and x bin j (as a 2D array is indexed).  Pairs outside the
+// ranges are counted in `outside`.
+struct histogram2d
+{
+    std::size_t rows = 0;
+    std::size_t cols = 0;
+    double xlo = 0, xhi = 0;
+    double ylo = 0, yhi = 0;
+    std::vector<std::uint64_t> counts;
+    std::uint64_t outside = 0;
+
+    struct row {
+        const std::uint64_t* p;
+        std::size_t n;
+        const std::uint64_t& operator[](std::size_t j) const { return p[j]; }
+        std::size_t size() const { return n; }
+    };
+
+    std::size_t size() const { return rows; }
+    row operator[](std::size_t i) const { return row{counts.data() + i*cols, cols}; }
+    const std::uint64_t& operator()(std::size_t i, std::size_t j) const { return counts[i*cols + j]; }
+};
+
+// Statistics of the values falling in each bin: of equal ranges of keys, or of equal ranges of
+// positions in a series (bucket_stats).  `min` and `max` are T{} for empty bins.
+template <typename T>
+struct bin_stats
+{
+    double lo = 0;
+    double hi = 0;
+    std::vector<std::uint64_t> count;
+    std::vector<double> mean;
+    std::vector<T> min;
+    std::vector<T> max;
+
+    std::size_t size() const { return count.size(); }
+};
+
+
+namespace simd {
+
+// The bin of each value plus one, for `bins` bins of 1/scale from lo: 0 below the range (or NaN),
+// and bins+1 above it
+template <typename T>
+void bin_index(const T* p, std::size_t n, double lo, double scale, std::uint32_t bins, std::uint32_t* idx)
+{
+    for (std::size_t i=0; i<n; i++) {
+        double v = (double(p[i]) - lo) * scale;
+        v = v >= -1 ? (v < bins ? v : double(bins)) : -1;
+        idx[i] = std::uint32_t(v + 1);
+    }
+}
+
+#if defined(__SSE2__)
+
+// Clamped to [-1, bins] (NaN to -1, as max() returns its second operand) then shifted, so that
+// truncation gives the bin plus one
+inline __m128i bin_index2(__m128d v, __m128d lo, __m128d scale, __m128d below, __m128d above, __m128d one)
+{
+    v = _mm_mul_pd(_mm_sub_pd(v, lo), scale);
+    v = _mm_min_pd(_mm_max_pd(v, below), above);
+    return _mm_cvttpd_epi32(_mm_add_pd(v, one));
+}
+
+inline void bin_index(const double* p, std::size_t n, double lo, double scale, std::uint32_t bins, std::uint32_t* idx)
+{
+    const __m128d vlo = _mm_set1_pd(lo);
+    const __m128d vscale = _mm_set1_pd(scale);
+    const __m128d below = _mm_set1_pd(-1.0);
+    const __m128d above = _mm_set1_pd(double(bins));
+    const __m128d one = _mm_set1_pd(1.0);
+    std::size_t i = 0;
+    for (; i+2 <= n; i += 2) {
+        __m128i b = bin_index2(_mm_loadu_pd(p + i), vlo, vscale, below, above, one);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(idx + i), b);
+    }
+    bin_index<double>(p + i, n - i, lo, scale, bins, idx + i);
+}
+
+inline void bin_index(const float* p, std::size_t n, double lo, double scale, std::uint32_t bins, std::uint32_t* idx)
+{
+    // In double precision, so that values near an edge land in the same bin as the scalar version
+    const __m128d vlo = _mm_set1_pd(lo);
+    const __m128d vscale = _mm_set1_pd(scale);
+    const __m128d below = _mm_set1_pd(-1.0);
+    const __m128d above = _mm_set1_pd(double(bins));
+    const __m128d one = _mm_set1_pd(1.0);
+    std::size_t i = 0;
+    for (; i+4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(p + i);
+        __m128i b0 = bin_index2(_mm_cvtps_pd(v), vlo, vscale, below, above, one);
+        __m128i b1 = bin_index2(_mm_cvtps_pd(_mm_movehl_ps(v, v)), vlo, vscale, below, above, one);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(idx + i), _mm_unpacklo_epi64(b0, b1));
+    }
+    bin_index<float>(p + i, n - i, lo, scale, bins, idx + i);
+}
+
+#endif
+
+} // namespace simd
+
+
+namespace detail {
+
+// Elements spaced `stride` bytes apart, such as one member of an array of structs
+template <typename T>
+struct strided
+{
+    const char* p;
+    std::size_t stride;
+
+    strided(const T* p, std::size_t stride = sizeof(T)) : p(reinterpret_cast<const char*>(p)), stride(stride) {}
+
+    const T& operator[](std::size_t i) const { return *reinterpret_cast<const T*>(p + i*stride); }
+
+    // A contiguous block of n elements from i, copied to `buffer` if need be
+    const T* block(std::size_t i, std::size_t n, T* buffer) const
+    {
+        if (stride == sizeof(T))
+            return &(*this)[i];
+        for (std::size_t k=0; k<n; k++)
+            buffer[k] = (*this)[i + k];
+        return buffer;
+    }
+};
+
+constexpr std::size_t block = 1024;
+
+// How many threads to split n elements across: given, or one per core for each 256k elements
+inline unsigned threads_for(std::size_t n, unsigned threads)
+{
+    if (threads == 0) {
+        unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+        threads = unsigned(std::min<std::size_t>(cores, n / (1 << 18) + 1));
+    }
+    return std::max(1u, unsigned(std::min<std::size_t>(threads, n ? n : 1)));
+}
+
+// f(first, last, t) for `threads` equal parts of [0,n), each but the first on a thread of its own
+template <typename F>
+void parallel_parts(std::size_t n, unsigned threads, F f)
+{
+    std::vector<std::thread> workers;
+    for (unsigned t=1; t<threads; t++)
+        workers.emplace_back([&f, n, threads, t] { f(t * n / threads, (t+1) * n / threads, t); });
+    f(0, n / threads, 0);
+    for (auto& worker : workers)
+        worker.join();
+}
+
+// The smallest and largest finite values of p[0,n), or false if there are none
+template <typename T>
+bool finite_minmax(const T* p, std::size_t n, T& lo, T& hi)
+{
+    bool found = false;
+    for (std::size_t i=0; i<n; i++) {
+        if (!std::isfinite(double(p[i])))
+            continue;
+        lo = found ? std::min(lo, p[i]) : p[i];
+        hi = found ? std::max(hi, p[i]) : p[i];
+        found = true;
+    }
+    return found;
+}
+
+// The range of the finite values in the data.  Without any, it's [0,1) and false is returned.
+template <typename T>
+bool find_range(strided<T> data, std::size_t n, unsigned threads, double& lo, double& hi)
+{
+    std::vector<double> los(threads, std::numeric_limits<double>::infinity());
+    std::vector<double> his(threads, -std::numeric_limits<double>::infinity());
+    parallel_parts(n, threads, [&](std::size_t first, std::size_t last, unsigned t) {
+        T buffer[block];
+        for (std::size_t i=first; i<last; i += block) {
+            std::size_t k = std::min(block, last - i);
+            const T* p = data.block(i, k, buffer);
+            T l, h;
+            if (!simd::minmax(p, k, l, h))
+                continue;
+            // Infinities can't bound bins: the rare block with one is scanned again for the rest
+            if ((!std::isfinite(double(l)) || !std::isfinite(double(h))) && !finite_minmax(p, k, l, h))
+                continue;
+            los[t] = std::min(los[t], double(l));
+            his[t] = std::max(his[t], double(h));
+        }
+    });
+    lo = *std::min_element(los.begin(), los.end());
+    hi = *std::max_element(his.begin(), his.end());
+
+    if (!(lo <= hi)) {
+        lo = 0;
+        hi = 1;
+        return false;
+    }
+    // As numpy, a range of one value is widened to a bin either side of it
+    if (!(lo < hi)) {
+        lo -= 0.5;
+        hi += 0.5;
+    }
+    return true;
+}
+
+// Add the bin indices (plus one) of data[first,last) to `counts`, which has bins+2 slots
+template <typename T>
+void count_bins(strided<T> data, std::size_t first, std::size_t last, double lo, double scale,
+                std::uint32_t bins, std::uint64_t* counts)
+{
+    T buffer[block];
+    std::uint32_t idx[block];
+
+    // For few bins, four interleaved sets of counts, so consecutive values in the same bin don't wait
+    // on each other's increment
+    std::size_t slots = bins + 2;
+    std::size_t ways = slots <= 4096 ? 4 : 1;
+    std::vector<std::uint64_t> local(ways * slots);
+
+    for (std::size_t i=first; i<last; i += block) {
+        std::size_t k = std::min(block, last - i);
+        simd::bin_index(data.block(i, k, buffer), k, lo, scale, bins, idx);
+        if (ways == 4) {
+            std::size_t j = 0;
+            for (; j+4 <= k; j += 4) {
+                local[idx[j]]++;
+                local[slots + idx[j+1]]++;
+                local[2*slots + idx[j+2]]++;
+                local[3*slots + idx[j+3]]++;
+            }
+            for (; j<k; j++)
+                local[idx[j]]++;
+        }
+        else {
+            for (std::size_t j=0; j<k; j++)
+                local[idx[j]]++;
+        }
+    }
+    for (std::size_t w=0; w<ways; w++)
+        for (std::size_t s=0; s<slots; s++)
+            counts[s] += local[w*slots + s];
+}
+
+} // namespace detail
+
+
+// Histogram of `bins` equal bins over [lo, hi), or over the range of the data's finite values if
+// lo >= hi.  With no finite value to take a range from, it's [0,1) and every value is counted below it.
+// `threads` 0 picks a number to suit the size of the data.
+template <typename T>
+void histogram_1d(const T* data, std::size_t n, std::size_t bins, double lo, double hi, histogram& out,
+                  unsigned threads = 0, std::size_t stride = sizeof(T))
+{
+    detail::strided<T> series(data, stride);
+    threads = detail::threads_for(n, threads);
+    bool fromData = !(lo < hi);
+    bool counted = !fromData || detail::find_range(series, n, threads, lo, hi);
+
+    bins = std::max<std::size_t>(bins, 1);
+    std::vector<std::vector<std::uint64_t>> parts(threads, std::vector<std::uint64_t>(bins + 2));
+    double scale = bins / (hi - lo);
+    detail::parallel_parts(counted ? n : 0, threads, [&](std::size_t first, std::size_t last, unsigned t) {
+        detail::count_bins(series, first, last, lo, scale, std::uint32_t(bins), parts[t].data());
+    });
+    for (unsigned t=1; t<threads; t++)
+        for (std::size_t s=0; s<bins+2; s++)
+            parts[0][s] += parts[t][s];
+
+    out.lo = lo;
+    out.hi = hi;
+    out.below = parts[0][0] + (counted ? 0 : n);
+    out.above = parts[0][bins+1];
+    out.counts.assign(parts[0].begin() + 1, parts[0].begin() + 1 + bins);
+    if (fromData) {
+        out.counts.back() += out.above;
+        out.above = 0;
+    }
+}
+
+// Density of (x[i], y[i]) over `cols` x `rows` bins.  Ranges with lo >= hi are taken from the data, as
+// histogram_1d takes them; without a finite value to take one from, every point is counted outside.
+// x and y may be members of an array of structs, given the struct's size as the stride.
+template <typename X, typename Y>
+void histogram_2d(const X* x, const Y* y, std::size_t n, std::size_t cols, std::size_t rows,
+                  double xlo, double xhi, double ylo, double yhi, histogram2d& out,
+                  unsigned threads = 0, std::size_t xstride = sizeof(X), std::size_t ystride = sizeof(Y))
+{
+    detail::strided<X> xs(x, xstride);
+    detail::strided<Y> ys(y, ystride);
+    threads = detail::threads_for(n, threads);
+    bool xFromData = !(xlo < xhi), yFromData = !(ylo < yhi);
+    bool xCounted = !xFromData || detail::find_range(xs, n, threads, xlo, xhi);
+    bool yCounted = !yFromData || detail::find_range(ys, n, threads, ylo, yhi);
+    bool counted = xCounted && yCounted;
+
+    cols = std::max<std::size_t>(cols, 1);
+    rows = std::max<std::size_t>(rows, 1);
+    std::uint32_t cbins = std::uint32_t(cols), rbins = std::uint32_t(rows);
+    double xscale = cols / (xhi - xlo), yscale = rows / (yhi - ylo);
+
+    std::vector<std::vector<std::uint64_t>> parts(threads, std::vector<std::uint64_t>(rows * cols + 1));
+    detail::parallel_parts(counted ? n : 0, threads, [&](std::size_t first, std::size_t last, unsigned t) {
+        X xbuffer[detail::block];
+        Y ybuffer[detail::block];
+        std::uint32_t xi[detail::block], yi[detail::block];
+        std::uint64_t* counts = parts[t].data();
+        std::uint64_t& outside = counts[rows * cols];
+
+        for (std::size_t i=first; i<last; i += detail::block) {
+            std::size_t k = std::min(detail::block, last - i);
+            simd::bin_index(xs.block(i, k, xbuffer), k, xlo, xscale, cbins, xi);
+            simd::bin_index(ys.block(i, k, ybuffer), k, ylo, yscale, rbins, yi);
+            for (std::size_t j=0; j<k; j++) {
+                // The largest values of a range taken from the data go in its last bin
+                std::uint32_t c = xi[j], r = yi[j];
+                c -= xFromData && c == cbins + 1;
+                r -= yFromData && r == rbins + 1;
+                if (c - 1 < cbins && r - 1 < rbins)
+                    counts[(r - 1) * cols + (c - 1)]++;
+                else
+                    outside++;
+            }
+        }
+    });
+    for (unsigned t=1; t<threads; t++)
+        for (std::size_t s=0; s<=rows*cols; s++)
+            parts[0][s] += parts[t][s];
+
+    out.rows = rows;
+    out.cols = cols;
+    out.xlo = xlo;
+    out.xhi = xhi;
+    out.ylo = ylo;
+    out.yhi = yhi;
+    out.outside = parts[0][rows * cols] + (counted ? 0 : n);
+    parts[0].pop_back();
+    out.counts = std::move(parts[0]);
+}
+
+// Count, mean, min and max of each of `buckets` equal ranges of positions in the series, as
+// decimate_minmax splits it
+template <typename T>
+void bucket_stats(const T* data, std::size_t n, std::size_t buckets, bin_stats<T>& out, unsigned threads = 0)
+{
+    buckets = std::max<std::size_t>(std::min(buckets, n), 1);
+    out.lo = 0;
+    out.hi = double(n);
+    out.count.assign(buckets, 0);
+    out.mean.assign(buckets, 0);
+    out.min.assign(buckets, T{});
+    out.max.assign(buckets, T{});
+
+    threads = detail::threads_for(n, threads);
+    detail::parallel_parts(buckets, std::min<unsigned>(threads, unsigned(buckets)),
+                           [&](std::size_t firstBucket, std::size_t lastBucket, unsigned) {
+        for (std::size_t b=firstBucket; b<lastBucket; b++) {
+            std::size_t first = b * n / buckets;
+            std::size_t last  = (b+1) * n / buckets;
+            if (first == last)
+                continue;
+            out.count[b] = last - first;
+            out.mean[b] = simd::sum(data + first, last - first) / (last - first);
+            simd::minmax(data + first, last - first, out.min[b], out.max[b]);
+        }
+    });
+}
+
+// Count, mean, min and max of the values whose keys fall in each of `bins` equal bins over [lo, hi)
+// (or the range of the keys' finite values if lo >= hi).  Values with keys outside the range, or all of
+// them if no key is finite, are left out.
+template <typename K, typename T>
+void binned_stats(const K* keys, const T* values, std::size_t n, std::size_t bins, double lo, double hi,
+                  bin_stats<T>& out, unsigned threads = 0,
+                  std::size_t keyStride = sizeof(K), std::size_t valueStride = sizeof(T))
+{
+    detail::strided<K> ks(keys, keyStride);
+    detail::strided<T> vs(values, valueStride);
+    threads = detail::threads_for(n, threads);
+    bool fromData = !(lo < hi);
+    bool counted = !fromData || detail::find_range(ks, n, threads, lo, hi);
+
+    bins = std::max<std::size_t>(bins, 1);
+    double scale = bins / (hi - lo);
+
+    struct Part {
+        std::vector<std::uint64_t> count;
+        std::vector<double> sum;
+        std::vector<T> min, max;
+    };
+    std::vector<Part> parts(threads);
+    detail::parallel_parts(counted ? n : 0, threads, [&](std::size_t first, std::size_t last, unsigned t) {
+        Part& part = parts[t];
+        part.count.assign(bins + 2, 0);
+        part.sum.assign(bins + 2, 0);
+        part.min.assign(bins + 2, std::numeric_limits<T>::max());
+        part.max.assign(bins + 2, std::numeric_limits<T>::lowest());
+
+        K buffer[detail::block];
+        std::uint32_t idx[detail::block];
+        for (std::size_t i=first; i<last; i += detail::block) {
+            std::size_t k = std::min(detail::block, last - i);
+            simd::bin_index(ks.block(i, k, buffer), k, lo, scale, std::uint32_t(bins), idx);
+            for (std::size_t j=0; j<k; j++) {
+                std::uint32_t b = idx[j];
+                b -= fromData && b == bins + 1;
+                const T& v = vs[i + j];
+                part.count[b]++;
+                part.sum[b] += v;
+                part.min[b] = std::min(part.min[b], v);
+                part.max[b] = std::max(part.max[b], v);
+            }
+        }
+    });
+
+    out.lo = lo;
+    out.hi = hi;
+    out.count.assign(bins, 0);
+    out.mean.assign(bins, 0);
+    out.min.assign(bins, T{});
+    out.max.assign(bins, T{});
+    for (std::size_t b=0; b<bins; b++) {
+        double sum = 0;
+        for (auto& part : parts) {
+            if (!part.count[b+1])
+                continue;
+            out.min[b] = out.count[b] ? std::min(out.min[b], part.min[b+1]) : part.min[b+1];
+            out.max[b] = out.count[b] ? std::max(out.max[b], part.max[b+1]) : part.max[b+1];
+            out.count[b] += part.count[b+1];
+            sum += part.sum[b+1];
+        }
+        if (out.count[b])
+            out.mean[b] = sum / out.count[b];
+    }
+}
+
+
+// Classify objects the aggregation stages know how to reduce
+
+// Elements with an x and a y: std::pair, two element std::array, or a struct with members x and y
+template <typename E, typename U = void>
+struct xy_fields : std::false_type {};
+
+template <typename A, typename B>
+struct xy_fields<std::pair<A,B>, std::enable_if_t<std::is_arithmetic<A>::value && std::is_arithmetic<B>::value>> : std::true_type {
+    static const A* x(const std::pair<A,B>* e) { return &e->first; }
+    static const B* y(const std::pair<A,B>* e) { return &e->second; }
+};
+
+template <typename T>
+struct xy_fields<std::array<T,2>, std::enable_if_t<std::is_arithmetic<T>::value>> : std::true_type {
+    static const T* x(const std::array<T,2>* e) { return &(*e)[0]; }
+    static const T* y(const std::array<T,2>* e) { return &(*e)[1]; }
+};
+
+template <typename E>
+struct xy_fields<E, std::enable_if_t<std::is_arithmetic<decltype(std::declval<const E&>().x)>::value &&
+                                     std::is_arithmetic<decltype(std::declval<const E&>().y)>::value>> : std::true_type {
+    static const decltype(E::x)* x(const E* e) { return &e->x; }
+    static const decltype(E::y)* y(const E* e) { return &e->y; }
+};
+
+// Contiguous containers of such elements
+template <typename T, typename U = void>
+struct is_xy_series : std::false_type {};
+
+template <typename T>
+struct is_xy_series<T, std::enable_if_t<
+        xy_fields<std::remove_cv_t<std::remove_pointer_t<decltype(std::declval<const T&>().data())>>>::value &&
+        std::is_integral<decltype(std::declval<const T&>().size())>::value>> : std::true_type {};
+
+
+// Pipeline stages that reduce each object before handing it on to `Snippet`, used like Decimate (see
+// decimate.h):
+//
+//     template <> struct binds_to<std::vector<double>> { using type = variant<LineChart, Histogram<Bars>>; };
+//
+//     script.run(Histogram<Bars>{100}, samples);
+//
+// Histogram passes flat series on as a `histogram`, Density passes contiguous series of (x,y) elements
+// on as a `histogram2d` (which indexes like a 2D array, as HeatMap snippets expect), and BucketStats
+// passes flat series on as a `bin_stats<T>`.  Other objects are passed through unchanged, and the
+// one-argument form of `Snippet`, if any, is forwarded as is.
+template <typename Snippet>
+struct Histogram : reducing_stage<Histogram<Snippet>, Snippet>
+{
+    Histogram() {}
+    Histogram(unsigned bins, double lo = 0, double hi = 0, Snippet snippet = Snippet{})
+        : reducing_stage<Histogram, Snippet>(snippet), bins(bins), lo(lo), hi(hi) {}
+
+    unsigned bins = 64;
+    double lo = 0;      // The range binned: the data's when lo >= hi
+    double hi = 0;
+
+private:
+    friend struct reducing_stage<Histogram, Snippet>;
+
+    template <typename T>
+    using reduces = is_flat_series<T>;
+
+    template <typename P, typename T>
+    void reduce(Process<P>& process, const T& series) const
+    {
+        histogram reduced;
+        histogram_1d(series.data(), series.size(), bins, lo, hi, reduced);
+        this->snippet(process, reduced);
+    }
+};
+
+template <typename Snippet>
+struct Density : reducing_stage<Density<Snippet>, Snippet>
+{
+    Density() {}
+    Density(unsigned cols, unsigned rows, Snippet snippet = Snippet{})
+        : reducing_stage<Density, Snippet>(snippet), cols(cols), rows(rows) {}
+
+    unsigned cols = 256;    // x bins
+    unsigned rows = 256;    // y bins
+    double xlo = 0, xhi = 0;    // The ranges binned: the data's when lo >= hi
+    double ylo = 0, yhi = 0;
+
+private:
+    friend struct reducing_stage<Density, Snippet>;
+
+    template <typename T>
+    using reduces = is_xy_series<T>;
+
+    template <typename P, typename T>
+    void reduce(Process<P>& process, const T& series) const
+    {
+        using E = std::remove_cv_t<std::remove_pointer_t<decltype(series.data())>>;
+        const E* first = series.data();
+        histogram2d reduced;
+        histogram_2d(xy_fields<E>::x(first), xy_fields<E>::y(first), series.size(), cols, rows,
+                     xlo, xhi, ylo, yhi, reduced, 0, sizeof(E), sizeof(E));
+        this->snippet(process, reduced);
+    }
+};
+
+template <typename Snippet>
+struct BucketStats : reducing_stage<BucketStats<Snippet>, Snippet>
+{
+    BucketStats() {}
+    BucketStats(unsigned buckets, Snippet snippet = Snippet{})
+        : reducing_stage<BucketStats, Snippet>(snippet), buckets(buckets) {}
+
+    unsigned buckets = 2048;
+
+private:
+    friend struct reducing_stage<BucketStats, Snippet>;
+
+    template <typename T>
+    using reduces = is_flat_series<T>;
+
+    template <typename P, typename T>
+    void reduce(Process<P>& process, const T& series) const
+    {
+        using V = std::remove_cv_t<std::remove_pointer_t<decltype(series.data())>>;
+        bin_stats<V> reduced;
+        bucket_stats(series.data(), series.size(), buckets, reduced);
+        this->snippet(process, reduced);
+    }
+};
+
+} // namespace iosc
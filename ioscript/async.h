@@ -0,0 +1,283 @@
+#pragma once
+
+#include "ioscript.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+namespace iosc {
+
+/// "async.h" ///
+
+// A bounded, lock-free multi-producer single-consumer ring.
+// After D. Vyukov's bounded MPMC queue, with the consumer side simplified for a single reader.
+// `push` never blocks: when the ring is full it returns false and the caller decides what to do.
+template <typename T>
+class mpsc_ring
+{
+public:
+    // `capacity` is rounded up to a power of two
+    mpsc_ring(std::size_t capacity)
+    {
+        std::size_t size = 2;
+        while (size < capacity)
+            size *= 2;
+        mask_ = size - 1;
+        cells_.reset(new Cell[size]);
+        for (std::size_t i=0; i<size; i++)
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    mpsc_ring(const mpsc_ring&) = delete;
+    mpsc_ring& operator=(const mpsc_ring&) = delete;
+
+    // Any thread
+    bool push(T&& value)
+    {
+        std::size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            std::intptr_t diff = std::intptr_t(seq) - std::intptr_t(pos);
+            if (diff == 0) {
+                if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0) {
+                return false;  // full
+            }
+            else {
+                pos = enqueuePos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer thread only
+    bool pop(T& value)
+    {
+        Cell* cell = &cells_[dequeuePos_ & mask_];
+        std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+        if (std::intptr_t(seq) - std::intptr_t(dequeuePos_ + 1) < 0)
+            return false;  // empty
+
+        value = std::move(cell->value);
+        cell->value = T{};  // Release anything the slot held on to
+        cell->sequence.store(dequeuePos_ + mask_ + 1, std::memory_order_release);
+        dequeuePos_++;
+        return true;
+    }
+
+    std::size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    std::size_t mask_;
+
+    alignas(64) std::atomic<std::size_t> enqueuePos_{0};
+    alignas(64) std::size_t dequeuePos_ = 0;
+};
+
+
+// A thread-safe front end to a `Script`, for print-statement like debugging from anywhere in a program.
+//
+// Any thread may call `run()`: the arguments are copied (snapshot-on-enqueue) and queued on a lock-free
+// ring, and a dedicated consumer thread drives the underlying `Script`.  Producers never wait on the
+// subprocess and never take a lock; when the ring is full the request is dropped and counted instead.
+// (Copying the arguments may still allocate through the global allocator.)
+//
+// `runLatest(key, args...)` coalesces per key: of all requests with the same key queued by the time the
+// consumer gets to them, only the newest is run.  A loop producing 10k frames/sec then renders as many
+// frames as the interpreter can keep up with, always the most recent.
+template <typename P, typename X, unsigned Capacity = 1024>
+class AsyncScript
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct Stats {
+        std::uint64_t enqueued = 0;     // Requests accepted onto the ring
+        std::uint64_t dropped = 0;      // Requests rejected because the ring was full
+        std::uint64_t coalesced = 0;    // Requests skipped in favour of a newer one with the same key
+        std::uint64_t executed = 0;     // Requests run
+        std::uint64_t maxLatencyNs = 0;     // Longest time from enqueue to the start of its run
+        std::uint64_t totalLatencyNs = 0;   // Summed over all executed requests
+    };
+
+    template <typename... Ts>
+    AsyncScript(Ts&&... args) :
+        script_(std::make_unique<Script<P,X>>(std::forward<Ts>(args)...)),
+        ring_(Capacity)
+    {
+        consumer_ = std::thread([this] { consume(); });
+    }
+
+    // Runs whatever is still queued, then stops the consumer
+    ~AsyncScript()
+    {
+        stop_.store(true, std::memory_order_release);
+        consumer_.join();
+    }
+
+    AsyncScript(const AsyncScript&) = delete;
+    AsyncScript& operator=(const AsyncScript&) = delete;
+
+    // Returns false if the request was dropped
+    template <typename... Ts>
+    bool run(const Ts&... args)
+    {
+        return enqueue(noKey, args...);
+    }
+
+    template <typename... Ts>
+    bool runLatest(std::uint64_t key, const Ts&... args)
+    {
+        assert(key != noKey);
+        return enqueue(key, args...);
+    }
+
+    // As run(), then `done(RunResult&&)` is called on the consumer thread with what the run produced
+    template <typename F, typename... Ts>
+    bool runThen(F done, const Ts&... args)
+    {
+        return push(noKey, [done, args...](Script<P,X>& script) { done(script.run(args...)); });
+    }
+
+    // Blocks the caller (not other producers) until everything queued so far has been run or skipped
+    void flush() const
+    {
+        std::uint64_t target = enqueued_.load(std::memory_order_acquire);
+        while (done_.load(std::memory_order_acquire) < target)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    Stats stats() const
+    {
+        Stats s;
+        s.enqueued  = enqueued_.load(std::memory_order_relaxed);
+        s.dropped   = dropped_.load(std::memory_order_relaxed);
+        s.coalesced = coalesced_.load(std::memory_order_relaxed);
+        s.executed  = executed_.load(std::memory_order_relaxed);
+        s.maxLatencyNs   = maxLatencyNs_.load(std::memory_order_relaxed);
+        s.totalLatencyNs = totalLatencyNs_.load(std::memory_order_relaxed);
+        return s;
+    }
+
+private:
+    static constexpr std::uint64_t noKey = ~std::uint64_t(0);
+
+    struct Job {
+        std::uint64_t key = noKey;
+        clock::time_point enqueued;
+        std::function<void(Script<P,X>&)> fn;
+    };
+
+    template <typename... Ts>
+    bool enqueue(std::uint64_t key, const Ts&... args)
+    {
+        return push(key, [args...](Script<P,X>& script) { script.run(args...); });
+    }
+
+    bool push(std::uint64_t key, std::function<void(Script<P,X>&)> fn)
+    {
+        Job job;
+        job.key = key;
+        job.enqueued = clock::now();
+        job.fn = std::move(fn);
+
+        if (!ring_.push(std::move(job))) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        enqueued_.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    void consume()
+    {
+        std::vector<Job> batch;
+        std::unordered_map<std::uint64_t, std::size_t> newest;
+        auto idle = std::chrono::microseconds(50);
+
+        for (;;)
+        {
+            // Take everything available in one go, so coalescing sees all pending requests
+            bool stopping = stop_.load(std::memory_order_acquire);
+            Job job;
+            while (ring_.pop(job))
+                batch.push_back(std::move(job));
+
+            if (batch.empty()) {
+                if (stopping)
+                    return;
+                // Nothing to do: back off, as producers never signal
+                std::this_thread::sleep_for(idle);
+                idle = std::min(idle * 2, decltype(idle)(2000));
+                continue;
+            }
+            idle = std::chrono::microseconds(50);
+
+            newest.clear();
+            for (std::size_t i=0; i<batch.size(); i++) {
+                if (batch[i].key != noKey)
+                    newest[batch[i].key] = i;
+            }
+
+            for (std::size_t i=0; i<batch.size(); i++)
+            {
+                Job& j = batch[i];
+                if (j.key != noKey && newest[j.key] != i) {
+                    coalesced_.fetch_add(1, std::memory_order_relaxed);
+                    done_.fetch_add(1, std::memory_order_release);
+                    continue;
+                }
+
+                auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - j.enqueued).count();
+                totalLatencyNs_.fetch_add(latency, std::memory_order_relaxed);
+                if (std::uint64_t(latency) > maxLatencyNs_.load(std::memory_order_relaxed))
+                    maxLatencyNs_.store(latency, std::memory_order_relaxed);
+
+                j.fn(*script_);
+                executed_.fetch_add(1, std::memory_order_relaxed);
+                done_.fetch_add(1, std::memory_order_release);
+            }
+            batch.clear();
+        }
+    }
+
+    std::unique_ptr<Script<P,X>> script_;
+    mpsc_ring<Job> ring_;
+    std::thread consumer_;
+    std::atomic<bool> stop_{false};
+
+    std::atomic<std::uint64_t> enqueued_{0};
+    std::atomic<std::uint64_t> dropped_{0};
+    std::atomic<std::uint64_t> coalesced_{0};
+    std::atomic<std::uint64_t> executed_{0};
+    std::atomic<std::uint64_t> done_{0};
+    std::atomic<std::uint64_t> maxLatencyNs_{0};
+    std::atomic<std::uint64_t> totalLatencyNs_{0};
+};
+
+// A process-wide instance per <P,X>, for one-liner debugging: `debugScript<Python,MyTypes>().run(vec)`
+template <typename P, typename X>
+AsyncScript<P,X>& debugScript()
+{
+    static AsyncScript<P,X> script;
+    return script;
+}
+
+} // namespace iosc
@@ -0,0 +1,428 @@
+#pragma once
+
+#include "ioscript.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+namespace iosc {
+
+/// "decimate.h" ///
+
+// Level-of-detail reduction on the C++ side, so that a series of 10^8 points plotted on a figure a few
+// thousand pixels wide only sends what can actually be drawn.  See `Decimate<Snippet>` at the end of this
+// file for attaching a decimation stage in front of an existing snippet.
+
+// A 1D series after decimation.  Each retained sample keeps its index into the original series, so the
+// x-axis stays faithful even when the spacing of retained samples isn't uniform (e.g. LTTB).
+template <typename T>
+struct sampled_series
+{
+    std::vector<std::size_t> x;
+    std::vector<T> y;
+
+    std::size_t size() const { return y.size(); }
+};
+
+// A 2D grid after stride sampling, stored row major.  `row_step` and `col_step` give the stride taken
+// in the original grid, i.e. values(i,j) corresponds to original[i*row_step][j*col_step].
+template <typename T>
+struct sampled_grid
+{
+    std::size_t rows = 0;
+    std::size_t cols = 0;
+    std::size_t row_step = 1;
+    std::size_t col_step = 1;
+    std::vector<T> values;
+
+    const T& operator()(std::size_t i, std::size_t j) const { return values[i*cols + j]; }
+};
+
+
+// Vectorized kernels.  The generic versions are plain loops; float and double get explicit SSE2
+// versions when available.  minmax skips NaNs; the others let them through.
+namespace simd {
+
+// The smallest and largest of p[0,n), ignoring NaNs.  Returns false if there are none (n is 0, or every
+// value is NaN), leaving lo > hi.
+template <typename T>
+bool minmax(const T* p, std::size_t n, T& lo, T& hi)
+{
+    std::size_t i = 0;
+    while (i < n && p[i] != p[i])
+        i++;
+    if (i == n) {
+        lo = std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+        hi = std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest();
+        return false;
+    }
+    // A comparison with NaN is false, so the rest are skipped too
+    lo = hi = p[i];
+    for (i++; i<n; i++) {
+        lo = p[i] < lo ? p[i] : lo;
+        hi = p[i] > hi ? p[i] : hi;
+    }
+    return true;
+}
+
+template <typename T>
+double sum(const T* p, std::size_t n)
+{
+    double s = 0;
+    for (std::size_t i=0; i<n; i++)
+        s += p[i];
+    return s;
+}
+
+// Twice the area of the triangle (a, (x0+i, p[i]), c) for each i in [0,n), written to `area`
+template <typename T>
+void triangle_areas(const T* p, std::size_t n, double x0, double ax, double ay, double cx, double cy, double* area)
+{
+    for (std::size_t i=0; i<n; i++) {
+        area[i] = std::abs((ax - cx) * (p[i] - ay) - (ax - (x0 + i)) * (cy - ay));
+    }
+}
+
+#if defined(__SSE2__)
+
+// MINPS and MAXPS return their second operand when either is NaN, so NaNs in `v` leave the bounds be
+inline bool minmax(const float* p, std::size_t n, float& lo, float& hi)
+{
+    if (n < 8)
+        return minmax<float>(p, n, lo, hi);
+    __m128 vlo = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    __m128 vhi = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+    std::size_t i = 0;
+    for (; i+4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(p + i);
+        vlo = _mm_min_ps(v, vlo);
+        vhi = _mm_max_ps(v, vhi);
+    }
+    alignas(16) float l[4], h[4];
+    _mm_store_ps(l, vlo);
+    _mm_store_ps(h, vhi);
+    lo = std::min(std::min(l[0], l[1]), std::min(l[2], l[3]));
+    hi = std::max(std::max(h[0], h[1]), std::max(h[2], h[3]));
+    for (; i<n; i++) {
+        lo = std::min(lo, p[i]);
+        hi = std::max(hi, p[i]);
+    }
+    return lo <= hi;
+}
+
+inline bool minmax(const double* p, std::size_t n, double& lo, double& hi)
+{
+    if (n < 4)
+        return minmax<double>(p, n, lo, hi);
+    __m128d vlo = _mm_set1_pd(std::numeric_limits<double>::infinity());
+    __m128d vhi = _mm_set1_pd(-std::numeric_limits<double>::infinity());
+    std::size_t i = 0;
+    for (; i+2 <= n; i += 2) {
+        __m128d v = _mm_loadu_pd(p + i);
+        vlo = _mm_min_pd(v, vlo);
+        vhi = _mm_max_pd(v, vhi);
+    }
+    alignas(16) double l[2], h[2];
+    _mm_store_pd(l, vlo);
+    _mm_store_pd(h, vhi);
+    lo = std::min(l[0], l[1]);
+    hi = std::max(h[0], h[1]);
+    for (; i<n; i++) {
+        lo = std::min(lo, p[i]);
+        hi = std::max(hi, p[i]);
+    }
+    return lo <= hi;
+}
+
+inline double sum(const double* p, std::size_t n)
+{
+    __m128d acc = _mm_setzero_pd();
+    std::size_t i = 0;
+    for (; i+2 <= n; i += 2)
+        acc = _mm_add_pd(acc, _mm_loadu_pd(p + i));
+    alignas(16) double a[2];
+    _mm_store_pd(a, acc);
+    double s = a[0] + a[1];
+    for (; i<n; i++)
+        s += p[i];
+    return s;
+}
+
+inline void triangle_areas(const double* p, std::size_t n, double x0, double ax, double ay, double cx, double cy, double* area)
+{
+    // area = |(ax-cx)*(y-ay) - (ax-x)*(cy-ay)|, with x counting up from x0
+    const __m128d k1 = _mm_set1_pd(ax - cx);
+    const __m128d k2 = _mm_set1_pd(cy - ay);
+    const __m128d vax = _mm_set1_pd(ax);
+    const __m128d vay = _mm_set1_pd(ay);
+    const __m128d two = _mm_set1_pd(2.0);
+    const __m128d sign = _mm_set1_pd(-0.0);
+    __m128d x = _mm_set_pd(x0 + 1, x0);
+    std::size_t i = 0;
+    for (; i+2 <= n; i += 2) {
+        __m128d y = _mm_loadu_pd(p + i);
+        __m128d a = _mm_sub_pd(_mm_mul_pd(k1, _mm_sub_pd(y, vay)),
+                               _mm_mul_pd(_mm_sub_pd(vax, x), k2));
+        _mm_storeu_pd(area + i, _mm_andnot_pd(sign, a));
+        x = _mm_add_pd(x, two);
+    }
+    for (; i<n; i++)
+        area[i] = std::abs((ax - cx) * (p[i] - ay) - (ax - (x0 + i)) * (cy - ay));
+}
+
+#endif
+
+} // namespace simd
+
+
+// Min/max decimation: split the series into `buckets` equal ranges and keep the smallest and largest
+// sample of each, in their original order.  At one bucket per pixel column this reproduces the rendered
+// line exactly, including every spike.  NaNs are passed over, but a bucket of nothing else keeps its first,
+// so that gaps in the line survive.  Series of at most 2*buckets samples are kept whole.
+template <typename T>
+void decimate_minmax(const T* data, std::size_t n, std::size_t buckets, sampled_series<T>& out)
+{
+    out.x.clear();
+    out.y.clear();
+
+    if (buckets == 0 || n <= 2*buckets) {
+        for (std::size_t i=0; i<n; i++) {
+            out.x.push_back(i);
+            out.y.push_back(data[i]);
+        }
+        return;
+    }
+
+    out.x.reserve(2*buckets);
+    out.y.reserve(2*buckets);
+
+    for (std::size_t b=0; b<buckets; b++)
+    {
+        std::size_t first = b * n / buckets;
+        std::size_t last  = (b+1) * n / buckets;
+
+        T lo, hi;
+        if (!simd::minmax(data + first, last - first, lo, hi)) {
+            out.x.push_back(first);
+            out.y.push_back(data[first]);
+            continue;
+        }
+
+        // Both are numbers, so are found
+        std::size_t iLo = std::find(data + first, data + last, lo) - data;
+        std::size_t iHi = std::find(data + first, data + last, hi) - data;
+
+        if (iLo == iHi) {
+            out.x.push_back(iLo);
+            out.y.push_back(data[iLo]);
+            continue;
+        }
+        std::size_t i0 = std::min(iLo, iHi);
+        std::size_t i1 = std::max(iLo, iHi);
+        out.x.push_back(i0);
+        out.y.push_back(data[i0]);
+        out.x.push_back(i1);
+        out.y.push_back(data[i1]);
+    }
+}
+
+// Largest-Triangle-Three-Buckets (Steinarsson, 2013): keep `threshold` samples, including the first and
+// last, choosing from each bucket the sample that forms the largest triangle with the previously kept
+// sample and the average of the next bucket.  Better at preserving the shape of smooth series than
+// min/max, at the cost of not guaranteeing that every extreme survives.
+template <typename T>
+void decimate_lttb(const T* data, std::size_t n, std::size_t threshold, sampled_series<T>& out)
+{
+    out.x.clear();
+    out.y.clear();
+
+    if (threshold < 3 || n <= threshold) {
+        for (std::size_t i=0; i<n; i++) {
+            out.x.push_back(i);
+            out.y.push_back(data[i]);
+        }
+        return;
+    }
+
+    out.x.reserve(threshold);
+    out.y.reserve(threshold);
+
+    // Scratch space for one bucket of areas
+    std::vector<double> area((n - 2) / (threshold - 2) + 2);
+
+    const double every = double(n - 2) / (threshold - 2);
+    std::size_t a = 0;
+
+    out.x.push_back(0);
+    out.y.push_back(data[0]);
+
+    for (std::size_t b=0; b<threshold-2; b++)
+    {
+        // Average of the next bucket (the last bucket looks ahead to the final sample)
+        std::size_t nextFirst = std::size_t((b+1) * every) + 1;
+        std::size_t nextLast  = std::min(std::size_t((b+2) * every) + 1, n);
+        std::size_t nextCount = nextLast - nextFirst;
+        double cx = (nextFirst + nextLast - 1) / 2.0;
+        double cy = nextCount ? simd::sum(data + nextFirst, nextCount) / nextCount : double(data[n-1]);
+
+        // Choose from this bucket
+        std::size_t first = std::size_t(b * every) + 1;
+        std::size_t last  = std::size_t((b+1) * every) + 1;
+        if (area.size() < last - first)
+            area.resize(last - first);
+
+        simd::triangle_areas(data + first, last - first, double(first), double(a), double(data[a]), cx, cy, area.data());
+        std::size_t best = std::max_element(area.begin(), area.begin() + (last - first)) - area.begin();
+
+        a = first + best;
+        out.x.push_back(a);
+        out.y.push_back(data[a]);
+    }
+
+    out.x.push_back(n-1);
+    out.y.push_back(data[n-1]);
+}
+
+// Stride sampling for 2D grids, e.g. `std::array<std::array<T,M>,N>` or `std::vector<std::vector<T>>`.
+// Keeps at most `maxRows` x `maxCols` values by taking every k'th row and column.
+template <typename Grid, typename T = std::decay_t<decltype(std::declval<const Grid&>()[0][0])>>
+void decimate_stride(const Grid& grid, std::size_t maxRows, std::size_t maxCols, sampled_grid<T>& out)
+{
+    std::size_t rows = grid.size();
+    std::size_t cols = rows ? grid[0].size() : 0;
+
+    out.row_step = (maxRows && rows > maxRows) ? (rows + maxRows - 1) / maxRows : 1;
+    out.col_step = (maxCols && cols > maxCols) ? (cols + maxCols - 1) / maxCols : 1;
+    out.rows = (rows + out.row_step - 1) / out.row_step;
+    out.cols = (cols + out.col_step - 1) / out.col_step;
+
+    out.values.clear();
+    out.values.reserve(out.rows * out.cols);
+    for (std::size_t i=0; i<rows; i += out.row_step) {
+        for (std::size_t j=0; j<cols; j += out.col_step) {
+            out.values.push_back(grid[i][j]);
+        }
+    }
+}
+
+
+// Classify objects the decimation stage knows how to reduce
+
+template <typename T, typename U = void>
+struct is_flat_series : std::false_type {};
+
+template <typename T>
+struct is_flat_series<T, std::enable_if_t<
+        std::is_arithmetic<std::remove_cv_t<std::remove_pointer_t<decltype(std::declval<const T&>().data())>>>::value &&
+        std::is_integral<decltype(std::declval<const T&>().size())>::value>> : std::true_type {};
+
+template <typename T, typename U = void>
+struct is_flat_grid : std::false_type {};
+
+template <typename T>
+struct is_flat_grid<T, std::enable_if_t<is_flat_series<typename T::value_type>::value>> : std::true_type {};
+
+
+// What the stages that reduce objects on their way to a snippet share: the one-argument form of `Snippet`,
+// if any, is forwarded as is, and objects the stage doesn't reduce are passed through unchanged.  `Stage`
+// names the ones it does with a trait `reduces<T>`, and hands them on with `reduce(process, obj)`.
+template <typename Stage, typename Snippet>
+struct reducing_stage
+{
+    explicit reducing_stage(Snippet snippet = Snippet{}) : snippet(snippet) {}
+
+    template <typename P, typename S = Snippet,
+              typename = decltype(std::declval<const S&>()(std::declval<Process<P>&>()))>
+    void operator()(Process<P>& process) const
+    {
+        snippet(process);
+    }
+
+    template <typename P, typename T>
+    void operator()(Process<P>& process, const T& obj) const
+    {
+        send(process, obj, typename Stage::template reduces<T>{});
+    }
+
+    Snippet snippet;
+
+private:
+    template <typename P, typename T>
+    void send(Process<P>& process, const T& obj, std::true_type) const
+    {
+        static_cast<const Stage&>(*this).reduce(process, obj);
+    }
+
+    template <typename P, typename T>
+    void send(Process<P>& process, const T& obj, std::false_type) const
+    {
+        snippet(process, obj);
+    }
+};
+
+// A pipeline stage that decimates each object before handing it on to `Snippet`, so it can be used as
+// an alternative in a `binds_to` variant or passed to run() like any other snippet:
+//
+//     template <> struct binds_to<std::vector<double>> { using type = variant<LineChart, Decimate<LineChart>>; };
+//
+//     script.run(Decimate<LineChart>{1920}, series);
+//
+// 1D series arrive at `Snippet` as a `sampled_series<T>` and 2D grids as a `sampled_grid<T>`, so `Snippet`
+// needs an overload for those.  Any other object is passed through unchanged.  The one-argument form of
+// `Snippet`, if any, is forwarded as is.
+template <typename Snippet>
+struct Decimate : reducing_stage<Decimate<Snippet>, Snippet>
+{
+    enum Method {
+        MinMax,
+        LTTB
+    };
+
+    Decimate() {}
+    Decimate(unsigned resolution, Method method = MinMax, Snippet snippet = Snippet{})
+        : reducing_stage<Decimate, Snippet>(snippet), resolution(resolution), method(method) {}
+
+    unsigned resolution = 2048;   // Target width (or height) in pixels
+    Method method = MinMax;
+
+private:
+    friend struct reducing_stage<Decimate, Snippet>;
+
+    template <typename T>
+    using reduces = std::integral_constant<bool, is_flat_series<T>::value || is_flat_grid<T>::value>;
+
+    template <typename P, typename T>
+    void reduce(Process<P>& process, const T& obj) const
+    {
+        reduce(process, obj, is_flat_series<T>{});
+    }
+
+    template <typename P, typename T>
+    void reduce(Process<P>& process, const T& series, std::true_type) const
+    {
+        using V = std::remove_cv_t<std::remove_pointer_t<decltype(series.data())>>;
+        sampled_series<V> reduced;
+        if (method == LTTB)
+            decimate_lttb(series.data(), series.size(), resolution, reduced);
+        else
+            decimate_minmax(series.data(), series.size(), resolution, reduced);
+        this->snippet(process, reduced);
+    }
+
+    template <typename P, typename T>
+    void reduce(Process<P>& process, const T& grid, std::false_type) const
+    {
+        sampled_grid<std::decay_t<decltype(grid[0][0])>> reduced;
+        decimate_stride(grid, resolution, resolution, reduced);
+        this->snippet(process, reduced);
+    }
+};
+
+} // namespace iosc
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "ioscript.h"
+#include "serialize.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace iosc {
+
+/// "delta.h" ///
+
+// Delta frames, for series sent again and again with only a few values changed - a live dashboard
+// calling run() a few times a second on a large array.  Wrap the series with a key naming it, and send
+// it as usual:
+//
+//     serialize(python, 0, delta("prices", prices));
+//     python << "prices = iosc_read(0)\n";
+//
+// Given a DeltaFrames (see Script::deltaFrames, or Process::deltaFrames for a long-lived Process) the
+// first frame of a series is sent whole, and each later one as just the chunks whose hashes changed,
+// which `iosc_read` patches into the copy it kept of the previous frame.  It returns that copy: an array
+// read earlier changes with it.  Without a DeltaFrames, or while recording, a series is sent whole.
+//
+// Frames only patch a copy still held by the same interpreter, so for a Script they need a runtime
+// whose interpreter persists between runs, as EmbeddedPython's does.  A frame that finds no copy (or not
+// the frame before it) raises an exception in the interpreter, and a failed run makes the next frames
+// whole again.  Changes are detected by 64 bit hashes, so a changed chunk hashing as before, while
+// possible, is vanishingly unlikely.
+
+template <typename T>
+struct delta_series
+{
+    std::string key;
+    const T* data;
+    std::size_t size;
+};
+
+template <typename T>
+delta_series<T> delta(std::string key, const T* data, std::size_t size)
+{
+    return delta_series<T>{std::move(key), data, size};
+}
+
+// A contiguous container: std::vector, std::array, ...
+template <typename C, typename T = std::remove_cv_t<std::remove_pointer_t<decltype(std::declval<const C&>().data())>>>
+delta_series<T> delta(std::string key, const C& container)
+{
+    return delta_series<T>{std::move(key), container.data(), container.size()};
+}
+
+// On the wire, the schema of the container (serialize.h) prefixed with "~<slot> <generation> <chunk
+// bytes> <chunks>|", then either the whole series (for chunks -1) or the u32 indices of the chunks that
+// changed followed by their bytes
+template <typename P, typename T>
+void serialize(Process<P>& process, unsigned c, const delta_series<T>& series)
+{
+    using F = element_format<T>;
+    static_assert(is_raw_format<F>::value, "Delta frames are of elements sent as their memory");
+
+    const char* p = reinterpret_cast<const char*>(series.data);
+    const std::size_t n = series.size * sizeof(T);
+    auto& out = process.data_out(c);
+
+    // A digest must not depend on what was sent before
+    DeltaFrames* frames = process.deltaFrames();
+    if (!frames || process.digesting()) {
+        detail::write_schema(process, c, F::dtype(), series.size);
+        out.write(p, n);
+        out.flush();
+        return;
+    }
+
+    DeltaFrames::Entry& entry = frames->entry(series.key);
+    const std::size_t chunk = frames->chunkBytes();
+    const std::size_t chunks = (n + chunk - 1) / chunk;
+    std::vector<std::uint64_t> hashes(chunks);
+    for (std::size_t i=0; i<chunks; i++)
+        hashes[i] = DeltaFrames::hash(p + i * chunk, std::min(chunk, n - i * chunk));
+
+    bool whole = process.recorder() || entry.generation == 0 || entry.bytes != n || entry.hashes.size() != chunks ||
+                 entry.dtype != F::dtype();
+    std::vector<std::uint32_t> changed;
+    if (!whole) {
+        for (std::size_t i=0; i<chunks; i++)
+            if (hashes[i] != entry.hashes[i])
+                changed.push_back(std::uint32_t(i));
+        whole = changed.size() * 2 > chunks;    // As cheap to send it all
+    }
+
+    entry.generation++;
+    out << '~' << entry.slot << ' ' << entry.generation << ' ' << chunk << ' '
+        << (whole ? -1 : (long long)changed.size()) << '|';
+    detail::write_schema(process, c, F::dtype(), series.size);
+
+    if (whole) {
+        out.write(p, n);
+    }
+    else {
+        out.write(reinterpret_cast<const char*>(changed.data()), changed.size() * sizeof(std::uint32_t));
+        // Runs of consecutive chunks in one write each
+        for (std::size_t i=0; i<changed.size(); ) {
+            std::size_t j = i + 1;
+            while (j < changed.size() && changed[j] == changed[j-1] + 1)
+                j++;
+            std::size_t start = changed[i] * chunk;
+            out.write(p + start, std::min(n, changed[j-1] * chunk + chunk) - start);
+            i = j;
+        }
+    }
+    out.flush();
+
+    entry.dtype = F::dtype();
+    entry.bytes = n;
+    entry.hashes = std::move(hashes);
+}
+
+} // namespace iosc
@@ -0,0 +1,422 @@
+#pragma once
+
+#include "ioscript.h"
+#include "serialize.h"
+#include "decimate.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+#if defined(__F16C__)
+    #include <immintrin.h>
+#endif
+
+namespace iosc {
+
+/// "encode.h" ///
+
+// Compact encodings for numeric series that are only going to be plotted, where full double precision
+// is wasted.  An encoded series is serialized like a container, and in Python `iosc_read(c)` decodes it
+// back to an array of the original dtype:
+//
+//     serialize(python, 0, encode(y, Encoding::quantized(12)));   // 2 bytes a value instead of 8
+//     serialize(python, 1, encode(t, Encoding::delta()));         // Often 1 byte a value for an x-axis
+//
+//   float16     IEEE half precision, 2 bytes.  For values of magnitude at most 65504.
+//   bfloat16    The top half of a float, 2 bytes: the range of a float with 8 bits of precision.
+//   quantized   Fixed point in 2^bits - 1 equal steps over [lo, hi], in 1, 2 or 4 bytes (bits in [1, 31]).
+//               The range is the data's unless given; values outside a given range are clamped.
+//   delta       Lossless, for integers: differences between successive values as zigzag varints, so a
+//               monotonic axis of small steps (indices, timestamps) costs a byte or two a value.
+//
+// Each encoding rounds to nearest, and `encoded_series::maxError()` bounds the absolute error of every
+// decoded value; it's infinite when the data is outside what the encoding represents.  On the wire an
+// encoded series is the schema of the container (serialize.h) prefixed with "!<encoding> <args>|".
+
+struct Encoding
+{
+    enum Kind { Float16, BFloat16, Quantized, Delta };
+
+    Kind kind = Float16;
+    unsigned bits = 0;      // Quantized
+    double lo = 0;          // Quantized: the range, or the data's when lo == hi
+    double hi = 0;
+
+    static Encoding float16() { return Encoding{Float16}; }
+    static Encoding bfloat16() { return Encoding{BFloat16}; }
+    static Encoding quantized(unsigned bits, double lo = 0, double hi = 0) { return Encoding{Quantized, bits, lo, hi}; }
+    static Encoding delta() { return Encoding{Delta}; }
+
+    // Bytes of each value, or 0 if variable
+    std::size_t width() const
+    {
+        switch (kind) {
+            case Float16: case BFloat16: return 2;
+            case Quantized: return bits <= 8 ? 1 : bits <= 16 ? 2 : 4;
+            default: return 0;
+        }
+    }
+};
+
+
+// Vectorized kernels.  Generic versions are plain loops; SSE2 (and F16C for float16) versions are used
+// when available.
+namespace simd {
+
+// Round to nearest even, overflowing to infinity, as F16C does
+inline std::uint16_t float_to_half(float f)
+{
+    std::uint32_t x;
+    std::memcpy(&x, &f, 4);
+    const std::uint32_t sign = x & 0x80000000u;
+    x ^= sign;
+
+    std::uint16_t h;
+    if (x >= (127u + 16) << 23) {
+        h = x > 0x7f800000u ? 0x7e00 : 0x7c00;      // NaN, or too large: infinity
+    }
+    else if (x < (127u - 14) << 23) {
+        // Subnormal: let the FPU round the mantissa into place by adding 0.5
+        const std::uint32_t magic = (127u - 1) << 23;
+        float m, f2;
+        std::memcpy(&f2, &x, 4);
+        std::memcpy(&m, &magic, 4);
+        f2 += m;
+        std::memcpy(&x, &f2, 4);
+        h = std::uint16_t(x - magic);
+    }
+    else {
+        const std::uint32_t odd = (x >> 13) & 1;
+        x += ((15u - 127) << 23) + 0xfff + odd;
+        h = std::uint16_t(x >> 13);
+    }
+    return h | std::uint16_t(sign >> 16);
+}
+
+inline std::uint16_t float_to_bfloat16(float f)
+{
+    std::uint32_t x;
+    std::memcpy(&x, &f, 4);
+    if ((x & 0x7fffffffu) > 0x7f800000u)
+        return std::uint16_t((x >> 16) | 0x40);     // Quiet, so that rounding can't make it infinity
+    return std::uint16_t((x + 0x7fff + ((x >> 16) & 1)) >> 16);
+}
+
+inline void to_float16(const float* p, std::size_t n, std::uint16_t* out)
+{
+    std::size_t i = 0;
+#if defined(__F16C__)
+    for (; i+8 <= n; i += 8) {
+        __m128i h0 = _mm_cvtps_ph(_mm_loadu_ps(p + i), _MM_FROUND_TO_NEAREST_INT);
+        __m128i h1 = _mm_cvtps_ph(_mm_loadu_ps(p + i + 4), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi64(h0, h1));
+    }
+#endif
+    for (; i<n; i++)
+        out[i] = float_to_half(p[i]);
+}
+
+inline void to_bfloat16(const float* p, std::size_t n, std::uint16_t* out)
+{
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i bias = _mm_set1_epi32(0x7fff);
+    const __m128i quiet = _mm_set1_epi32(0x40);
+    const __m128i half = _mm_set1_epi32(0x8000);
+    const __m128i flip = _mm_set1_epi16(-0x8000);
+
+    // The top 16 bits of each lane, rounded; offset so that packing with signed saturation keeps them
+    auto round4 = [&](__m128 v) {
+        __m128i x = _mm_castps_si128(v);
+        __m128i hi = _mm_srli_epi32(x, 16);
+        __m128i r = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, bias), _mm_and_si128(hi, one)), 16);
+        __m128i nan = _mm_castps_si128(_mm_cmpunord_ps(v, v));
+        r = _mm_or_si128(_mm_andnot_si128(nan, r), _mm_and_si128(nan, _mm_or_si128(hi, quiet)));
+        return _mm_sub_epi32(r, half);
+    };
+    for (; i+8 <= n; i += 8) {
+        __m128i packed = _mm_packs_epi32(round4(_mm_loadu_ps(p + i)), round4(_mm_loadu_ps(p + i + 4)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_xor_si128(packed, flip));
+    }
+#endif
+    for (; i<n; i++)
+        out[i] = float_to_bfloat16(p[i]);
+}
+
+// round((p[i] - lo) * scale), clamped to [0, levels] (NaN to 0)
+template <typename T>
+void quantize(const T* p, std::size_t n, double lo, double scale, std::uint32_t levels, std::uint32_t* q)
+{
+    for (std::size_t i=0; i<n; i++) {
+        double v = (double(p[i]) - lo) * scale;
+        v = v >= 0 ? (v < levels ? v : double(levels)) : 0;
+        q[i] = std::uint32_t(v + 0.5);
+    }
+}
+
+#if defined(__SSE2__)
+
+// max() returns its second operand for NaN, so NaN clamps to 0 as in the scalar version
+inline __m128i quantize2(__m128d v, __m128d lo, __m128d scale, __m128d zero, __m128d top, __m128d half)
+{
+    v = _mm_mul_pd(_mm_sub_pd(v, lo), scale);
+    v = _mm_min_pd(_mm_max_pd(v, zero), top);
+    return _mm_cvttpd_epi32(_mm_add_pd(v, half));
+}
+
+inline void quantize(const double* p, std::size_t n, double lo, double scale, std::uint32_t levels, std::uint32_t* q)
+{
+    const __m128d vlo = _mm_set1_pd(lo);
+    const __m128d vscale = _mm_set1_pd(scale);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d top = _mm_set1_pd(double(levels));
+    const __m128d half = _mm_set1_pd(0.5);
+    std::size_t i = 0;
+    for (; i+4 <= n; i += 4) {
+        __m128i q0 = quantize2(_mm_loadu_pd(p + i), vlo, vscale, zero, top, half);
+        __m128i q1 = quantize2(_mm_loadu_pd(p + i + 2), vlo, vscale, zero, top, half);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(q + i), _mm_unpacklo_epi64(q0, q1));
+    }
+    quantize<double>(p + i, n - i, lo, scale, levels, q + i);
+}
+
+inline void quantize(const float* p, std::size_t n, double lo, double scale, std::uint32_t levels, std::uint32_t* q)
+{
+    const __m128d vlo = _mm_set1_pd(lo);
+    const __m128d vscale = _mm_set1_pd(scale);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d top = _mm_set1_pd(double(levels));
+    const __m128d half = _mm_set1_pd(0.5);
+    std::size_t i = 0;
+    for (; i+4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(p + i);
+        __m128i q0 = quantize2(_mm_cvtps_pd(v), vlo, vscale, zero, top, half);
+        __m128i q1 = quantize2(_mm_cvtps_pd(_mm_movehl_ps(v, v)), vlo, vscale, zero, top, half);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(q + i), _mm_unpacklo_epi64(q0, q1));
+    }
+    quantize<float>(p + i, n - i, lo, scale, levels, q + i);
+}
+
+#endif
+
+} // namespace simd
+
+
+namespace detail {
+
+inline std::uint64_t zigzag(std::int64_t v) { return (std::uint64_t(v) << 1) ^ std::uint64_t(v >> 63); }
+
+inline std::size_t varint_size(std::uint64_t v)
+{
+    std::size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+inline char* put_varint(char* out, std::uint64_t v)
+{
+    while (v >= 0x80) {
+        *out++ = char(v | 0x80);
+        v >>= 7;
+    }
+    *out++ = char(v);
+    return out;
+}
+
+// The difference from the previous value, wrapping like the int64 sums that undo it
+template <typename T>
+std::uint64_t delta_at(const T* p, std::size_t i)
+{
+    return zigzag(std::int64_t(std::uint64_t(p[i]) - (i ? std::uint64_t(p[i-1]) : 0)));
+}
+
+} // namespace detail
+
+
+// A contiguous series of arithmetic values to send in an encoding.  Refers to the values, which must
+// outlive it.
+template <typename T>
+class encoded_series
+{
+    static_assert(std::is_arithmetic<T>::value && !std::is_same<T,bool>::value, "Only numbers are encoded");
+
+public:
+    using value_type = T;
+
+    encoded_series(const T* data, std::size_t size, const Encoding& encoding) :
+        data_(data), size_(size), encoding_(encoding) {}
+
+    const T* data() const { return data_; }
+    std::size_t size() const { return size_; }
+    const Encoding& encoding() const { return encoding_; }
+
+    // The range quantized over
+    void range(double& lo, double& hi) const
+    {
+        lo = encoding_.lo;
+        hi = encoding_.hi;
+        if (lo == hi && size_) {
+            T l, h;
+            simd::minmax(data_, size_, l, h);
+            lo = double(l);
+            hi = double(h);
+        }
+    }
+
+    // A bound on |decoded - original| over the series
+    double maxError() const
+    {
+        constexpr double inf = std::numeric_limits<double>::infinity();
+        if (size_ == 0 || encoding_.kind == Encoding::Delta)
+            return 0;
+
+        T l, h;
+        simd::minmax(data_, size_, l, h);
+        const double big = std::max(std::abs(double(l)), std::abs(double(h)));
+        // A float result rounds once more
+        const double result = std::is_same<T,float>::value ? big / (1 << 24) : 0;
+
+        switch (encoding_.kind) {
+            case Encoding::Float16:
+                // Half an ulp of 11 bits, or of the subnormal spacing 2^-24; plus rounding to float first
+                return big <= 65504 ? big * (1.0 / (1 << 11) + 1.0 / (1 << 24)) + 1.0 / (1 << 25) : inf;
+            case Encoding::BFloat16:
+                return big <= 3.3895313892515355e38 ? big * (1.0 / (1 << 8) + 1.0 / (1 << 24)) + std::ldexp(1.0, -134) : inf;
+            default: {
+                double lo, hi;
+                range(lo, hi);
+                if (double(l) < lo || double(h) > hi || !std::isfinite(hi - lo))
+                    return inf;
+                // Half a step, plus the rounding of lo + q*step when decoding
+                const double step = (hi - lo) / levels();
+                const double error = step / 2 + 4 * std::numeric_limits<double>::epsilon() * std::max(std::abs(lo), std::abs(hi));
+                // An integer is decoded to the nearest integer, so its error is a whole number within error + 1/2
+                return std::is_integral<T>::value ? std::floor(error + 0.5) : error + result;
+            }
+        }
+    }
+
+    std::uint32_t levels() const { return (std::uint32_t(1) << encoding_.bits) - 1; }
+
+private:
+    const T* data_;
+    std::size_t size_;
+    Encoding encoding_;
+};
+
+template <typename T>
+encoded_series<T> encode(const T* data, std::size_t size, const Encoding& encoding)
+{
+    return encoded_series<T>(data, size, encoding);
+}
+
+// A contiguous container: std::vector, std::array, ...
+template <typename C, typename T = std::remove_cv_t<std::remove_pointer_t<decltype(std::declval<const C&>().data())>>>
+encoded_series<T> encode(const C& container, const Encoding& encoding)
+{
+    return encoded_series<T>(container.data(), container.size(), encoding);
+}
+
+
+// Sent a block at a time through a buffer of bounded size.  See python.h for the decoder.
+template <typename P, typename T>
+void serialize(Process<P>& process, unsigned c, const encoded_series<T>& series)
+{
+    constexpr std::size_t block = 4096;     // Values
+    const Encoding& e = series.encoding();
+    const T* p = series.data();
+    const std::size_t n = series.size();
+
+    if (e.kind == Encoding::Quantized && (e.bits < 1 || e.bits > 31)) {
+        std::cerr << "(ioscript) Can't quantize to " << e.bits << " bits: 1 to 31 are supported" << std::endl;
+        assert(false);
+        return;
+    }
+    if (e.kind == Encoding::Delta && !std::is_integral<T>::value) {
+        std::cerr << "(ioscript) The delta encoding is for integers: quantize floating point values instead" << std::endl;
+        assert(false);
+        return;
+    }
+
+    auto& out = process.data_out(c);
+    std::vector<char> buffer(block * std::max<std::size_t>(e.width(), 10));
+    std::vector<float> floats;
+    std::vector<std::uint32_t> levels;
+    double lo = 0, hi = 0, scale = 0;
+
+    std::ostringstream head;
+    head.precision(17);
+    switch (e.kind) {
+        case Encoding::Float16: head << "f16"; break;
+        case Encoding::BFloat16: head << "bf16"; break;
+        case Encoding::Quantized:
+            series.range(lo, hi);
+            scale = hi > lo ? series.levels() / (hi - lo) : 0;
+            head << "q " << e.width() << ' ' << lo << ' ' << (hi > lo ? (hi - lo) / series.levels() : 0);
+            break;
+        case Encoding::Delta: {
+            std::size_t bytes = 0;
+            for (std::size_t i=0; i<n; i++)
+                bytes += detail::varint_size(detail::delta_at(p, i));
+            head << "delta " << bytes;
+            break;
+        }
+    }
+    out << '!' << head.str() << '|';
+    detail::write_schema(process, c, element_format<T>::dtype(), n);
+
+    for (std::size_t first=0; first<n; first+=block)
+    {
+        const std::size_t m = std::min(block, n - first);
+        const T* q = p + first;
+        std::size_t used = m * e.width();
+
+        if (e.kind == Encoding::Float16 || e.kind == Encoding::BFloat16) {
+            const float* f = reinterpret_cast<const float*>(q);
+            if (!std::is_same<T,float>::value) {
+                floats.assign(q, q + m);
+                f = floats.data();
+            }
+            std::uint16_t* h = reinterpret_cast<std::uint16_t*>(buffer.data());
+            if (e.kind == Encoding::Float16)
+                simd::to_float16(f, m, h);
+            else
+                simd::to_bfloat16(f, m, h);
+        }
+        else if (e.kind == Encoding::Quantized) {
+            levels.resize(m);
+            simd::quantize(q, m, lo, scale, series.levels(), levels.data());
+            if (e.width() == 1)
+                std::copy_n(levels.data(), m, reinterpret_cast<std::uint8_t*>(buffer.data()));
+            else if (e.width() == 2)
+                std::copy_n(levels.data(), m, reinterpret_cast<std::uint16_t*>(buffer.data()));
+            else
+                std::memcpy(buffer.data(), levels.data(), m * 4);
+        }
+        else {
+            char* end = buffer.data();
+            for (std::size_t i=first; i<first+m; i++)
+                end = detail::put_varint(end, detail::delta_at(p, i));
+            used = end - buffer.data();
+        }
+        out.write(buffer.data(), used);
+    }
+    out.flush();
+}
+
+} // namespace iosc
@@ -0,0 +1,376 @@
+#pragma once
+
+#include "ioscript.h"
+#include "serialize.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace iosc {
+
+/// "fanout.h" ///
+
+// Fan-out: an object serialized once, and the result sent to any number of Processes and Scripts, of
+// any runtime types - quick thumbnails from Gnuplot and full reports from Python, say.  Wrap the object
+// with shared(), and bind the wrapper like any other type:
+//
+//     template <> struct binds_to<shared<Trace>> { using type = variant<Thumbnail, Report>; };
+//
+//     shared<Trace> trace(std::move(t));
+//     gnuplot.run(trace);        // Serializes it
+//     python.run(trace);         // Sends the same bytes again
+//
+// A snippet reaches the object itself with `trace.value()` (or ->), and sends it with serialize() as
+// usual.  The first serialize() runs the object's own serializer once, into a shared_payload, and every
+// send after that is of the payload: the same bytes on the wire.  A reader of something other than
+// Python can skip the schema line (shared_payload::schemaBytes), e.g. gnuplot's `binary skip=`.
+//
+// On Linux a payload is kept in a sealed memfd, and sent with Process::send_file, so the pipes are
+// spliced the payload's pages rather than copies of them; elsewhere it's kept in memory.  Payloads are
+// immutable and reference counted, so one can be sent from several threads at once, and lives as long as
+// any copy of it (or of the shared<T> holding it).  fan_out() sends one to several Processes at once.
+
+// Serializes into memory: the runtime of the Process a payload is captured with
+struct Capture { static constexpr const char* cmd = ""; };
+
+namespace detail {
+
+// Appends to a memfd where there is one, or else to memory, through a buffer of its own
+class payload_buf : public std::streambuf
+{
+public:
+    payload_buf() : buffer_(1 << 16)
+    {
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+        fd_ = memfd_create("ioscript-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+    }
+
+    ~payload_buf()
+    {
+        if (fd_ != -1)
+            close(fd_);
+    }
+
+    int fd() const { return fd_; }
+    std::size_t size() const { return size_ + (pptr() - pbase()); }
+    bool good() const { return good_; }
+
+    // Ends the capture: the descriptor (or -1) and bytes held are the caller's
+    int release(std::vector<char>& bytes)
+    {
+        sync();
+        bytes = std::move(bytes_);
+        int fd = fd_;
+        fd_ = -1;
+        return fd;
+    }
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        if (sync() == -1)
+            return traits_type::eof();
+        if (c != traits_type::eof()) {
+            *pptr() = char(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    // Large writes go straight through
+    std::streamsize xsputn(const char* s, std::streamsize n) override
+    {
+        if (n < std::streamsize(buffer_.size()) / 4)
+            return std::streambuf::xsputn(s, n);
+        if (sync() == -1)
+            return 0;
+        append(s, std::size_t(n));
+        return n;
+    }
+
+    int sync() override
+    {
+        append(pbase(), pptr() - pbase());
+        setp(buffer_.data(), buffer_.data() + buffer_.size());
+        return good_ ? 0 : -1;
+    }
+
+private:
+    void append(const char* p, std::size_t n)
+    {
+        size_ += n;
+        if (fd_ == -1) {
+            bytes_.insert(bytes_.end(), p, p + n);
+            return;
+        }
+        while (n) {
+            ssize_t r = write(fd_, p, n);
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                good_ = false;
+                return;
+            }
+            p += r;
+            n -= r;
+        }
+    }
+
+    std::vector<char> buffer_;
+    std::vector<char> bytes_;
+    std::size_t size_ = 0;
+    int fd_ = -1;
+    bool good_ = true;
+};
+
+} // namespace detail
+
+// What serializers write is kept rather than sent.  Every channel is the one payload, so a serializer
+// must write to a single channel.  Nothing is recorded or digested, and there are no delta frames.
+template <>
+class Process<Capture>
+{
+public:
+    Process() : out_(&buf_) {}
+
+    Process(const Process&) = delete;
+    Process& operator=(const Process&) = delete;
+
+    class capture_ostream : public std::ostream
+    {
+    public:
+        explicit capture_ostream(detail::payload_buf* buf) : std::ostream(buf) {}
+        bool drain() { return !flush().fail(); }
+    };
+
+    capture_ostream& data_out(unsigned) { return out_; }
+    unsigned numChannels() { return 1; }
+
+    Recorder* recorder() { return nullptr; }
+    bool digesting() const { return false; }
+    void digestOnly(unsigned, const std::string&) {}
+    DeltaFrames* deltaFrames() { return nullptr; }
+
+    send_ticket send(unsigned, const void* data, std::size_t n)
+    {
+        out_.write(static_cast<const char*>(data), n);
+        return send_ticket{};
+    }
+
+    bool send_file(unsigned, int fd, off_t offset, std::size_t n)
+    {
+        std::vector<char> buffer(std::min<std::size_t>(n, 1 << 20));
+        while (n) {
+            ssize_t r = pread(fd, buffer.data(), std::min(n, buffer.size()), offset);
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                return false;
+            out_.write(buffer.data(), r);
+            offset += r;
+            n -= r;
+        }
+        return true;
+    }
+
+    bool good() { return out_.drain() && buf_.good(); }
+    std::size_t size() const { return buf_.size(); }
+    int release(std::vector<char>& bytes) { out_.flush(); return buf_.release(bytes); }
+
+private:
+    detail::payload_buf buf_;
+    capture_ostream out_;
+};
+
+// The bytes an object serializes to, on the wire format of serialize.h.  Copies share them.
+class shared_payload
+{
+public:
+    shared_payload() {}
+
+    // Runs serialize(process, c, obj) once, into a new payload
+    template <typename T>
+    static shared_payload of(const T& obj)
+    {
+        Process<Capture> capture;
+        serialize(capture, 0, obj);
+        if (!capture.good()) {
+            std::cerr << "(ioscript) shared_payload: could not keep the " << capture.size()
+                      << " bytes serialized" << std::endl;
+            assert(false);
+        }
+
+        auto storage = std::make_shared<Storage>();
+        storage->size = capture.size();
+        storage->fd = capture.release(storage->bytes);
+#ifdef F_SEAL_WRITE
+        if (storage->fd != -1)
+            fcntl(storage->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+        storage->schema = storage->find('\n');
+
+        shared_payload payload;
+        payload.storage_ = std::move(storage);
+        return payload;
+    }
+
+    bool empty() const { return !storage_; }
+    std::size_t size() const { return storage_ ? storage_->size : 0; }
+
+    // The length of the first line, the schema (with its newline): what precedes the records
+    std::size_t schemaBytes() const { return storage_ ? storage_->schema : 0; }
+
+    // The memfd holding the payload, or -1 if it's held in memory
+    int fd() const { return storage_ ? storage_->fd : -1; }
+
+    // The payload read back, e.g. to check it
+    std::vector<char> bytes() const
+    {
+        if (!storage_)
+            return {};
+        if (storage_->fd == -1)
+            return storage_->bytes;
+        std::vector<char> bytes(storage_->size);
+        std::size_t done = 0;
+        while (done < bytes.size()) {
+            ssize_t r = pread(storage_->fd, bytes.data() + done, bytes.size() - done, off_t(done));
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                break;
+            done += r;
+        }
+        bytes.resize(done);
+        return bytes;
+    }
+
+    // Write it all to channel c of `process`
+    template <typename P>
+    bool sendTo(Process<P>& process, unsigned c) const
+    {
+        if (!storage_)
+            return true;
+        if (storage_->fd != -1)
+            return process.send_file(c, storage_->fd, 0, storage_->size);
+        auto& out = process.data_out(c);
+        out.write(storage_->bytes.data(), storage_->bytes.size());
+        return out.drain();
+    }
+
+private:
+    struct Storage
+    {
+        int fd = -1;
+        std::vector<char> bytes;    // If there's no fd
+        std::size_t size = 0;
+        std::size_t schema = 0;
+
+        ~Storage()
+        {
+            if (fd != -1)
+                close(fd);
+        }
+
+        std::size_t find(char ch) const
+        {
+            const std::size_t n = std::min<std::size_t>(size, 1 << 16);
+            if (fd == -1) {
+                auto it = std::find(bytes.begin(), bytes.begin() + n, ch);
+                return it == bytes.begin() + n ? 0 : std::size_t(it - bytes.begin()) + 1;
+            }
+            std::vector<char> head(n);
+            ssize_t r = pread(fd, head.data(), n, 0);
+            auto it = std::find(head.begin(), head.begin() + std::max<ssize_t>(r, 0), ch);
+            return r <= 0 || it == head.begin() + r ? 0 : std::size_t(it - head.begin()) + 1;
+        }
+    };
+
+    std::shared_ptr<const Storage> storage_;
+};
+
+template <typename T>
+shared_payload payload(const T& obj)
+{
+    return shared_payload::of(obj);
+}
+
+// An object, and its payload once first serialized.  Copies share both.
+template <typename T>
+class shared
+{
+public:
+    explicit shared(T value) : state_(std::make_shared<State>(std::move(value))) {}
+
+    const T& value() const { return state_->value; }
+    const T& operator*() const { return state_->value; }
+    const T* operator->() const { return &state_->value; }
+
+    // Serializes the object on first use, once however many threads ask at once
+    const shared_payload& payload() const
+    {
+        std::call_once(state_->once, [this] { state_->payload = shared_payload::of(state_->value); });
+        return state_->payload;
+    }
+
+private:
+    struct State
+    {
+        explicit State(T v) : value(std::move(v)) {}
+        const T value;
+        std::once_flag once;
+        shared_payload payload;
+    };
+
+    std::shared_ptr<State> state_;
+};
+
+template <typename P>
+void serialize(Process<P>& process, unsigned c, const shared_payload& payload)
+{
+    if (!payload.sendTo(process, c)) {
+        std::cerr << "(ioscript) couldn't send a payload of " << payload.size() << " bytes on channel " << c << std::endl;
+        assert(false);
+    }
+}
+
+template <typename P, typename T>
+void serialize(Process<P>& process, unsigned c, const shared<T>& obj)
+{
+    serialize(process, c, obj.payload());
+}
+
+// Send `payload` on channel c of each of `processes` at once, from a thread per process after the first,
+// so that none waits on another's reader.  Returns whether it all went, once it has.
+template <typename P, typename... Ps>
+bool fan_out(const shared_payload& payload, unsigned c, Process<P>& first, Process<Ps>&... rest)
+{
+    std::atomic<bool> ok{true};
+    std::vector<std::thread> threads;
+    int expand[] = {0, (threads.emplace_back([&ok, &payload, c, &rest] {
+        if (!payload.sendTo(rest, c))
+            ok.store(false);
+    }), 0)...};
+    (void)expand;
+
+    if (!payload.sendTo(first, c))
+        ok.store(false);
+    for (auto& thread : threads)
+        thread.join();
+    return ok.load();
+}
+
+} // namespace iosc
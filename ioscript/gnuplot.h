@@ -16,4 +16,36 @@ void addPrivateHeader(Script<Gnuplot,S>& python)
 {
 }
 
+// Send the plot back to C++ (see ProcessOptions::output) instead of to a file, e.g.
+// `script.run(GnuplotOutput{"pngcairo"}, obj)`
+struct GnuplotOutput
+{
+    const char* terminal = "png";
+
+    void operator()(Process<Gnuplot>& gnuplot) const
+    {
+        if (gnuplot.fd_out() == -1) {
+            std::cerr << "(ioscript) GnuplotOutput needs ProcessOptions::output" << std::endl;
+            return;
+        }
+        gnuplot << "set terminal " << terminal << "\n"
+                << "set output '/dev/fd/" << gnuplot.fd_out() << "'\n";
+    }
+};
+
+// The marks around a snippet's code.  The end mark resets `set print`, so a snippet printing to a file
+// of its own must set it again each run.
+template <>
+struct snippet_timer<Gnuplot> {
+    static constexpr bool supported = true;
+    static void begin(Process<Gnuplot>& gnuplot, unsigned) {
+        gnuplot << "iosc_t0 = time(0.0)\n";
+    }
+    static void end(Process<Gnuplot>& gnuplot, unsigned id) {
+        gnuplot << "set print '/dev/fd/" << gnuplot.fd_timing() << "' append\n"
+                << "print sprintf('" << id << " %.0f', (time(0.0) - iosc_t0) * 1e9)\n"
+                << "set print\n";
+    }
+};
+
 } // namespace iosc
@@ -1,15 +1,46 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstddef>
+#include <cerrno>
+#include <cstdlib>
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <iterator>
+#include <list>
+#include <memory>
 #include <sstream>
 #include <streambuf>
+#include <string>
+#include <thread>
 #include <vector>
 #include <tuple>
 #include <type_traits>
+#include <typeindex>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
 
-#include <unistd.h>  // for write
+#ifdef __GNUG__
+#include <cxxabi.h>  // for __cxa_demangle
+#endif
+#include <fcntl.h>   // for open, fcntl, splice
+#include <sched.h>   // for sched_setaffinity, sched_setscheduler
+#include <sys/ioctl.h> // for FIONREAD
+#include <sys/resource.h> // for setrlimit
+#include <sys/socket.h> // for sendmsg, SCM_RIGHTS
+#include <sys/un.h>  // for sockaddr_un
+#include <sys/uio.h> // for writev, vmsplice
+#include <sys/wait.h> // for waitpid
+#include <unistd.h>  // for write, fork, exec
+#ifdef __linux__
+    #include <sys/syscall.h> // for SYS_ioprio_set
+#endif
 
 constexpr unsigned NUM_OPEN_CHANNELS = 16;
 
@@ -48,31 +79,699 @@ namespace iosc {
 #endif
 
 
+// The element type of binary output returned from a subprocess
+#if __cplusplus >= 201703L
+    using byte = std::byte;
+#else
+    using byte = unsigned char;
+#endif
+
+
 /// "Process.h" ///
 
+// The two ends of a data channel's pipe
+struct ChannelFd {
+    int fd_r;
+    int fd_w;
+};
+
+// Send a message on a UNIX socket together with duplicates of `fds` (SCM_RIGHTS)
+inline bool sendFds(int sock, const void* data, std::size_t n, const std::vector<int>& fds)
+{
+    iovec iov = { const_cast<void*>(data), n };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    std::vector<char> control(CMSG_SPACE(fds.size() * sizeof(int)));
+    if (!fds.empty()) {
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+    }
+
+    ssize_t r;
+    while ((r = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {}
+    return r == ssize_t(n);
+}
+
+// Records everything a `Process` sends to its subprocess - the header, the code stream and each data
+// channel - into a bundle file, so that a run can be replayed later against a fresh interpreter without
+// the C++ application (see replay.h).
+//
+// A bundle is the magic "IOSCREC1" followed by records of
+//     u8 kind, u32 stream, u64 time (ns since the first record of the run), u64 length, bytes[length]
+// in host byte order.  Consecutive writes to the same stream are merged into one record.
+// A run is delimited by RunBegin and RunEnd records.  RunBegin holds the command, followed by a u32
+// channel count and an (i32 fd_r, i32 fd_w) pair per channel, as those numbers appear in the code, and
+// u32 flags (bit 0: channels were multiplexed, bit 1: an output pipe was open, its i32 fd_w follows,
+// bit 2: code was framed for incremental execution, and is recorded with its framing).
+// Data records always carry the logical channel.
+class Recorder
+{
+public:
+    enum Kind : unsigned char {
+        RunBegin = 1,
+        Header,
+        Code,
+        Data,
+        RunEnd
+    };
+
+    Recorder(const std::string& path)
+    {
+        // Keep the descriptor clear of the low numbers the channels of later runs will reuse
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            int moved = fcntl(fd, F_DUPFD_CLOEXEC, 256);
+            close(fd);
+            fd = moved;
+        }
+        if (fd == -1 || !(file_ = fdopen(fd, "wb"))) {
+            std::cerr << "(ioscript) Recorder could not open " << path << std::endl;
+            if (fd != -1)
+                close(fd);
+            return;
+        }
+        fwrite("IOSCREC1", 1, 8, file_);
+    }
+    ~Recorder()
+    {
+        if (file_)
+            fclose(file_);
+    }
+
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+
+    bool good() const { return file_ != nullptr; }
+
+    // The run's description is written with its first event, so that processes which never send
+    // anything leave no trace in the bundle
+    void beginRun(const char* cmd, const std::vector<ChannelFd>& fds, std::uint32_t flags, int outputFd = -1,
+                  int timingFd = -1)
+    {
+        std::string desc(cmd);
+        desc.push_back('\0');
+        appendPod(desc, std::uint32_t(fds.size()));
+        for (auto& fd : fds) {
+            appendPod(desc, std::int32_t(fd.fd_r));
+            appendPod(desc, std::int32_t(fd.fd_w));
+        }
+        if (outputFd != -1)
+            flags |= 2;
+        if (timingFd != -1)
+            flags |= 8;
+        appendPod(desc, flags);
+        if (outputFd != -1)
+            appendPod(desc, std::int32_t(outputFd));
+        if (timingFd != -1)
+            appendPod(desc, std::int32_t(timingFd));
+        runDesc_ = desc;
+        started_ = false;
+    }
+
+    void endRun()
+    {
+        if (started_) {
+            flush();
+            writeRecord(RunEnd, 0, now(), nullptr, 0);
+            fflush(file_);
+        }
+        started_ = false;
+    }
+
+    // While set, bytes on the code stream are recorded as Header rather than Code
+    void header(bool inHeader) { inHeader_ = inHeader; }
+
+    void code(const char* s, std::size_t n)          { append(inHeader_ ? Header : Code, 0, s, n); }
+    void data(unsigned c, const char* s, std::size_t n)  { append(Data, c, s, n); }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    template <typename T>
+    static void appendPod(std::string& buf, T value) {
+        buf.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    std::uint64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t0_).count();
+    }
+
+    void append(Kind kind, unsigned stream, const char* s, std::size_t n)
+    {
+        if (!file_ || n == 0)
+            return;
+
+        if (!started_) {
+            t0_ = clock::now();
+            writeRecord(RunBegin, 0, 0, runDesc_.data(), runDesc_.size());
+            started_ = true;
+        }
+
+        if (!pending_.empty() && (kind != pendingKind_ || stream != pendingStream_ || pending_.size() > (1u << 20)))
+            flush();
+
+        if (pending_.empty()) {
+            pendingKind_ = kind;
+            pendingStream_ = stream;
+            pendingTime_ = now();
+        }
+        pending_.append(s, n);
+    }
+
+    void flush()
+    {
+        if (!pending_.empty())
+            writeRecord(pendingKind_, pendingStream_, pendingTime_, pending_.data(), pending_.size());
+        pending_.clear();
+    }
+
+    void writeRecord(Kind kind, std::uint32_t stream, std::uint64_t time, const char* s, std::uint64_t n)
+    {
+        unsigned char k = kind;
+        fwrite(&k, 1, 1, file_);
+        fwrite(&stream, sizeof(stream), 1, file_);
+        fwrite(&time, sizeof(time), 1, file_);
+        fwrite(&n, sizeof(n), 1, file_);
+        if (n)
+            fwrite(s, 1, n, file_);
+    }
+
+    FILE* file_ = nullptr;
+    std::string runDesc_;
+    bool started_ = false;
+    bool inHeader_ = false;
+    clock::time_point t0_;
+
+    std::string pending_;
+    Kind pendingKind_ = Code;
+    unsigned pendingStream_ = 0;
+    std::uint64_t pendingTime_ = 0;
+};
+
+// A 64-bit digest of everything a run sends - the code stream and each data channel - computed as the
+// bytes go by (see Process::digest), so that identical runs can be recognised without keeping a copy.
+// Each stream is hashed separately, a word at a time, so the result doesn't depend on how the writes
+// to a stream were split up or interleaved with writes to others.  Not cryptographic.
+class RunDigest
+{
+public:
+    void code(const char* s, std::size_t n)              { lane(0).add(s, n); }
+    void data(unsigned c, const char* s, std::size_t n)  { if (n) lane(c + 1).add(s, n); }
+
+    std::uint64_t value() const
+    {
+        std::uint64_t h = 0x243f6a8885a308d3;
+        for (const auto& l : lanes_) {
+            h = mix(h ^ l.value());
+            h = mix(h ^ l.length);
+        }
+        return h;
+    }
+
+private:
+    static std::uint64_t mix(std::uint64_t x)
+    {
+        // The splitmix64 finalizer
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+    struct Lane {
+        std::uint64_t h = 0x9e3779b97f4a7c15;
+        std::uint64_t length = 0;
+        char tail[8];
+        unsigned tailLength = 0;
+
+        void word(std::uint64_t w) {
+            h ^= w * 0x9e3779b97f4a7c15;
+            h = ((h << 27) | (h >> 37)) * 0x94d049bb133111eb;
+        }
+
+        void add(const char* s, std::size_t n)
+        {
+            length += n;
+            if (tailLength) {
+                std::size_t k = std::min<std::size_t>(n, 8 - tailLength);
+                std::memcpy(tail + tailLength, s, k);
+                tailLength += k;
+                s += k;
+                n -= k;
+                if (tailLength < 8)
+                    return;
+                std::uint64_t w;
+                std::memcpy(&w, tail, 8);
+                word(w);
+                tailLength = 0;
+            }
+            for (; n >= 8; s += 8, n -= 8) {
+                std::uint64_t w;
+                std::memcpy(&w, s, 8);
+                word(w);
+            }
+            std::memcpy(tail, s, n);
+            tailLength = n;
+        }
+
+        std::uint64_t value() const
+        {
+            std::uint64_t w = 0;
+            std::memcpy(&w, tail, tailLength);
+            return mix(h ^ w);
+        }
+    };
+
+    Lane& lane(std::size_t i)
+    {
+        if (i >= lanes_.size())
+            lanes_.resize(i + 1);
+        return lanes_[i];
+    }
+
+    std::vector<Lane> lanes_;
+};
+
+// What a run writes while its digest is taken (see Process::digest), held back in the order it was
+// written: the code, the data of each channel, and the points the code was committed at.  It can then be
+// sent as written, once the digest has been looked up, or dropped.
+class HeldRun
+{
+public:
+    enum Kind : unsigned char {
+        Code,
+        Data,
+        Commit
+    };
+
+    struct Event {
+        Kind kind;
+        unsigned channel;
+        std::string bytes;
+    };
+
+    // Past `maxBytes` held, the rest is only digested, and what was held is dropped
+    HeldRun(RunDigest* digest, std::size_t maxBytes) : digest_(digest), maxBytes_(maxBytes) {}
+
+    void code(const char* s, std::size_t n)              { digest_->code(s, n); append(Code, 0, s, n); }
+    void data(unsigned c, const char* s, std::size_t n)  { digest_->data(c, s, n); append(Data, c, s, n); }
+
+    void commit()
+    {
+        if (complete_ && !events_.empty() && events_.back().kind != Commit)
+            events_.push_back(Event{Commit, 0, std::string()});
+    }
+
+    // Bytes that identify what channel c is sent, without being sent themselves
+    void digestOnly(unsigned c, const char* s, std::size_t n)  { digest_->data(c, s, n); }
+
+    const std::vector<Event>& events() const { return events_; }
+
+    // Whether everything written is held, i.e. maxBytes wasn't passed
+    bool complete() const { return complete_; }
+
+private:
+    void append(Kind kind, unsigned channel, const char* s, std::size_t n)
+    {
+        if (n == 0 || !complete_)
+            return;
+        if (n > maxBytes_ - bytes_) {
+            complete_ = false;
+            std::vector<Event>().swap(events_);
+            return;
+        }
+        bytes_ += n;
+        if (events_.empty() || events_.back().kind != kind || events_.back().channel != channel)
+            events_.push_back(Event{kind, channel, std::string()});
+        events_.back().bytes.append(s, n);
+    }
+
+    RunDigest* digest_;
+    std::vector<Event> events_;
+    std::size_t maxBytes_;
+    std::size_t bytes_ = 0;
+    bool complete_ = true;
+};
+
+// What a session last sent of each series tracked for delta frames (see delta.h): the series' chunks
+// by hash, so that the next frame can send only the chunks that changed.  Valid as long as the
+// interpreter holding the copies the frames patch lives, so clear() it when starting a new one.
+class DeltaFrames
+{
+public:
+    struct Entry {
+        std::string slot;           // The name of the interpreter's copy
+        std::string dtype;
+        std::size_t bytes = 0;
+        std::uint64_t generation = 0;   // Frames sent: 0 for none yet
+        std::vector<std::uint64_t> hashes;
+    };
+
+    // Chunks of `chunkBytes` each: smaller chunks send less around each change, for more hashes
+    explicit DeltaFrames(std::size_t chunkBytes = 4096) : chunkBytes_(std::max<std::size_t>(chunkBytes, 64))
+    {
+        static std::atomic<unsigned> sessions{0};
+        session_ = sessions.fetch_add(1);
+    }
+
+    std::size_t chunkBytes() const { return chunkBytes_; }
+
+    Entry& entry(const std::string& key)
+    {
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            it = entries_.emplace(key, Entry{}).first;
+            it->second.slot = std::to_string(session_) + "." + std::to_string(slots_++);
+        }
+        return it->second;
+    }
+
+    // Forget what was sent: the next frame of each series is sent whole
+    void clear()
+    {
+        for (auto& entry : entries_) {
+            entry.second.generation = 0;
+            entry.second.hashes.clear();
+        }
+    }
+
+    std::size_t size() const { return entries_.size(); }
+
+    static std::uint64_t hash(const char* p, std::size_t n)
+    {
+        // Four independent lanes of 8 bytes, as the chunks are large
+        std::uint64_t h[4] = { 0x9e3779b97f4a7c15, 0xbf58476d1ce4e5b9, 0x94d049bb133111eb, n };
+        for (; n >= 32; p += 32, n -= 32) {
+            for (int k=0; k<4; k++) {
+                std::uint64_t w;
+                std::memcpy(&w, p + 8*k, 8);
+                h[k] ^= w * 0x9e3779b97f4a7c15;
+                h[k] = ((h[k] << 31) | (h[k] >> 33)) * 0xbf58476d1ce4e5b9;
+            }
+        }
+        char tail[32] = {};
+        std::memcpy(tail, p, n);
+        std::uint64_t x = 0;
+        for (int k=0; k<4; k++) {
+            std::uint64_t w;
+            std::memcpy(&w, tail + 8*k, 8);
+            x = mix(x ^ h[k] ^ w);
+        }
+        return x;
+    }
+
+private:
+    static std::uint64_t mix(std::uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+    std::size_t chunkBytes_;
+    unsigned session_ = 0;
+    unsigned slots_ = 0;
+    std::unordered_map<std::string, Entry> entries_;
+};
+
+// Counts the bytes written into a pipe, shared by every stream writing to it and by the send_tickets
+// handed out for it.  Together with the number of bytes still unread in the pipe this tells how far
+// the reader has got.
+struct pipe_counter
+{
+    int fd = -1;
+    std::atomic<std::uint64_t> written{0};
+    std::atomic<bool> closed{false};   // Closed on our side, and the subprocess has exited
+};
+
+// Returned by Process::send() and Process::sent(): done() once the subprocess has read everything
+// written to the channel up to that point.  For a zero-copy send this is the signal that the buffer may
+// be modified or freed again.  Check tickets from the thread that uses the Process.
+class send_ticket
+{
+public:
+    send_ticket() {}  // Nothing to wait for
+    send_ticket(std::shared_ptr<pipe_counter> counter, std::uint64_t end) : counter_(std::move(counter)), end_(end) {}
+
+    bool done() const
+    {
+        if (!counter_ || counter_->closed.load(std::memory_order_acquire))
+            return true;
+
+        // Load the count before asking for what's unread, so a concurrent write can only make this conservative
+        std::uint64_t written = counter_->written.load(std::memory_order_acquire);
+        int unread = 0;
+        if (ioctl(counter_->fd, FIONREAD, &unread) == -1)
+            return false;
+        return written - unread >= end_;
+    }
+
+    void wait() const
+    {
+        while (!done())
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+private:
+    std::shared_ptr<pipe_counter> counter_;
+    std::uint64_t end_ = 0;
+};
+
 // Adapted from Nicolai M. Josuttis, The C++ Standard Library - A Tutorial and Reference, 2nd Edition
 class fdoutbuf : public std::streambuf
 {
 protected:
     int fd_;
+    Recorder* recorder_ = nullptr;
+    unsigned channel_ = 0;
+
+    // Framed mode, see below
+    bool framed_ = false;
+    std::vector<char> frame_;   // Also the buffer while batching unframed writes
+    bool batching_ = false;
 
 public:
     fdoutbuf(int fd) : fd_(fd) {}
 
+    // Framed mode: buffer writes and send them to `fd` as frames tagged with `channel`, so that any
+    // number of channels can share one pipe.  A frame is a u32 channel and u32 length in host byte
+    // order, followed by that many bytes.
+    fdoutbuf(int fd, unsigned channel) : fd_(fd), channel_(channel), framed_(true), frame_(1 << 16)
+    {
+        setp(frame_.data(), frame_.data() + frame_.size());
+    }
+
+    void record(Recorder* recorder, unsigned channel) {
+        recorder_ = recorder;
+        channel_ = channel;
+    }
+
+    void count(pipe_counter* counter) { counter_ = counter; }
+
+    // While set, writes go to `held` instead of the pipe
+    void hold(HeldRun* held) { held_ = held; }
+
+    // While batching, writes are buffered and flushes ignored, so that the data for a whole range of
+    // objects goes out in a few large writes.  Ending the batch sends everything.
+    void batch(bool on)
+    {
+        if (on == batching_)
+            return;
+        if (!framed_) {
+            if (on) {
+                frame_.resize(1 << 16);
+                setp(frame_.data(), frame_.data() + frame_.size());
+            }
+            else {
+                flushRaw();
+                setp(nullptr, nullptr);
+            }
+        }
+        batching_ = on;
+        if (!on)
+            drain();
+    }
+
+    // Send anything buffered, batching or not
+    bool drain()
+    {
+        return framed_ ? flushFrame() : flushRaw();
+    }
+
 protected:
+    pipe_counter* counter_ = nullptr;
+    HeldRun* held_ = nullptr;
+
+    void counted(ssize_t n) {
+        if (counter_ && n > 0)
+            counter_->written.fetch_add(n, std::memory_order_relaxed);
+    }
+
     virtual int_type overflow(int_type c)
     {
+        if (framed_) {
+            if (!flushFrame())
+                return EOF;
+            if (c != EOF) {
+                *pptr() = c;
+                pbump(1);
+            }
+            return c;
+        }
+
+        if (batching_) {
+            if (!flushRaw())
+                return EOF;
+            if (c != EOF) {
+                *pptr() = c;
+                pbump(1);
+            }
+            return c;
+        }
+
         if (c != EOF) {
             char z = c;
+            if (held_) {
+                held_->data(channel_, &z, 1);
+                return c;
+            }
             if (write(fd_, &z, 1) != 1) {
                 return EOF;
             }
+            counted(1);
+            if (recorder_)
+                recorder_->data(channel_, &z, 1);
         }
         return c;
     }
 
     virtual std::streamsize xsputn(const char* s, std::streamsize num) {
-        return write(fd_, s, num);
+        if (framed_) {
+            if (num > epptr() - pptr()) {
+                if (!flushFrame())
+                    return 0;
+            }
+            if (num <= epptr() - pptr()) {
+                std::copy(s, s + num, pptr());
+                pbump(num);
+            }
+            else if (!writeFrame(s, num)) {
+                return 0;
+            }
+            return num;
+        }
+
+        if (batching_) {
+            if (num > epptr() - pptr() && !flushRaw())
+                return 0;
+            if (num <= epptr() - pptr()) {
+                std::copy(s, s + num, pptr());
+                pbump(num);
+                return num;
+            }
+        }
+
+        if (held_) {
+            held_->data(channel_, s, num);
+            return num;
+        }
+
+        std::streamsize n = write(fd_, s, num);
+        counted(n);
+        if (recorder_ && n > 0)
+            recorder_->data(channel_, s, n);
+        return n;
+    }
+
+    virtual int sync()
+    {
+        if (batching_)
+            return 0;
+        if (framed_ && !flushFrame())
+            return -1;
+        return 0;
+    }
+
+private:
+    bool flushRaw()
+    {
+        const char* s = pbase();
+        std::size_t num = pptr() - pbase();
+        setp(pbase(), epptr());
+        if (held_) {
+            held_->data(channel_, s, num);
+            return true;
+        }
+        if (recorder_ && num)
+            recorder_->data(channel_, s, num);
+
+        while (num) {
+            ssize_t n = write(fd_, s, num);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            counted(n);
+            s += n;
+            num -= n;
+        }
+        return true;
+    }
+
+    bool flushFrame()
+    {
+        bool ok = writeFrame(pbase(), pptr() - pbase());
+        setp(frame_.data(), frame_.data() + frame_.size());
+        return ok;
+    }
+
+    // Framed writes are recorded as they're sent, since the put area is also filled directly by std::ostream
+    bool writeFrame(const char* s, std::size_t num)
+    {
+        if (held_) {
+            held_->data(channel_, s, num);
+            return true;
+        }
+        if (recorder_ && num)
+            recorder_->data(channel_, s, num);
+
+        while (num)
+        {
+            std::uint32_t header[2] = { std::uint32_t(channel_), std::uint32_t(std::min<std::size_t>(num, 1u << 30)) };
+            iovec iov[2] = { { header, sizeof(header) }, { const_cast<char*>(s), header[1] } };
+
+            std::size_t left = sizeof(header) + header[1];
+            int first = 0;
+            while (left) {
+                ssize_t n = writev(fd_, iov + first, 2 - first);
+                if (n <= 0)
+                    return false;
+                counted(n);
+                left -= n;
+                // Partial write: skip what's been sent
+                while (first < 2 && std::size_t(n) >= iov[first].iov_len) {
+                    n -= iov[first].iov_len;
+                    first++;
+                }
+                if (first < 2) {
+                    iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + n;
+                    iov[first].iov_len -= n;
+                }
+            }
+            s += header[1];
+            num -= header[1];
+        }
+        return true;
     }
 };
 
@@ -85,6 +784,17 @@ public:
     fd_ostream (int fd) : std::ostream(0), buf_(fd) {
         rdbuf(&buf_);
     }
+
+    // Framed, see fdoutbuf
+    fd_ostream (int fd, unsigned channel) : std::ostream(0), buf_(fd, channel) {
+        rdbuf(&buf_);
+    }
+
+    void record(Recorder* recorder, unsigned channel) { buf_.record(recorder, channel); }
+    void count(pipe_counter* counter) { buf_.count(counter); }
+    void hold(HeldRun* held) { buf_.hold(held); }
+    void batch(bool on) { buf_.batch(on); }
+    bool drain() { return buf_.drain(); }
 };
 
 class cf_outbuffer : public std::streambuf
@@ -92,11 +802,54 @@ class cf_outbuffer : public std::streambuf
 public:
     cf_outbuffer(FILE* file) : file_(file) {}
 
+    void record(Recorder* recorder) { recorder_ = recorder; }
+
+    // While set, code goes to `held` instead of the subprocess, unframed, and so do commits
+    void hold(HeldRun* held) { held_ = held; }
+
+    // Framed mode: code is collected into chunks, each sent as a u32 length (host byte order) followed by
+    // that many bytes when committed.  An interpreter bootstrap can then run each chunk as it arrives.
+    void frame(bool on) { framed_ = on; }
+
+    // End the current chunk of code and send it, so far as the subprocess may start running it
+    void commit()
+    {
+        if (held_) {
+            held_->commit();
+            return;
+        }
+        if (framed_ && !chunk_.empty()) {
+            std::uint32_t n = chunk_.size();
+            writeRaw(reinterpret_cast<const char*>(&n), sizeof(n));
+            writeRaw(chunk_.data(), n);
+            chunk_.clear();
+        }
+        fflush(file_);
+    }
+
+    // Write bytes as they are, framed or not
+    bool writeRaw(const char* s, std::size_t num)
+    {
+        if (held_) {
+            held_->code(s, num);
+            return true;
+        }
+        std::size_t n = fwrite(s, 1, num, file_);
+        if (recorder_ && n > 0)
+            recorder_->code(s, n);
+        return n == num;
+    }
+
 protected:
     virtual int_type overflow(int_type c)
     {
         if (c != traits_type::eof()) {
-            if (fwrite(&c, 1, 1, file_) != 1) {
+            char z = c;
+            if (framed_ && !held_) {
+                chunk_.push_back(z);
+                return c;
+            }
+            if (!writeRaw(&z, 1)) {
                 return traits_type::eof();
             }
         }
@@ -104,11 +857,42 @@ protected:
     }
 
     virtual std::streamsize xsputn(const char* s, std::streamsize num) {
-        return fwrite(s, 1, num, file_);
+        if (held_) {
+            held_->code(s, num);
+            return num;
+        }
+        if (framed_) {
+            chunk_.append(s, num);
+            return num;
+        }
+        std::streamsize n = fwrite(s, 1, num, file_);
+        if (recorder_ && n > 0)
+            recorder_->code(s, n);
+        return n;
+    }
+
+    // So that std::flush reaches the subprocess.  (When framed, only a commit ends a chunk)
+    virtual int sync() {
+        if (batching_ || framed_ || held_)
+            return 0;
+        return fflush(file_) == 0 ? 0 : -1;
+    }
+
+public:
+    // See fdoutbuf::batch
+    void batch(bool on) {
+        batching_ = on;
+        if (!on)
+            fflush(file_);
     }
 
 private:
     FILE* file_;
+    Recorder* recorder_ = nullptr;
+    HeldRun* held_ = nullptr;
+    bool batching_ = false;
+    bool framed_ = false;
+    std::string chunk_;
 };
 
 struct cf_ostream : public std::ostream
@@ -117,10 +901,168 @@ struct cf_ostream : public std::ostream
         rdbuf(&buffer_);
     }
 
+    void record(Recorder* recorder) { buffer_.record(recorder); }
+    void hold(HeldRun* held) { buffer_.hold(held); }
+    void batch(bool on) { buffer_.batch(on); }
+    void frame(bool on) { buffer_.frame(on); }
+    void commit() { buffer_.commit(); }
+    bool writeRaw(const char* s, std::size_t num) { return buffer_.writeRaw(s, num); }
+
 protected:
     cf_outbuffer buffer_;
 };
 
+// How a subprocess is started: applied in the child between fork and exec, so the interpreter and
+// everything it starts inherit it.  Each setting is best-effort - a failure is reported on stderr and
+// the subprocess still runs.
+struct LaunchPolicy
+{
+    enum Scheduler { Inherit, Batch, Idle };
+
+    std::vector<int> cpus;          // CPU affinity (Linux); empty inherits ours
+    int nice = 0;                   // Added to our nice value
+    Scheduler scheduler = Inherit;  // SCHED_BATCH or SCHED_IDLE (Linux)
+    int ioClass = -1;               // I/O priority class (Linux): 1 realtime, 2 best-effort, 3 idle; -1 inherits
+    int ioLevel = 4;                // I/O priority level within the class, 0 (highest) to 7
+    rlim_t addressSpace = 0;        // RLIMIT_AS in bytes, 0 for none
+    rlim_t cpuSeconds = 0;          // RLIMIT_CPU in seconds, 0 for none
+};
+
+// The launch policy for each runtime type, with specializations in client code
+template <typename T>
+struct launch_policy {
+    static LaunchPolicy get() { return LaunchPolicy{}; }
+};
+
+// What a subprocess consumed over its life, as wait4(2) reports it once it has exited (including any
+// processes it started and waited for).  Times are in seconds, and the peak resident set in KiB.
+struct ResourceUsage
+{
+    bool measured = false;      // Whether the figures below were reported: false e.g. for a lost server
+    double userSeconds = 0;
+    double systemSeconds = 0;
+    std::int64_t maxRssKb = 0;
+    std::uint64_t minorFaults = 0;
+    std::uint64_t majorFaults = 0;          // Those that needed I/O
+    std::uint64_t voluntarySwitches = 0;    // Context switches while waiting, e.g. for a pipe
+    std::uint64_t involuntarySwitches = 0;  // Preempted
+    int exitCode = 0;           // As passed to exit(), unless killed by a signal
+    int signal = 0;             // The signal that ended it, or 0
+
+    static ResourceUsage of(int status, const struct rusage& ru)
+    {
+        ResourceUsage usage;
+        usage.measured = true;
+        usage.userSeconds = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6;
+        usage.systemSeconds = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+#ifdef __APPLE__
+        usage.maxRssKb = ru.ru_maxrss / 1024;   // In bytes there
+#else
+        usage.maxRssKb = ru.ru_maxrss;
+#endif
+        usage.minorFaults = ru.ru_minflt;
+        usage.majorFaults = ru.ru_majflt;
+        usage.voluntarySwitches = ru.ru_nvcsw;
+        usage.involuntarySwitches = ru.ru_nivcsw;
+        usage.exit(status);
+        return usage;
+    }
+
+    // Split a wait status into exitCode and signal
+    void exit(int status)
+    {
+        exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+        signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    }
+};
+
+// Options applied when a Process opens its channels and starts the subprocess
+struct ProcessOptions
+{
+    // Carry every data channel over a single pipe as frames tagged with the channel (see fdoutbuf),
+    // instead of a pipe per channel.  The number of channels is then unbounded at a constant cost of
+    // two file descriptors, and `data_out(c)` opens channel c on first use.  fd_r(c) and fd_w(c) return
+    // the shared pipe, so the reader must demultiplex (PythonHeader does so for Python).
+    bool multiplexed = false;
+
+    // Overrides `launch_policy<T>` for the runtime type, when set
+    std::shared_ptr<const LaunchPolicy> launch;
+
+    // Open a pipe back from the subprocess, on descriptor fd_out(), for output such as rendered images.
+    // Everything written to it is collected in memory and handed back by Process::output() once the
+    // subprocess has exited.
+    bool output = false;
+
+    // Run on an interpreter from the pool of an ioscriptd server listening on this UNIX socket (see
+    // server.h), rather than starting one.  The channels are handed over with their descriptor numbers
+    // unchanged, and the subprocess writes to our stdout and stderr; the launch policy is the server's.
+    // Falls back to starting the subprocess here if the server can't be reached.
+    std::string server;
+
+    // Time each snippet's code in the interpreter: Script marks where each one starts and ends (see
+    // snippet_timer), and the interpreter writes the time between them to another pipe back, on
+    // fd_timing().  Each run's result then breaks its time down by snippet type (RunResult::timings).
+    bool timing = false;
+
+    // Have the interpreter run code as it arrives, rather than once the code stream has closed, so that
+    // it works while later objects are still being sent.  Code is committed after each snippet (and
+    // before data is written), and with a bootstrap for the runtime (see incremental_cmd) is framed so
+    // that each commit is run whole.  Without one, commits just flush, as suits line-by-line runtimes.
+    bool incremental = false;
+};
+
+// The command that runs an ioscriptd pool interpreter for a runtime type (see server.h), with
+// specializations in the runtime headers.  nullptr if the runtime can't be served.
+template <typename T>
+struct server_cmd {
+    static const char* cmd() { return nullptr; }
+};
+
+// What a pool interpreter reports of each run, passed on by ioscriptd to the Process: the i32 wait status,
+// then the run's usage as i64 microseconds of user and system time, peak resident set in KiB, minor and
+// major faults and voluntary and involuntary context switches, in host byte order.  An interpreter may
+// send the status alone.
+#pragma pack(push, 1)
+struct server_report
+{
+    std::int32_t status = -1;
+    std::int64_t userUs = 0;
+    std::int64_t systemUs = 0;
+    std::int64_t maxRssKb = 0;
+    std::int64_t minorFaults = 0;
+    std::int64_t majorFaults = 0;
+    std::int64_t voluntarySwitches = 0;
+    std::int64_t involuntarySwitches = 0;
+
+    ResourceUsage usage() const
+    {
+        ResourceUsage usage;
+        usage.measured = true;
+        usage.userSeconds = userUs * 1e-6;
+        usage.systemSeconds = systemUs * 1e-6;
+        usage.maxRssKb = maxRssKb;
+        usage.minorFaults = std::uint64_t(minorFaults);
+        usage.majorFaults = std::uint64_t(majorFaults);
+        usage.voluntarySwitches = std::uint64_t(voluntarySwitches);
+        usage.involuntarySwitches = std::uint64_t(involuntarySwitches);
+        usage.exit(status);
+        return usage;
+    }
+};
+#pragma pack(pop)
+
+// The command that runs framed code chunks for a runtime type (see ProcessOptions::incremental), with
+// specializations in the runtime headers.  nullptr if the runtime needs no framing.
+template <typename T>
+struct incremental_cmd {
+    static const char* cmd() { return nullptr; }
+};
+
+// Whether one interpreter outlives the Processes of a runtime type, keeping what they leave in it (see
+// DeltaFrames).  Each Process normally starts an interpreter of its own.
+template <typename T>
+struct persistent_interpreter : std::false_type {};
+
 struct Null    { static constexpr const char* cmd = "cat > /dev/null"; };
 struct Cat     { static constexpr const char* cmd = "cat"; };
 
@@ -128,10 +1070,479 @@ template <typename T>
 class Process
 {
 public:
-    Process(unsigned numChannels)
+    using Fd = ChannelFd;
+
+    Process(unsigned numChannels, const ProcessOptions& options = ProcessOptions{})
+        : options_(options)
+    {
+        assert(options_.multiplexed || numChannels < 1024); // todo
+
+        openChannels(options_.multiplexed ? 1 : numChannels);
+        start(numChannels);
+    }
+
+    // Open the channels on the given file descriptor numbers, e.g. to reproduce the layout of a recorded
+    // run (whose code refers to those numbers).  The descriptors must not already be in use.
+    // When multiplexed, `layout` holds the one shared pipe.  Likewise the write ends of the output and
+    // timing pipes are placed on `outputFd` and `timingFd`, if given.
+    Process(const std::vector<Fd>& layout, const ProcessOptions& options = ProcessOptions{}, int outputFd = -1,
+            int timingFd = -1)
+        : options_(options)
+    {
+        output_.target = outputFd;
+        timing_.target = timingFd;
+
+        openChannels(layout.size());
+
+        // Move every new descriptor out of the way first, since a target may collide with a descriptor
+        // just opened for another channel
+        for (auto& channel : channels_) {
+            channel.fd_r = moveFd(channel.fd_r, 256);
+            channel.fd_w = moveFd(channel.fd_w, 256);
+        }
+        for (unsigned i=0; i<layout.size(); i++) {
+            channels_[i].fd_r = placeFd(channels_[i].fd_r, layout[i].fd_r);
+            channels_[i].fd_w = placeFd(channels_[i].fd_w, layout[i].fd_w);
+        }
+
+        start(options_.multiplexed ? 0 : layout.size());
+    }
+
+    ~Process() { wait(); }
+
+    // Close the code and data streams and wait for the subprocess to exit, and for all its output
+    void wait()
+    {
+        if (!file_)
+            return;
+
+        // Send anything still buffered (framed or batched channels)
+        batchDepth_ = 0;
+        cfout_->batch(false);
+        cfout_->commit();
+        for (auto& out : fdout_) {
+            out->batch(false);
+            out->flush();
+        }
+
+        if (recorder_)
+            recorder_->endRun();
+
+        // Close 'data' pipe
+        for (unsigned i=0; i<channels_.size(); i++)
+        {
+            if (close(channels_[i].fd_w) == -1) {
+                std::cerr << "(ioscript) error closing (write) file descriptor "
+                          << channels_[i].fd_w << " on channel " << i << std::endl;
+                assert(false);
+            }
+        }
+
+        // Close process
+        fclose(file_);
+        file_ = nullptr;
+        int status = 0;
+        if (server_ != -1) {
+            status = serverStatus();
+        }
+        else {
+            struct rusage ru;
+            pid_t r;
+            while ((r = wait4(pid_, &status, 0, &ru)) == -1 && errno == EINTR) {}
+            if (r == pid_)
+                usage_ = ResourceUsage::of(status, ru);
+        }
+        // A wait status, unless the connection to a server was lost
+        if (status != -1)
+            usage_.exit(status);
+        if (usage_.signal)
+            std::cerr << "(ioscript) subprocess was killed by signal " << usage_.signal << " (" << strsignal(usage_.signal) << ")" << std::endl;
+        else if (usage_.exitCode != 0)
+            std::cerr << "(ioscript) subprocess returned with exit code: " << usage_.exitCode << std::endl;
+        status_ = status;
+
+        // Anything the subprocess started may still hold the pipes back
+        if (output_.reader.joinable())
+            output_.reader.join();
+        if (timing_.reader.joinable())
+            timing_.reader.join();
+
+        for (auto& counter : counters_)
+            counter->closed.store(true, std::memory_order_release);
+    }
+
+    // The wait status of the subprocess, once wait() has returned
+    int status() const { return status_; }
+
+    // What the subprocess consumed, likewise
+    const ResourceUsage& usage() const { return usage_; }
+
+    // The bytes written to fd_out() by the subprocess: complete once wait() has returned
+    std::vector<byte>& output() { return output_.bytes; }
+
+    // What the subprocess wrote to fd_timing(), likewise
+    std::vector<byte>& timings() { return timing_.bytes; }
+
+    template <typename U>
+    friend Process& operator<<(Process& process, U&& rhs) {
+        *process.cfout_ << std::forward<U>(rhs);
+        return process;
+    }
+
+    // Manipulators are also templates, so write non-template overloads (three types)
+    using m1 = std::ostream&(*)(std::ostream&);
+    using m2 = std::basic_ios<std::ostream::char_type,std::ostream::traits_type>&
+                    (*)(std::basic_ios<std::ostream::char_type,std::ostream::traits_type>&);
+    using m3 = std::ios_base&(*)(std::ios_base&);
+
+    friend Process& operator<<(Process& process, m1 rhs) {
+        *process.cfout_ << rhs;
+        return process;
+    }
+    friend Process& operator<<(Process& process, m2 rhs) {
+        *process.cfout_ << rhs;
+        return process;
+    }
+    friend Process& operator<<(Process& process, m3 rhs) {
+        *process.cfout_ << rhs;
+        return process;
+    }
+
+    Process(const Process&) = delete;
+    Process& operator=(const Process&) = delete;
+
+    cf_ostream& out()  { return *cfout_; }
+    fd_ostream& data_out(unsigned c) {
+        // The code reading this data must be running first
+        if (options_.incremental)
+            cfout_->commit();
+
+        if (options_.multiplexed) {
+            while (c >= fdout_.size())
+                addChannelStream();
+        }
+        if (c >= fdout_.size())
+            assert(false); // todo
+        return *fdout_[c];
+    }
+
+    unsigned numChannels() { return fdout_.size(); }
+
+    int fd_r(unsigned c) {
+        if (options_.multiplexed)
+            c = 0;
+        if (c >= channels_.size())
+            assert(false);
+        return channels_[c].fd_r;
+    }
+    int fd_w(unsigned c) {
+        if (options_.multiplexed)
+            c = 0;
+        if (c >= channels_.size())
+            assert(false);
+        return channels_[c].fd_w;
+    }
+
+    // The pipes as opened (a single one when multiplexed)
+    const std::vector<Fd>& channels() const { return channels_; }
+
+    // End the current chunk of code: with ProcessOptions::incremental the subprocess may now run it.
+    // Script commits after each snippet.
+    void commit()
+    {
+        if (options_.incremental)
+            cfout_->commit();
+    }
+
+    // Write code exactly as given: already framed when framesCode(), as recorded from such a run
+    void out_raw(const char* s, std::size_t n) { cfout_->writeRaw(s, n); }
+
+    bool framesCode() const { return options_.incremental && incremental_cmd<T>::cmd(); }
+
+    // The command the subprocess is run with: the runtime's bootstrap when framing code
+    const char* command() const { return framesCode() ? incremental_cmd<T>::cmd() : T::cmd; }
+
+    // Batch code and data writes until the matching batch(false), ignoring flushes (see fdoutbuf::batch).
+    // Calls nest.
+    void batch(bool on)
+    {
+        if (on) {
+            if (batchDepth_++)
+                return;
+        }
+        else if (batchDepth_ == 0 || --batchDepth_) {
+            return;
+        }
+        cfout_->batch(on);
+        for (auto& out : fdout_)
+            out->batch(on);
+    }
+
+    // The write end of the output pipe, as seen by the subprocess, or -1 without ProcessOptions::output
+    int fd_out() const { return output_.fd_w; }
+
+    // The write end of the timing pipe, as seen by the subprocess, or -1 without ProcessOptions::timing
+    int fd_timing() const { return timing_.fd_w; }
+
+    const ProcessOptions& options() const { return options_; }
+    pid_t pid() const { return pid_; }   // -1 when run by a server
+    bool multiplexed() const { return options_.multiplexed; }
+
+    // Send `code` unless something was already sent under `key` to this subprocess, i.e. once per run.
+    // For code that many snippet calls share, such as a function each object's data is then passed to.
+    // Returns true if the code was sent.
+    bool define(const std::string& key, const std::string& code)
+    {
+        if (!defined_.insert(key).second)
+            return false;
+        *cfout_ << code;
+        return true;
+    }
+
+    // Count `keys` as already sent by define(), e.g. in a header replayed ahead of the run
+    void defined(std::unordered_set<std::string> keys) { defined_ = std::move(keys); }
+
+    // Send `n` bytes from `data` on channel c without copying them, where possible.
+    // On Linux a page-aligned buffer is handed to the pipe with vmsplice(2): the pipe then refers to the
+    // pages themselves, so the buffer must be left untouched until the returned ticket is done().
+    // Otherwise (or when multiplexed) the bytes are copied as by data_out(c) and the ticket is done at once.
+    send_ticket send(unsigned c, const void* data, std::size_t n)
+    {
+        fd_ostream& out = data_out(c);
+        out.drain();
+
+        const char* p = static_cast<const char*>(data);
+        if (options_.multiplexed || held_) {
+            out.write(p, n);
+            out.drain();
+            return send_ticket{};
+        }
+
+        if (recorder_)
+            recorder_->data(c, p, n);
+
+        pipe_counter& counter = *counters_[c];
+
+#ifdef __linux__
+        static const long pageSize = sysconf(_SC_PAGESIZE);
+        if (reinterpret_cast<std::uintptr_t>(p) % pageSize == 0)
+        {
+            // A larger pipe means fewer round trips with the reader
+            fcntl(counter.fd, F_SETPIPE_SZ, 1 << 20);
+
+            std::size_t left = n;
+            while (left) {
+                iovec iov = { const_cast<char*>(p), left };
+                ssize_t r = vmsplice(counter.fd, &iov, 1, 0);
+                if (r == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    break;
+                }
+                counter.written.fetch_add(r, std::memory_order_release);
+                p += r;
+                left -= r;
+            }
+            if (!left)
+                return send_ticket(counters_[c], counter.written.load(std::memory_order_acquire));
+
+            n = left;  // Unsupported here after all: copy what's left
+        }
+#endif
+
+        writeAll(counter, p, n);
+        return send_ticket{};
+    }
+
+    // Send one contiguous object split into chunks across channels first..first+k-1, written concurrently
+    // from k threads so that no single pipe limits the throughput: chunk i goes to channel first + i % k.
+    // In Python, `iosc_recv_striped(first, k, n)` reassembles it.  When multiplexed, recording or digesting, the
+    // chunks are written in order from this thread instead.  The code reading them must already be running,
+    // so a runtime that only runs its code once complete needs ProcessOptions::incremental.
+    void send_striped(unsigned first, unsigned k, const void* data, std::size_t n, std::size_t chunk = 1 << 20)
+    {
+        assert(k > 0 && chunk > 0);
+        const char* p = static_cast<const char*>(data);
+
+        if (incremental_cmd<T>::cmd() && !options_.incremental) {
+            std::cerr << "(ioscript) send_striped needs ProcessOptions::incremental: otherwise nothing reads the "
+                      << "channels until the code is complete, and the pipes fill" << std::endl;
+            assert(false);
+        }
+
+        if (options_.multiplexed || recorder_ || held_ || k == 1) {
+            for (std::size_t i=0, start=0; start < n; i++, start += chunk)
+                data_out(first + i % k).write(p + start, std::min(chunk, n - start));
+            for (unsigned t=0; t<k; t++)
+                data_out(first + t).drain();
+            return;
+        }
+
+        if (first + k > channels_.size()) {
+            std::cerr << "(ioscript) send_striped over channels " << first << " to " << first + k - 1
+                      << " but only " << channels_.size() << " are open" << std::endl;
+            assert(false);
+            return;
+        }
+        for (unsigned t=0; t<k; t++)
+            data_out(first + t).drain();
+
+        auto stripe = [=](unsigned t) {
+            for (std::size_t start = t * chunk; start < n; start += k * chunk)
+                writeAll(*counters_[first + t], p + start, std::min(chunk, n - start));
+        };
+        std::vector<std::thread> threads;
+        for (unsigned t=1; t<k; t++)
+            threads.emplace_back(stripe, t);
+        stripe(0);
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    // A ticket for everything written to channel c so far, by any means
+    send_ticket sent(unsigned c)
+    {
+        data_out(c).drain();
+        auto& counter = counters_[options_.multiplexed ? 0 : c];
+        return send_ticket(counter, counter->written.load(std::memory_order_acquire));
+    }
+
+    // Send `n` bytes of the open file `fd`, starting at `offset`, on channel c.  On Linux the bytes move
+    // from the page cache into the pipe with splice(2), never passing through user space.  (Note that
+    // copy_file_range(2) can't write to a pipe.)  Falls back to reading and writing, as it must when
+    // multiplexed or recording.  Returns false if the file ended early or couldn't be read.
+    bool send_file(unsigned c, int fd, off_t offset, std::size_t n)
+    {
+        fd_ostream& out = data_out(c);
+        out.drain();
+
+#ifdef __linux__
+        if (!options_.multiplexed && !recorder_ && !held_)
+        {
+            pipe_counter& counter = *counters_[c];
+            fcntl(counter.fd, F_SETPIPE_SZ, 1 << 20);
+
+            bool spliced = false;
+            while (n) {
+                ssize_t r = splice(fd, &offset, counter.fd, nullptr, n, SPLICE_F_MOVE);
+                if (r == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    if (!spliced && (errno == EINVAL || errno == ENOSYS))
+                        break;   // Not supported for this file: fall back
+                    return false;
+                }
+                if (r == 0)
+                    return false;
+                counter.written.fetch_add(r, std::memory_order_release);
+                n -= r;     // splice advanced `offset` itself
+                spliced = true;
+            }
+            if (!n)
+                return true;
+        }
+#endif
+
+        std::vector<char> buffer(std::min<std::size_t>(n, 1 << 20));
+        while (n) {
+            ssize_t r = pread(fd, buffer.data(), std::min(n, buffer.size()), offset);
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                return false;
+            out.write(buffer.data(), r);
+            offset += r;
+            n -= r;
+        }
+        out.drain();
+        return true;
+    }
+
+    // Record everything sent from now on to `recorder` (or stop, if null)
+    void record(Recorder* recorder)
+    {
+        if (recorder_)
+            recorder_->endRun();
+
+        recorder_ = recorder;
+        if (recorder_)
+            recorder_->beginRun(command(), channels_, (options_.multiplexed ? 1 : 0) | (framesCode() ? 4 : 0),
+                                 output_.fd_w, timing_.fd_w);
+
+        cfout_->record(recorder_);
+        for (unsigned i=0; i<fdout_.size(); i++)
+            fdout_[i]->record(recorder_, i);
+    }
+
+    Recorder* recorder() { return recorder_; }
+
+    // What was sent of the series tracked for delta frames (see delta.h), or null to send them whole
+    void deltaFrames(DeltaFrames* frames) { deltaFrames_ = frames; }
+    DeltaFrames* deltaFrames() const { return deltaFrames_; }
+
+    // While set, nothing is sent to the subprocess: everything that would be - code, data and code already
+    // defined under a key - is fed to `digest` and held back, identifying what a run would send before any
+    // of it is (see Script::memoize).  Once it's unset, sendHeld() sends what was held as it was written,
+    // or dropHeld() forgets it along with the definitions made meanwhile.  Past `maxHeld` bytes nothing
+    // more is held, only digested, and heldAll() is false: there's then nothing to send.
+    void digest(RunDigest* digest, std::size_t maxHeld = std::size_t(-1))
+    {
+        // Anything buffered belongs to the side it was written on
+        for (auto& out : fdout_)
+            out->drain();
+
+        if (digest) {
+            definedBefore_ = defined_;
+            held_ = std::make_unique<HeldRun>(digest, maxHeld);
+        }
+        holding_ = digest != nullptr;
+
+        HeldRun* held = holding_ ? held_.get() : nullptr;
+        cfout_->hold(held);
+        for (auto& out : fdout_)
+            out->hold(held);
+    }
+
+    bool digesting() const { return holding_; }
+    bool heldAll() const { return held_ && held_->complete(); }
+
+    // Bytes that identify what channel c is sent while digesting, though they aren't sent: e.g. the
+    // version of a file only named in the data
+    void digestOnly(unsigned c, const std::string& bytes)
+    {
+        if (holding_)
+            held_->digestOnly(c, bytes.data(), bytes.size());
+    }
+
+    void sendHeld()
+    {
+        if (!held_ || holding_)
+            return;
+        std::unique_ptr<HeldRun> held = std::move(held_);
+        for (const HeldRun::Event& event : held->events()) {
+            if (event.kind == HeldRun::Code)
+                cfout_->write(event.bytes.data(), event.bytes.size());
+            else if (event.kind == HeldRun::Commit)
+                cfout_->commit();
+            else {
+                fd_ostream& out = *fdout_[event.channel];
+                out.write(event.bytes.data(), event.bytes.size());
+                out.drain();
+            }
+        }
+    }
+
+    void dropHeld()
     {
-        assert(numChannels < 1024); // todo
+        if (!held_ || holding_)
+            return;
+        held_.reset();
+        defined_.swap(definedBefore_);
+    }
 
+private:
+    void openChannels(unsigned numChannels)
+    {
         // Open data pipes
         for (unsigned i=0; i<numChannels; i++)
         {
@@ -141,21 +1552,100 @@ public:
                 assert(false);
             }
             channels_.push_back(Fd{filedes[0], filedes[1]});
+        }
+    }
 
-            // Wrap new fd_w in fd_ostream
-            fdout_.push_back(std::make_unique<fd_ostream>(channels_.back().fd_w));
+    static int moveFd(int fd, int minFd)
+    {
+        int moved = fcntl(fd, F_DUPFD, minFd);
+        if (moved == -1) {
+            std::cerr << "(ioscript) could not duplicate file descriptor " << fd << std::endl;
+            assert(false);
+            return fd;
         }
+        close(fd);
+        return moved;
+    }
 
-        // Fork process
-        if (!(file_ = popen(T::cmd, "w"))) {
-            std::cerr << "(ioscript) popen returned with error" << std::endl;
-            assert(false);  // todo
+    static int placeFd(int fd, int target)
+    {
+        if (fcntl(target, F_GETFD) != -1) {
+            std::cerr << "(ioscript) file descriptor " << target << " is already in use" << std::endl;
+            assert(false);
+            return fd;
+        }
+        if (dup2(fd, target) == -1) {
+            std::cerr << "(ioscript) dup2 to file descriptor " << target << " returned with error" << std::endl;
+            assert(false);
+            return fd;
         }
+        close(fd);
+        return target;
+    }
+
+    void addChannelStream()
+    {
+        unsigned c = fdout_.size();
+        if (options_.multiplexed) {
+            fdout_.push_back(std::make_unique<fd_ostream>(channels_[0].fd_w, c));
+            fdout_.back()->count(counters_[0].get());
+        }
+        else {
+            fdout_.push_back(std::make_unique<fd_ostream>(channels_[c].fd_w));
+            fdout_.back()->count(counters_[c].get());
+        }
+        fdout_.back()->record(recorder_, c);
+        fdout_.back()->hold(holding_ ? held_.get() : nullptr);
+        if (batchDepth_)
+            fdout_.back()->batch(true);
+    }
+
+    static void writeAll(pipe_counter& counter, const char* p, std::size_t n)
+    {
+        while (n) {
+            ssize_t r = write(counter.fd, p, n);
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r <= 0) {
+                std::cerr << "(ioscript) write to file descriptor " << counter.fd << " returned with error" << std::endl;
+                return;
+            }
+            counter.written.fetch_add(r, std::memory_order_release);
+            p += r;
+            n -= r;
+        }
+    }
+
+    void start(unsigned numChannels)
+    {
+        for (auto& channel : channels_) {
+            counters_.push_back(std::make_shared<pipe_counter>());
+            counters_.back()->fd = channel.fd_w;
+        }
+
+        // Wrap each fd_w in fd_ostream
+        for (unsigned c=0; c<numChannels; c++)
+            addChannelStream();
+
+        if (options_.output)
+            openReturnPipe(output_);
+        if (options_.timing)
+            openReturnPipe(timing_);
+
+        // Fork process, unless a server runs it
+        if (options_.server.empty() || !connectServer())
+            spawn(options_.launch ? *options_.launch : launch_policy<T>::get());
+
+        if (options_.output)
+            startReader(output_);
+        if (options_.timing)
+            startReader(timing_);
 
         cfout_ = std::make_unique<cf_ostream>(file_);
+        cfout_->frame(framesCode());
 
         // Close unused read ends on this process
-        for (unsigned i=0; i<numChannels; i++)
+        for (unsigned i=0; i<channels_.size(); i++)
         {
             if (close(channels_[i].fd_r) == -1)
                 std::cerr << "(ioscript) error closing (read) file descriptor "
@@ -165,82 +1655,238 @@ public:
             //           << " and write end " << channels_[i].fd_w << std::endl;
         }
     }
-    ~Process() {
-        // Close 'data' pipe
-        for (unsigned i=0; i<channels_.size(); i++)
+
+    // A pipe back from the subprocess, collected in memory
+    struct ReturnPipe {
+        int target = -1;        // Where the write end must be placed, if anywhere
+        int fd_w = -1;
+        int fd_r = -1;
+        std::thread reader;
+        std::vector<byte> bytes;
+    };
+
+    void openReturnPipe(ReturnPipe& pipe)
+    {
+        int filedes[2];
+        if (::pipe(filedes) == -1) {
+            std::cerr << "(ioscript) pipe() returned with error" << std::endl;
+            assert(false);
+        }
+        fcntl(filedes[0], F_SETFD, FD_CLOEXEC);
+        pipe.fd_r = filedes[0];
+        pipe.fd_w = filedes[1];
+        if (pipe.target != -1) {
+            pipe.fd_r = fcntl(pipe.fd_r, F_DUPFD_CLOEXEC, 256);
+            close(filedes[0]);
+            pipe.fd_w = placeFd(moveFd(pipe.fd_w, 256), pipe.target);
+        }
+    }
+
+    // Drain a pipe back as it's written, so the subprocess never blocks on it
+    void startReader(ReturnPipe& pipe)
+    {
+        close(pipe.fd_w);  // Only the subprocess writes
+        int fd = pipe.fd_r;
+        std::vector<byte>& bytes = pipe.bytes;
+        pipe.reader = std::thread([&bytes, fd] {
+            char buffer[65536];
+            for (;;) {
+                ssize_t r = read(fd, buffer, sizeof(buffer));
+                if (r == -1 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    break;
+                const byte* p = reinterpret_cast<const byte*>(buffer);
+                bytes.insert(bytes.end(), p, p + r);
+            }
+            close(fd);
+        });
+    }
+
+    // As popen(T::cmd, "w"), with the launch policy applied in the child before exec
+    void spawn(const LaunchPolicy& policy)
+    {
+        int in[2];
+        if (pipe(in) == -1) {
+            std::cerr << "(ioscript) pipe() returned with error" << std::endl;
+            assert(false);
+        }
+        fcntl(in[1], F_SETFD, FD_CLOEXEC);  // Not for any later subprocess
+
+        const char* cmd = command();
+
+#ifdef __linux__
+        // Prepared here, since the child may only make async-signal-safe calls
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu : policy.cpus)
+            CPU_SET(cpu, &cpus);
+#endif
+
+        pid_ = fork();
+        if (pid_ == -1) {
+            std::cerr << "(ioscript) fork() returned with error" << std::endl;
+            assert(false);  // todo
+        }
+
+        if (pid_ == 0)
         {
-            if (close(channels_[i].fd_w) == -1) {
-                std::cerr << "(ioscript) error closing (write) file descriptor "
-                          << channels_[i].fd_w << " on channel " << i << std::endl;
-                assert(false);
+            dup2(in[0], 0);
+            close(in[0]);
+            close(in[1]);
+
+#ifdef __linux__
+            if (!policy.cpus.empty() && sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+                childError("sched_setaffinity");
+            if (policy.scheduler != LaunchPolicy::Inherit) {
+                sched_param param = {};
+                if (sched_setscheduler(0, policy.scheduler == LaunchPolicy::Idle ? SCHED_IDLE : SCHED_BATCH, &param) == -1)
+                    childError("sched_setscheduler");
+            }
+            if (policy.ioClass != -1 && syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, (policy.ioClass << 13) | policy.ioLevel) == -1)
+                childError("ioprio_set");
+#endif
+            errno = 0;
+            if (policy.nice != 0 && nice(policy.nice) == -1 && errno != 0)
+                childError("nice");
+            if (policy.addressSpace) {
+                rlimit limit = { policy.addressSpace, policy.addressSpace };
+                if (setrlimit(RLIMIT_AS, &limit) == -1)
+                    childError("setrlimit(RLIMIT_AS)");
+            }
+            if (policy.cpuSeconds) {
+                rlimit limit = { policy.cpuSeconds, policy.cpuSeconds };
+                if (setrlimit(RLIMIT_CPU, &limit) == -1)
+                    childError("setrlimit(RLIMIT_CPU)");
             }
+
+            execl("/bin/sh", "sh", "-c", cmd, static_cast<char*>(nullptr));
+            childError("exec");
+            _exit(127);
         }
 
-        // Close process
-        int retVal = pclose(file_);
-        if (retVal != 0)
-            std::cerr << "(ioscript) pclose returned with exit code: " << retVal << std::endl;
+        close(in[0]);
+        if (!(file_ = fdopen(in[1], "w"))) {
+            std::cerr << "(ioscript) fdopen returned with error" << std::endl;
+            assert(false);  // todo
+        }
     }
 
-    template <typename U>
-    friend Process& operator<<(Process& process, U&& rhs) {
-        *process.cfout_ << std::forward<U>(rhs);
-        return process;
-    }
+    // Hand the subprocess's end of each pipe to an ioscriptd server, which runs the code on one of its
+    // interpreters once we start writing.  The request is the command, a u32 count of the descriptors
+    // to watch for that, and the i32 number each descriptor must have in the subprocess.
+    bool connectServer()
+    {
+        server_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, options_.server.c_str(), sizeof(addr.sun_path) - 1);
+        if (server_ == -1 || connect(server_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+            std::cerr << "(ioscript) could not connect to ioscriptd at " << options_.server
+                      << ", starting the subprocess here" << std::endl;
+            if (server_ != -1)
+                close(server_);
+            server_ = -1;
+            return false;
+        }
 
-    // Manipulators are also templates, so write non-template overloads (three types)
-    using m1 = std::ostream&(*)(std::ostream&);
-    using m2 = std::basic_ios<std::ostream::char_type,std::ostream::traits_type>&
-                    (*)(std::basic_ios<std::ostream::char_type,std::ostream::traits_type>&);
-    using m3 = std::ios_base&(*)(std::ios_base&);
+        int in[2];
+        if (pipe(in) == -1) {
+            std::cerr << "(ioscript) pipe() returned with error" << std::endl;
+            assert(false);
+        }
+        fcntl(in[1], F_SETFD, FD_CLOEXEC);
 
-    friend Process& operator<<(Process& process, m1 rhs) {
-        *process.cfout_ << rhs;
-        return process;
-    }
-    friend Process& operator<<(Process& process, m2 rhs) {
-        *process.cfout_ << rhs;
-        return process;
-    }
-    friend Process& operator<<(Process& process, m3 rhs) {
-        *process.cfout_ << rhs;
-        return process;
-    }
+        std::vector<int> fds = { in[0] };
+        std::vector<std::int32_t> targets = { 0 };
+        for (auto& channel : channels_) {
+            fds.push_back(channel.fd_r);
+            targets.push_back(channel.fd_r);
+        }
+        std::uint32_t watch = fds.size();
+        std::uint32_t flags = framesCode() ? 1 : 0;
 
-    Process(const Process&) = delete;
-    Process& operator=(const Process&) = delete;
+        // The write ends too, as a subprocess started here would inherit them (and the header closes them)
+        for (auto& channel : channels_) {
+            fds.push_back(channel.fd_w);
+            targets.push_back(channel.fd_w);
+        }
+        fds.insert(fds.end(), { 1, 2 });
+        targets.insert(targets.end(), { 1, 2 });
+        for (const ReturnPipe* pipe : { &output_, &timing_ }) {
+            if (pipe->fd_w != -1) {
+                fds.push_back(pipe->fd_w);
+                targets.push_back(pipe->fd_w);
+            }
+        }
 
-    cf_ostream& out()  { return *cfout_; }
-    fd_ostream& data_out(unsigned c) {
-        if (c >= channels_.size())
-            assert(false); // todo
-        return *fdout_[c];
-    }
+        std::string request(T::cmd);
+        request.push_back('\0');
+        request.append(reinterpret_cast<const char*>(&watch), sizeof(watch));
+        request.append(reinterpret_cast<const char*>(&flags), sizeof(flags));
+        request.append(reinterpret_cast<const char*>(targets.data()), targets.size() * sizeof(std::int32_t));
+        if (!sendFds(server_, request.data(), request.size(), fds)) {
+            std::cerr << "(ioscript) could not send a request to ioscriptd at " << options_.server << std::endl;
+            assert(false);
+        }
 
-    unsigned numChannels() { return channels_.size(); }
+        close(in[0]);
+        if (!(file_ = fdopen(in[1], "w"))) {
+            std::cerr << "(ioscript) fdopen returned with error" << std::endl;
+            assert(false);  // todo
+        }
+        return true;
+    }
 
-    int fd_r(unsigned c) {
-        if (c >= channels_.size())
-            assert(false);
-        return channels_[c].fd_r;
+    // The wait status of a subprocess run by a server, once it has exited, and its usage if the server
+    // reports it (see server_report)
+    int serverStatus()
+    {
+        server_report report;
+        ssize_t r;
+        while ((r = recv(server_, &report, sizeof(report), 0)) == -1 && errno == EINTR) {}
+        if (r < ssize_t(sizeof(report.status))) {
+            std::cerr << "(ioscript) lost the connection to ioscriptd at " << options_.server << std::endl;
+            report.status = -1;
+        }
+        else if (r == sizeof(report)) {
+            usage_ = report.usage();
+        }
+        close(server_);
+        server_ = -1;
+        return report.status;
     }
-    int fd_w(unsigned c) {
-        if (c >= channels_.size())
-            assert(false);
-        return channels_[c].fd_w;
+
+    static void childError(const char* call)
+    {
+        const char prefix[] = "(ioscript) launch policy: ";
+        ssize_t r = write(2, prefix, sizeof(prefix) - 1);
+        r = write(2, call, strlen(call));
+        r = write(2, " failed\n", 8);
+        (void)r;
     }
 
-private:
     std::unique_ptr<cf_ostream> cfout_;
     std::vector<std::unique_ptr<fd_ostream>> fdout_;
 
-    struct Fd {
-        int fd_r;
-        int fd_w;
-    };
-
+    ProcessOptions options_;
     std::vector<Fd> channels_;
-    FILE* file_;
+    std::vector<std::shared_ptr<pipe_counter>> counters_;   // One per pipe in channels_
+    std::unordered_set<std::string> defined_;
+    unsigned batchDepth_ = 0;
+    FILE* file_ = nullptr;
+    pid_t pid_ = -1;
+    int server_ = -1;           // Connection to the ioscriptd running the subprocess, if one is
+
+    ReturnPipe output_;
+    ReturnPipe timing_;
+    Recorder* recorder_ = nullptr;
+    std::unique_ptr<HeldRun> held_;    // What was written while digesting
+    bool holding_ = false;
+    std::unordered_set<std::string> definedBefore_;    // defined_ when digesting began
+    DeltaFrames* deltaFrames_ = nullptr;
+    int status_ = 0;
+    ResourceUsage usage_;
 };
 
 
@@ -406,6 +2052,32 @@ struct is_object_snippet<T, P, std::enable_if_t<has_member_function<T, void(Proc
 };
 
 
+// A canvas snippet added to a Script header replaces any earlier one with the same key, which by default is
+// the snippet's type: a new ImageSize supersedes the last.  A member `std::string headerKey() const`
+// overrides it, to keep several of one type apart (an empty key never replaces).
+template <typename T, typename U = void>
+struct has_header_key : std::false_type {};
+
+template <typename T>
+struct has_header_key<T, std::enable_if_t<std::is_convertible<decltype(std::declval<const T&>().headerKey()), std::string>::value>> : std::true_type {};
+
+template <typename T, std::enable_if_t<has_header_key<T>::value, int> = 0>
+std::string header_key(const T& snippet) { return snippet.headerKey(); }
+
+template <typename T, std::enable_if_t<!has_header_key<T>::value, int> = 0>
+std::string header_key(const T&) { return typeid(T).name(); }
+
+
+// A snippet with a static member `definition()` has that code sent once per run, before its first use,
+// so each object or call only needs to send what differs: code and parse time then scale with the
+// number of distinct snippet types rather than the number of objects.
+template <typename T, typename U = void>
+struct has_definition : std::false_type {};
+
+template <typename T>
+struct has_definition<T, std::enable_if_t<std::is_convertible<decltype(T::definition()), std::string>::value>> : std::true_type {};
+
+
 // With specializations in client code
 template <typename T>
 struct binds_to;
@@ -428,6 +2100,47 @@ template <typename Tuple>
 using snippets_from_types = get_snippets<std::tuple<>, Tuple>;
 
 
+template <typename... Ts> struct make_void { using type = void; };
+template <typename... Ts> using void_t = typename make_void<Ts...>::type;
+
+// The index in the snippet tuple S of the variant T binds to, or -1 if T isn't bound
+template <typename T, typename S, typename U = void>
+struct bound_index : std::integral_constant<int, -1> {};
+
+template <typename T, typename S>
+struct bound_index<T, S, void_t<typename binds_to<T>::type>>
+    : std::integral_constant<int, tuple_element_index<typename binds_to<T>::type, S>::value> {};
+
+// A range passed to run() is plotted element by element, in a runtime loop: its elements must be bound,
+// or variants of bound types, and the range itself not be (else it's plotted as one object - see `each`)
+template <typename R>
+using range_element_t = std::decay_t<decltype(*std::begin(std::declval<const R&>()))>;
+
+template <typename R, typename S, typename U = void>
+struct is_object_range : std::false_type {};
+
+template <typename R, typename S>
+struct is_object_range<R, S, void_t<range_element_t<R>>>
+    : std::integral_constant<bool, bound_index<R,S>::value == -1 &&
+                                   (bound_index<range_element_t<R>,S>::value != -1 || is_variant<range_element_t<R>>::value)> {};
+
+// A range of objects, for iterator pairs or containers that are themselves bound:
+// `script.run(each(series))` plots each element, where `script.run(series)` would plot the container
+template <typename It>
+struct object_range
+{
+    It first, last;
+    It begin() const { return first; }
+    It end() const { return last; }
+};
+
+template <typename It>
+object_range<It> each(It first, It last) { return object_range<It>{first, last}; }
+
+template <typename R>
+auto each(const R& range) -> object_range<decltype(std::begin(range))> { return each(std::begin(range), std::end(range)); }
+
+
 // Check that the given type refers to a variant with at least one snippet
 // todo: this check is supported on C++17 only
 #ifndef WITH_BOOST_VARIANT
@@ -463,11 +2176,186 @@ template <typename P, typename S>
 void addPrivateHeader(Script<P,S>& python) {}
 
 
+// The code that marks where a snippet's code starts and ends, for runtime types that can time snippets
+// (see ProcessOptions::timing), with specializations in the runtime headers.  The end mark has the
+// interpreter write a line "<id> <nanoseconds since the start mark>" to fd_timing().
+template <typename T>
+struct snippet_timer {
+    static constexpr bool supported = false;
+    static void begin(Process<T>&, unsigned) {}
+    static void end(Process<T>&, unsigned) {}
+};
+
+// The readable name of a type, where the compiler can tell
+inline std::string type_name(const std::type_info& type)
+{
+#ifdef __GNUG__
+    int status = 0;
+    char* name = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+    if (status == 0 && name) {
+        std::string result(name);
+        std::free(name);
+        return result;
+    }
+#endif
+    return type.name();
+}
+
+// The time a run spent in the code of one snippet type, as measured by the interpreter
+struct SnippetTiming
+{
+    std::string snippet;        // The snippet type
+    std::uint64_t count = 0;    // Calls
+    std::uint64_t totalNs = 0;
+    std::uint64_t maxNs = 0;
+};
+
+// What a run produced
+struct RunResult
+{
+    std::vector<byte> output;   // Written by the subprocess to fd_out(), with ProcessOptions::output
+    std::vector<SnippetTiming> timings;     // With ProcessOptions::timing, by snippet type in order of first use
+    ResourceUsage usage;        // What the subprocess consumed
+};
+
+// The usage of every run that used one combination of snippet types, summed (see Script::usage)
+struct SnippetUsage
+{
+    std::string snippets;       // The snippet types, sorted, separated by " + "
+    std::uint64_t runs = 0;
+    std::uint64_t failed = 0;   // Runs whose subprocess exited with a nonzero status
+    std::uint64_t measured = 0; // Runs whose usage was reported, and so is included below
+    double userSeconds = 0;
+    double systemSeconds = 0;
+    std::int64_t maxRssKb = 0;  // The highest peak of any run
+    std::uint64_t minorFaults = 0;
+    std::uint64_t majorFaults = 0;
+    std::uint64_t voluntarySwitches = 0;
+    std::uint64_t involuntarySwitches = 0;
+
+    void add(const ResourceUsage& usage, bool ok)
+    {
+        runs++;
+        failed += !ok;
+        if (!usage.measured)
+            return;
+        measured++;
+        userSeconds += usage.userSeconds;
+        systemSeconds += usage.systemSeconds;
+        maxRssKb = std::max(maxRssKb, usage.maxRssKb);
+        minorFaults += usage.minorFaults;
+        majorFaults += usage.majorFaults;
+        voluntarySwitches += usage.voluntarySwitches;
+        involuntarySwitches += usage.involuntarySwitches;
+    }
+};
+
+
+// The results of earlier runs by their RunDigest, least recently used first out once more than
+// `maxBytes` of output or `maxEntries` results are held
+class RunCache
+{
+public:
+    struct Stats {
+        std::uint64_t hits = 0;
+        std::uint64_t misses = 0;
+        std::uint64_t evictions = 0;
+        std::size_t entries = 0;
+        std::size_t bytes = 0;      // Output held
+    };
+
+    RunCache(std::size_t maxBytes, std::size_t maxEntries) : maxBytes_(maxBytes), maxEntries_(maxEntries) {}
+
+    // nullptr on a miss.  Valid until the next insert()
+    const RunResult* find(std::uint64_t key)
+    {
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            stats_.misses++;
+            return nullptr;
+        }
+        stats_.hits++;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return &it->second->second;
+    }
+
+    void insert(std::uint64_t key, const RunResult& result)
+    {
+        if (result.output.size() > maxBytes_ || maxEntries_ == 0)
+            return;
+        erase(key);
+        entries_.emplace_front(key, result);
+        index_[key] = entries_.begin();
+        stats_.bytes += result.output.size();
+        while (stats_.bytes > maxBytes_ || entries_.size() > maxEntries_) {
+            erase(entries_.back().first);
+            stats_.evictions++;
+        }
+        stats_.entries = entries_.size();
+    }
+
+    const Stats& stats() const { return stats_; }
+
+private:
+    void erase(std::uint64_t key)
+    {
+        auto it = index_.find(key);
+        if (it == index_.end())
+            return;
+        stats_.bytes -= it->second->second.output.size();
+        entries_.erase(it->second);
+        index_.erase(it);
+        stats_.entries = entries_.size();
+    }
+
+    using Entry = std::pair<std::uint64_t, RunResult>;
+    std::list<Entry> entries_;      // Most recently used first
+    std::unordered_map<std::uint64_t, std::list<Entry>::iterator> index_;
+    std::size_t maxBytes_;
+    std::size_t maxEntries_;
+    Stats stats_;
+};
+
+
+// Whether the first of Ts is a ProcessOptions, to select between the Script constructors
+template <typename... Ts>
+struct first_is_options : std::false_type {};
+
+template <typename T, typename... Ts>
+struct first_is_options<T, Ts...> : std::is_same<std::decay_t<T>, ProcessOptions> {};
+
+
 template <typename P, typename X>
 class Script
 {
+    ProcessOptions options_;
+    std::unique_ptr<Recorder> recorder_;   // Declared before subprocess_, so outlives it
     std::unique_ptr<Process<P>> subprocess_;
-    std::ostringstream header_;
+    std::unique_ptr<RunCache> cache_;
+    std::size_t maxHeld_ = 0;
+    std::shared_ptr<DeltaFrames> deltaFrames_;
+
+    // Snippet types timed so far, by the id their timing marks carry (see ProcessOptions::timing)
+    std::vector<std::string> timedNames_;
+    std::unordered_map<std::type_index, unsigned> timedIds_;
+    bool timingRun_ = false;    // Only the code of runs is marked, not the header's
+
+    // Snippet types used by the current run, and the usage of runs by combination of them
+    std::vector<const std::type_info*> used_;
+    std::vector<SnippetUsage> usage_;
+    std::unordered_map<std::string, std::size_t> usageIndex_;
+
+    // The header, one entry per snippet so that superseded ones can be dropped
+    struct HeaderEntry {
+        std::string key;    // Empty for entries that are never replaced
+        std::string code;
+    };
+    std::vector<HeaderEntry> header_;
+    std::unordered_set<std::string> headerDefined_;    // The definition()s in header_, sent by every run
+    std::string definitions_;    // Those met in the entry being captured
+    bool capturing_ = false;
+    std::string headerCode_;    // header_ rendered, as replayed by each run
+    bool headerDirty_ = false;
 
 // todo: this check is supported on C++17 only
 #ifndef WITH_BOOST_VARIANT
@@ -479,9 +2367,14 @@ class Script
     S snippetsHeader_;
 
 public:
+    template <typename... Ts, std::enable_if_t<!first_is_options<Ts...>::value, int> = 0>
+    Script(Ts&&... args) : Script(ProcessOptions{}, std::forward<Ts>(args)...) {}
+
+    // The options apply to every subprocess started by this Script
     template <typename... Ts>
-    Script(Ts&&... args) :
-        subprocess_(std::make_unique<Process<P>>(NUM_OPEN_CHANNELS))
+    Script(const ProcessOptions& options, Ts&&... args) :
+        options_(options),
+        subprocess_(std::make_unique<Process<P>>(NUM_OPEN_CHANNELS, options_))
     {
         addPrivateHeader(*this);
         addToHeader(args...);
@@ -495,7 +2388,11 @@ public:
                                !is_object_snippet<T,P>::value, int> = 0>
     void processArgs(const T& snippet, const Ts&... args)
     {
-        snippet(*subprocess_);
+        timed<T>([&] {
+            define(snippet);
+            snippet(*subprocess_);
+        });
+        subprocess_->commit();
 		processArgs(args...);
     }
 
@@ -518,7 +2415,11 @@ public:
                                is_script_snippet<T,P>::value, int> = 0>
     void processArgs(const T& snippet, const Ts&... args)
     {
-        snippet(*subprocess_);
+        timed<T>([&] {
+            define(snippet);
+            snippet(*subprocess_);
+        });
+        subprocess_->commit();
 
         constexpr size_t NumSnippets = std::tuple_size<S>::value;
         TupleUpdater<T, S, NumSnippets>::update(snippets_, snippet);
@@ -534,21 +2435,31 @@ public:
                                key != -1, int> = 0>
     void processArgs(const T& obj, const Ts&... args)
     {
-		// Get the snippet variant that's currently associated with the arg type T
-        auto snippetVar = std::get<key>(snippets_);
+        processObject(obj);
+		processArgs(args...);
+    }
 
-		// Plot this object
-        iosc::visit([this,&obj](auto&& snippet) {
-            snippet(*subprocess_, obj);
-		}, snippetVar);
+    // Arg is a range of objects to plot
+    template <typename T, typename... Ts,
+              std::enable_if_t<!is_object_snippet<T,P>::value &&
+                               !is_script_snippet<T,P>::value &&
+                               is_object_range<T,S>::value, int> = 0>
+    void processArgs(const T& range, const Ts&... args)
+    {
+        // One loop however long the range, with code and data sent in large writes
+        subprocess_->batch(true);
+        for (const auto& obj : range)
+            processElement(obj);
+        subprocess_->batch(false);
 
-		processArgs(args...);
+        processArgs(args...);
     }
 
     template <typename T, typename... Ts,
               int key = tuple_element_index<typename binds_to<T>::type, S>::value,
               std::enable_if_t<!is_object_snippet<T,P>::value &&
                                !is_script_snippet<T,P>::value &&
+                               !is_object_range<T,S>::value &&
                                key == -1, int> = 0>
     void processArgs(const T& obj, const Ts&... args)
     {
@@ -557,42 +2468,334 @@ public:
         std::cerr << "(ioscript) Warning: An unrecognised type was passed to run() and was ignored" << std::endl;
     }
 
+    template <typename T, int key = tuple_element_index<typename binds_to<T>::type, S>::value>
+    void processObject(const T& obj)
+    {
+		// Get the snippet variant that's currently associated with the arg type T
+        auto snippetVar = std::get<key>(snippets_);
+
+		// Plot this object
+        iosc::visit([this,&obj](auto&& snippet) {
+            this->template timed<std::decay_t<decltype(snippet)>>([&] {
+                define(snippet);
+                snippet(*subprocess_, obj);
+            });
+		}, snippetVar);
+        subprocess_->commit();
+    }
+
+    template <typename T, std::enable_if_t<!is_variant<T>::value, int> = 0>
+    void processElement(const T& obj)
+    {
+        static_assert(bound_index<T,S>::value != -1, "A range passed to run() holds a type that is not recognised. (Did you forget to add this type to MyTypes?)");
+        processObject(obj);
+    }
+
+    template <typename T, std::enable_if_t<is_variant<T>::value, int> = 0>
+    void processElement(const T& var)
+    {
+        iosc::visit([this](const auto& obj) { this->processElement(obj); }, var);
+    }
+
     template <typename... Ts>
-	void run(const Ts&... args)
+	RunResult run(const Ts&... args)
 	{
-        // Replay the header
-        subprocess_->out() << header_.str();
-
         // Reload state for the chosen alternatives
         snippets_ = snippetsHeader_;
+        subprocess_->defined(headerDefined_);
+        used_.clear();
+        timingRun_ = options_.timing && snippet_timer<P>::supported && subprocess_->fd_timing() != -1;
+
+        // An identical run has been done before: skip it.  Otherwise send what was held back while
+        // looking, after the header.
+        std::uint64_t key = 0;
+        bool held = false;
+        if (cache_) {
+            RunDigest digest;
+            const std::string& header = headerCode();
+            digest.code(header.data(), header.size());
+            subprocess_->digest(&digest, maxHeld_);
+            processArgs(args...);
+            subprocess_->digest(nullptr);
+            key = digest.value();
+
+            if (const RunResult* cached = cache_->find(key)) {
+                subprocess_->dropHeld();
+                timingRun_ = false;
+                return *cached;
+            }
+
+            // Too much to hold: only the digest was kept, so the snippets are called again to send the run
+            held = subprocess_->heldAll();
+            if (!held) {
+                subprocess_->dropHeld();
+                snippets_ = snippetsHeader_;
+                used_.clear();
+            }
+        }
+
+        // Replay the header
+        if (recorder_)
+            recorder_->header(true);
+        subprocess_->out() << headerCode();
+        subprocess_->commit();
+        if (recorder_)
+            recorder_->header(false);
 
         // Recurse into arguments
-		processArgs(args...);
+        if (held)
+            subprocess_->sendHeld();
+        else
+            processArgs(args...);
+        timingRun_ = false;
 
         // Finally, close this process and reopen with a fresh instance
         // + This ends out code stream to the process, which e.g. for python allows the process to start execution
         // + Also important that each call to plot (aside from the intentional header) is stateless
+        subprocess_->wait();
+
+        // The copies delta frames patch go with the interpreter, and may be stale after a failed run
+        if (deltaFrames_ && (!persistent_interpreter<P>::value || subprocess_->status() != 0))
+            deltaFrames_->clear();
+
+        RunResult result;
+        result.output = std::move(subprocess_->output());
+        result.timings = collectTimings(subprocess_->timings());
+        result.usage = subprocess_->usage();
+        const int status = subprocess_->status();
+        addUsage(result.usage, status == 0);
+
         subprocess_.reset();  // destroy first
-        subprocess_ = std::make_unique<Process<P>>(NUM_OPEN_CHANNELS);
+        subprocess_ = std::make_unique<Process<P>>(NUM_OPEN_CHANNELS, options_);
+        subprocess_->record(recorder_.get());
+        subprocess_->deltaFrames(deltaFrames_.get());
+
+        // A failed run may be worth trying again
+        if (cache_ && status == 0)
+            cache_->insert(key, result);
+        return result;
 	}
 
+    // Skip runs that would send exactly what an earlier successful run sent - the same header, code and
+    // data on every channel - and return that run's result instead.  What a run sends is hashed as its
+    // snippets write it, and held back in memory until the digest has been looked up; only then is it
+    // sent (or not).  A run sending more than `maxHeld` bytes is only hashed, and on a miss its snippets
+    // are called a second time to send it.  Results are kept for up to `maxEntries` runs, and `maxBytes`
+    // of output.
+    void memoize(std::size_t maxBytes, std::size_t maxEntries = 64, std::size_t maxHeld = 64 << 20)
+    {
+        cache_ = std::make_unique<RunCache>(maxBytes, maxEntries);
+        maxHeld_ = maxHeld;
+    }
+
+    void stopMemoizing() { cache_.reset(); }
+
+    RunCache::Stats memoStats() const { return cache_ ? cache_->stats() : RunCache::Stats{}; }
+
+    // What the runs so far consumed, summed by the combination of snippet types each one used, in order
+    // of first use.  Runs skipped by memoize() consumed nothing and aren't counted.
+    const std::vector<SnippetUsage>& usage() const { return usage_; }
+
+    void resetUsage()
+    {
+        usage_.clear();
+        usageIndex_.clear();
+    }
+
+    // Send series wrapped by delta() (see delta.h) as delta frames: after the first run, only the chunks
+    // that changed since the previous run.  Only runtimes whose interpreter persists between runs (see
+    // persistent_interpreter) keep the copies to patch; others are sent every series whole.
+    void deltaFrames(std::shared_ptr<DeltaFrames> frames)
+    {
+        deltaFrames_ = std::move(frames);
+        subprocess_->deltaFrames(deltaFrames_.get());
+    }
+
+    // Record each following run - header, code and data channels - to a bundle file for replay.h
+    bool record(const std::string& path)
+    {
+        subprocess_->record(nullptr);
+        recorder_ = std::make_unique<Recorder>(path);
+        if (!recorder_->good()) {
+            recorder_.reset();
+            return false;
+        }
+        subprocess_->record(recorder_.get());
+        return true;
+    }
+
+    void stopRecording()
+    {
+        subprocess_->record(nullptr);
+        recorder_.reset();
+    }
+
+    // Each canvas snippet replaces an earlier one with the same key (see `header_key`), so a header that's
+    // changed repeatedly stays the size of its latest state
     template <typename... Ts>
     void addToHeader(const Ts&... args)
     {
-        // Everything to cfout goes to our local ostringstream
-        auto cout_buffer = subprocess_->out().rdbuf();
-        subprocess_->out().rdbuf(header_.rdbuf());
+        // Start from the header's chosen alternatives, not whatever the last run chose, and save them after
+        snippets_ = snippetsHeader_;
+        addHeaderEntries(args...);
+        snippetsHeader_ = snippets_;
+    }
 
-        // Also save the state of the chosen alternatives
+    // Add args to the header as a single entry, at the end, replacing any earlier entry with this key
+    template <typename... Ts>
+    void setHeader(const std::string& key, const Ts&... args)
+    {
+        snippets_ = snippetsHeader_;
+        putHeaderEntry(key, captureHeader(args...));
         snippetsHeader_ = snippets_;
+    }
+
+    void removeFromHeader(const std::string& key)
+    {
+        auto it = std::remove_if(header_.begin(), header_.end(), [&key](const HeaderEntry& e) { return e.key == key; });
+        headerDirty_ |= it != header_.end();
+        header_.erase(it, header_.end());
+    }
+
+    const std::string& headerCode()
+    {
+        if (headerDirty_) {
+            headerCode_.clear();
+            for (const auto& entry : header_)
+                headerCode_ += entry.code;
+            headerDirty_ = false;
+        }
+        return headerCode_;
+    }
+
+    std::size_t headerEntries() const { return header_.size(); }
+
+private:
+    // Send a snippet's code, between timing marks if this run is timed
+    template <typename T, typename F>
+    void timed(F&& send)
+    {
+        if (std::none_of(used_.begin(), used_.end(), [](const std::type_info* type) { return *type == typeid(T); }))
+            used_.push_back(&typeid(T));
+        if (!timingRun_) {
+            send();
+            return;
+        }
+        auto it = timedIds_.find(typeid(T));
+        if (it == timedIds_.end()) {
+            it = timedIds_.emplace(typeid(T), unsigned(timedNames_.size())).first;
+            timedNames_.push_back(type_name(typeid(T)));
+        }
+        snippet_timer<P>::begin(*subprocess_, it->second);
+        send();
+        snippet_timer<P>::end(*subprocess_, it->second);
+    }
+
+    void addUsage(const ResourceUsage& usage, bool ok)
+    {
+        std::vector<std::string> names;
+        for (const std::type_info* type : used_)
+            names.push_back(type_name(*type));
+        std::sort(names.begin(), names.end());
+        std::string key;
+        for (const auto& name : names)
+            key += (key.empty() ? "" : " + ") + name;
+
+        auto it = usageIndex_.find(key);
+        if (it == usageIndex_.end()) {
+            it = usageIndex_.emplace(key, usage_.size()).first;
+            usage_.emplace_back();
+            usage_.back().snippets = key;
+        }
+        usage_[it->second].add(usage, ok);
+    }
+
+    // Sum the lines "<id> <nanoseconds>" written by the end marks, per snippet type
+    std::vector<SnippetTiming> collectTimings(const std::vector<byte>& bytes) const
+    {
+        std::vector<SnippetTiming> byId(timedNames_.size());
+        std::istringstream lines(std::string(reinterpret_cast<const char*>(bytes.data()), bytes.size()));
+        unsigned id;
+        double ns;
+        while (lines >> id >> ns) {
+            if (id >= byId.size() || ns < 0)
+                continue;
+            SnippetTiming& timing = byId[id];
+            timing.count++;
+            timing.totalNs += std::uint64_t(ns);
+            timing.maxNs = std::max(timing.maxNs, std::uint64_t(ns));
+        }
+
+        std::vector<SnippetTiming> timings;
+        for (unsigned id=0; id<byId.size(); id++) {
+            if (byId[id].count) {
+                byId[id].snippet = timedNames_[id];
+                timings.push_back(std::move(byId[id]));
+            }
+        }
+        return timings;
+    }
+
+    // Send a snippet's definition() once per run.  Keyed on the code, so snippets sharing a definition
+    // send it once.  Those met while capturing the header get an entry of their own, ahead of the captured
+    // one, so that replacing that can't drop a definition another entry relies on.
+    template <typename T, std::enable_if_t<has_definition<T>::value, int> = 0>
+    void define(const T&)
+    {
+        std::string code = T::definition();
+        if (!capturing_) {
+            subprocess_->define(code, code);
+        }
+        else if (headerDefined_.insert(code).second) {
+            definitions_ += code;
+        }
+    }
+
+    template <typename T, std::enable_if_t<!has_definition<T>::value, int> = 0>
+    void define(const T&) {}
+
+    void addHeaderEntries() {}
+
+    template <typename T, typename... Ts>
+    void addHeaderEntries(const T& arg, const Ts&... args)
+    {
+        std::string code = captureHeader(arg);
+        std::string key = is_script_snippet<T,P>::value ? header_key(arg) : std::string();
+        putHeaderEntry(std::move(key), std::move(code));
+        addHeaderEntries(args...);
+    }
+
+    // Process args, capturing all code sent to the subprocess
+    template <typename... Ts>
+    std::string captureHeader(const Ts&... args)
+    {
+        std::ostringstream code;
+        auto cout_buffer = subprocess_->out().rdbuf();
+        subprocess_->out().rdbuf(code.rdbuf());
 
-        // Capture in local header_ buffer
+        capturing_ = true;
         processArgs(args...);
+        capturing_ = false;
 
-        // Swap back
         subprocess_->out().rdbuf(cout_buffer);
+        return code.str();
+    }
+
+    void putHeaderEntry(std::string key, std::string code)
+    {
+        // A replacement goes last, where its code then takes effect over the entries before it
+        if (!key.empty())
+            removeFromHeader(key);
+        if (!definitions_.empty()) {
+            header_.push_back(HeaderEntry{std::string(), std::move(definitions_)});
+            definitions_.clear();
+        }
+        if (!code.empty())
+            header_.push_back(HeaderEntry{std::move(key), std::move(code)});
+        headerDirty_ = true;
     }
 
+public:
     // cf_ostream& out()      { return subprocess_->out(); }
     // fd_ostream& data_out() { return subprocess_->data_out(); }
 
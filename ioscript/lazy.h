@@ -0,0 +1,200 @@
+#pragma once
+
+#include "ioscript.h"
+#include "serialize.h"
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+namespace iosc {
+
+/// "lazy.h" ///
+
+// A series of T computed as it's sent, rather than materialized in a container first.  It's produced a
+// chunk at a time into one buffer of `chunk` values, so a snippet streaming it to `data_out` uses the
+// same memory however long the series is.  Bind it like any other type:
+//
+//     template <> struct binds_to<lazy_series<double>> { using type = variant<LazyLine>; };
+//
+//     script.run(generate<double>(n, [](std::size_t i) { return std::sin(i * 1e-6); }));
+//
+// A series can be produced any number of times (each pass starts again from the first value), as
+// memoized runs need.  Within a snippet, iterate it with range-for, or a chunk at a time with forEachChunk.
+template <typename T>
+class lazy_series
+{
+public:
+    static constexpr std::size_t unknown = std::size_t(-1);
+
+    // Writes up to `max` values to `out`, continuing where the last call left off: returns how many, 0 at the end
+    using Reader = std::function<std::size_t(T* out, std::size_t max)>;
+
+    // `fill(offset, out, max)` writes up to `max` values starting at value `offset` of the series to `out`,
+    // and returns how many (0 past the end)
+    template <typename F, std::enable_if_t<std::is_convertible<decltype(std::declval<F&>()(std::size_t(), (T*)nullptr, std::size_t())), std::size_t>::value, int> = 0>
+    lazy_series(F fill, std::size_t size = unknown, std::size_t chunk = 1 << 14) :
+        open_([fill]() -> Reader {
+            std::size_t offset = 0;
+            return [fill, offset](T* out, std::size_t max) mutable {
+                std::size_t n = fill(offset, out, max);
+                offset += n;
+                return n;
+            };
+        }),
+        size_(size), chunk_(chunk)
+    {}
+
+    // `open()` returns a fresh Reader for each pass over the series
+    static lazy_series fromReader(std::function<Reader()> open, std::size_t size = unknown, std::size_t chunk = 1 << 14)
+    {
+        lazy_series series;
+        series.open_ = std::move(open);
+        series.size_ = size;
+        series.chunk_ = chunk;
+        return series;
+    }
+
+    // The length, if given when made, otherwise found by producing the series once
+    std::size_t size() const
+    {
+        if (size_ != unknown)
+            return size_;
+        std::size_t n = 0;
+        forEachChunk([&n](const T*, std::size_t k) { n += k; });
+        return n;
+    }
+
+    bool sized() const { return size_ != unknown; }
+    std::size_t chunk() const { return chunk_; }
+
+    // f(const T* values, std::size_t n) for each chunk in turn
+    template <typename F>
+    void forEachChunk(F&& f) const
+    {
+        std::vector<T> buffer(chunk_);
+        Reader read = open_();
+        while (std::size_t n = read(buffer.data(), buffer.size()))
+            f(static_cast<const T*>(buffer.data()), n);
+    }
+
+    // A single pass input iterator
+    class iterator
+    {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        iterator() {}
+        iterator(Reader read, std::size_t chunk) : state_(std::make_shared<State>())
+        {
+            state_->read = std::move(read);
+            state_->buffer.resize(chunk);
+            refill();
+        }
+
+        const T& operator*() const { return state_->buffer[state_->pos]; }
+        const T* operator->() const { return &state_->buffer[state_->pos]; }
+
+        iterator& operator++()
+        {
+            if (++state_->pos == state_->length)
+                refill();
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+
+        // Only the end compares equal to an iterator at the end
+        bool operator==(const iterator& rhs) const { return atEnd() == rhs.atEnd(); }
+        bool operator!=(const iterator& rhs) const { return !(*this == rhs); }
+
+    private:
+        struct State {
+            Reader read;
+            std::vector<T> buffer;
+            std::size_t pos = 0;
+            std::size_t length = 0;
+        };
+
+        void refill()
+        {
+            state_->pos = 0;
+            state_->length = state_->read(state_->buffer.data(), state_->buffer.size());
+            if (state_->length == 0)
+                state_.reset();
+        }
+
+        bool atEnd() const { return !state_; }
+
+        std::shared_ptr<State> state_;
+    };
+
+    iterator begin() const { return iterator(open_(), chunk_); }
+    iterator end() const { return iterator(); }
+
+private:
+    lazy_series() {}
+
+    std::function<Reader()> open_;
+    std::size_t size_ = unknown;
+    std::size_t chunk_ = 1 << 14;
+};
+
+// The series f(0), f(1), ..., f(n-1)
+template <typename T, typename F>
+lazy_series<T> generate(std::size_t n, F f, std::size_t chunk = 1 << 14)
+{
+    return lazy_series<T>([n, f](std::size_t offset, T* out, std::size_t max) {
+        std::size_t k = offset < n ? std::min(max, n - offset) : 0;
+        for (std::size_t i=0; i<k; i++)
+            out[i] = f(offset + i);
+        return k;
+    }, n, chunk);
+}
+
+// The values of [first, last), e.g. a view that computes each element as it's dereferenced, converted
+// to T if given.  The iterators must be forward iterators (and stay valid), as each pass starts again
+// from `first`.
+template <typename V = void, typename It,
+          typename T = std::conditional_t<std::is_void<V>::value, std::decay_t<decltype(*std::declval<It>())>, V>>
+lazy_series<T> lazy_range(It first, It last, std::size_t chunk = 1 << 14)
+{
+    return lazy_series<T>::fromReader([first, last]() -> typename lazy_series<T>::Reader {
+        It it = first;
+        return [it, last](T* out, std::size_t max) mutable {
+            std::size_t n = 0;
+            for (; n < max && it != last; ++it, ++n)
+                out[n] = *it;
+            return n;
+        };
+    }, lazy_series<T>::unknown, chunk);
+}
+
+// Streamed a chunk at a time, with the schema of a container of T (see serialize.h).  The length goes
+// first, so a series of unknown length is produced twice.
+template <typename P, typename T, std::enable_if_t<has_element_format<T>::value, int> = 0>
+void serialize(Process<P>& process, unsigned c, const lazy_series<T>& series)
+{
+    using F = element_format<T>;
+    detail::write_schema(process, c, F::dtype(), series.size());
+
+    auto& out = process.data_out(c);
+    std::vector<char> packed(is_raw_format<F>::value ? 0 : series.chunk() * F::size);
+    series.forEachChunk([&](const T* values, std::size_t n) {
+        if (is_raw_format<F>::value) {
+            out.write(reinterpret_cast<const char*>(values), n * sizeof(T));
+            return;
+        }
+        for (std::size_t i=0; i<n; i++)
+            F::pack(packed.data() + i * F::size, values[i]);
+        out.write(packed.data(), n * F::size);
+    });
+    out.flush();
+}
+
+} // namespace iosc
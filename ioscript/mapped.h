@@ -0,0 +1,160 @@
+#pragma once
+
+#include "ioscript.h"
+#include "serialize.h"
+
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace iosc {
+
+/// "mapped.h" ///
+
+// A series of T stored in a binary file, plotted without reading it into the application: the
+// interpreter is told where the file is, and maps it itself.  Bind it like any other type:
+//
+//     template <> struct binds_to<mapped_file<float>> { using type = variant<LinePlot>; };
+//
+//     script.run(mapped_file<float>("/data/trace.f32"));
+//
+// In Python `iosc_read(c)` returns a read-only numpy.memmap of the series.  The file is named by its path,
+// or for one given as a descriptor by the descriptor's /proc path (Linux), which opens the same file even
+// if it has since been renamed or unlinked.  The file must not shrink while the interpreter uses it.
+//
+// Where the interpreter can't be relied on to open the file - while recording, as a bundle must replay
+// anywhere, or for a descriptor on other systems - the bytes are copied into the channel instead, with
+// Process::send_file (splice(2) on Linux).
+
+template <typename T>
+class mapped_file
+{
+public:
+    static constexpr std::size_t all = std::size_t(-1);
+
+    // `count` elements from `offset` bytes into the file, by default as many as there are
+    mapped_file(std::string path, std::size_t offset = 0, std::size_t count = all) :
+        path_(std::move(path)), offset_(offset), count_(count)
+    {
+        struct stat st;
+        if (stat(path_.c_str(), &st) == -1) {
+            std::cerr << "(ioscript) mapped_file: can't stat " << path_ << std::endl;
+            good_ = false;
+            count_ = 0;
+            return;
+        }
+        // Absolute, since the interpreter needn't share our working directory (an ioscriptd pool's doesn't)
+        if (char* absolute = realpath(path_.c_str(), nullptr)) {
+            path_ = absolute;
+            free(absolute);
+        }
+        fit(st);
+    }
+
+    // A file open on `fd`, which must stay open while the object is used
+    mapped_file(int fd, std::size_t offset = 0, std::size_t count = all) :
+        fd_(fd), offset_(offset), count_(count)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            std::cerr << "(ioscript) mapped_file: can't stat descriptor " << fd << std::endl;
+            good_ = false;
+            count_ = 0;
+            return;
+        }
+#ifdef __linux__
+        path_ = "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(fd);
+#endif
+        fit(st);
+    }
+
+    bool good() const { return good_; }
+    std::size_t size() const { return count_; }
+    std::size_t offset() const { return offset_; }
+    std::size_t bytes() const { return count_ * sizeof(T); }
+    const std::string& path() const { return path_; }     // Empty if the file has no path to give
+    int fd() const { return fd_; }                        // -1 unless given
+
+    // Identifies the file's contents as they are now: it changes whenever the file is written
+    std::string version() const { return version_; }
+
+private:
+    void fit(const struct stat& st)
+    {
+        std::size_t size = std::size_t(st.st_size);
+        std::size_t available = size > offset_ ? (size - offset_) / sizeof(T) : 0;
+        if (count_ == all)
+            count_ = available;
+        if (count_ > available) {
+            std::cerr << "(ioscript) mapped_file: " << count_ << " elements from offset " << offset_
+                      << " run past the end of a file of " << size << " bytes" << std::endl;
+            count_ = available;
+        }
+        version_ = std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) + ":" + std::to_string(size) + ":" +
+                   std::to_string(st.st_mtime);
+#ifdef __linux__
+        version_ += "." + std::to_string(st.st_mtim.tv_nsec);
+#endif
+    }
+
+    std::string path_;
+    int fd_ = -1;
+    std::size_t offset_ = 0;
+    std::size_t count_ = 0;
+    std::string version_;
+    bool good_ = true;
+};
+
+namespace detail {
+
+// A Python string literal
+inline std::string python_literal(const std::string& s)
+{
+    std::string literal = "'";
+    for (char ch : s) {
+        if (ch == '\\' || ch == '\'')
+            literal += '\\';
+        if (ch == '\n')
+            literal += "\\n";
+        else
+            literal += ch;
+    }
+    return literal + "'";
+}
+
+} // namespace detail
+
+// On the wire, a line "@<offset> <path literal>" then the schema of a container (serialize.h), and no
+// records: unless copied, as the records would be of a container
+template <typename P, typename T, std::enable_if_t<has_element_format<T>::value, int> = 0>
+void serialize(Process<P>& process, unsigned c, const mapped_file<T>& file)
+{
+    static_assert(is_raw_format<element_format<T>>::value, "A file holds elements as their memory");
+
+    auto& out = process.data_out(c);
+    if (!process.recorder() && !file.path().empty()) {
+        out << '@' << file.offset() << ' ' << detail::python_literal(file.path()) << '\n';
+        detail::write_schema(process, c, element_format<T>::dtype(), file.size());
+        // What a memoized run depends on is the file's contents, not just its name
+        process.digestOnly(c, file.version());
+        out.flush();
+        return;
+    }
+
+    detail::write_schema(process, c, element_format<T>::dtype(), file.size());
+    out.flush();
+    int fd = file.fd() != -1 ? file.fd() : open(file.path().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || !process.send_file(c, fd, off_t(file.offset()), file.bytes())) {
+        std::cerr << "(ioscript) mapped_file: couldn't send " << file.bytes() << " bytes of "
+                  << (file.path().empty() ? "descriptor " + std::to_string(file.fd()) : file.path()) << std::endl;
+        assert(false);
+    }
+    if (fd != -1 && fd != file.fd())
+        close(fd);
+}
+
+} // namespace iosc
@@ -2,6 +2,14 @@
 
 #include "ioscript.h"
 
+#ifdef WITH_EMBEDDED_PYTHON
+    #define PY_SSIZE_T_CLEAN
+    #include <Python.h>
+
+    #include <mutex>
+    #include <unordered_map>
+#endif
+
 namespace iosc {
 
 #ifdef QPLOT_DEBUG
@@ -10,23 +18,355 @@ namespace iosc {
     struct Python  { static constexpr const char* cmd = "python"; };
 #endif
 
+// Runs each framed chunk of code as it arrives, in one namespace (see ProcessOptions::incremental)
+#ifndef QPLOT_DEBUG
+template <>
+struct incremental_cmd<Python> {
+    static const char* cmd() {
+        return "python -c '"
+               "import sys, struct\n"
+               "namespace = {\"__name__\": \"__main__\"}\n"
+               "code = sys.stdin.buffer\n"
+               "while True:\n"
+               "    header = code.read(4)\n"
+               "    if len(header) < 4:\n"
+               "        break\n"
+               "    n, = struct.unpack(\"=I\", header)\n"
+               "    exec(compile(code.read(n), \"<ioscript>\", \"exec\"), namespace)\n"
+               "'";
+    }
+};
+
+// An ioscriptd pool interpreter (see server.h): runs the preload code from stdin, then for each request
+// forks, moves the descriptors it was sent into place and runs the code read from the new stdin, whole
+// or frame by frame as incremental_cmd does
+template <>
+struct server_cmd<Python> {
+    static const char* cmd() {
+        return "python -c '"
+               "import os, sys, socket, struct, fcntl, traceback\n"
+               "namespace = {\"__name__\": \"__main__\"}\n"
+               "exec(compile(sys.stdin.read(), \"<preload>\", \"exec\"), namespace)\n"
+               "server = socket.socket(fileno=3)\n"
+               "while True:\n"
+               "    try:\n"
+               "        message, fds, _, _ = socket.recv_fds(server, 4096, 253)\n"
+               "    except OSError:\n"
+               "        break\n"
+               "    if not message:\n"
+               "        break\n"
+               "    flags, *targets = struct.unpack(\"=%di\" % (len(message) // 4), message)\n"
+               "    targets = tuple(targets)\n"
+               "    sys.stdout.flush()\n"
+               "    sys.stderr.flush()\n"
+               "    pid = os.fork()\n"
+               "    if pid == 0:\n"
+               "        server.close()\n"
+               "        top = max(targets + (2,)) + 1\n"
+               "        moved = [fcntl.fcntl(fd, fcntl.F_DUPFD, top) for fd in fds]\n"
+               "        for fd in fds:\n"
+               "            os.close(fd)\n"
+               "        for fd, target in zip(moved, targets):\n"
+               "            os.dup2(fd, target)\n"
+               "            os.close(fd)\n"
+               "        status = 0\n"
+               "        scope = dict(namespace)\n"
+               "        try:\n"
+               "            with os.fdopen(0, \"rb\") as code:\n"
+               "                while flags & 1:\n"
+               "                    header = code.read(4)\n"
+               "                    if len(header) < 4:\n"
+               "                        break\n"
+               "                    n, = struct.unpack(\"=I\", header)\n"
+               "                    exec(compile(code.read(n), \"<ioscript>\", \"exec\"), scope)\n"
+               "                else:\n"
+               "                    exec(compile(code.read(), \"<ioscript>\", \"exec\"), scope)\n"
+               "        except SystemExit as e:\n"
+               "            status = e.code if isinstance(e.code, int) else int(e.code is not None)\n"
+               "        except BaseException:\n"
+               "            traceback.print_exc()\n"
+               "            status = 1\n"
+               "        scope.clear()\n"
+               "        sys.exit(status)\n"
+               "    for fd in fds:\n"
+               "        os.close(fd)\n"
+               "    _, status, usage = os.wait4(pid, 0)\n"
+               "    server.sendall(struct.pack(\"=i7q\", status, round(usage.ru_utime * 1e6), round(usage.ru_stime * 1e6),\n"
+               "                               usage.ru_maxrss, usage.ru_minflt, usage.ru_majflt, usage.ru_nvcsw, usage.ru_nivcsw))\n"
+               "'";
+    }
+};
+#endif
+
+// Demultiplexes the frames written by a multiplexed Process (see ProcessOptions) back into one
+// file-like object per channel.  `iosc_in[c]` supports read, readline and iteration as the file objects
+// of the one-pipe-per-channel layout do.  Frames for other channels met along the way are buffered.
+static constexpr const char* pythonDemux = R"(
+import struct as _iosc_struct
+
+class _IoscChannel(object):
+    def __init__(self, mux, c):
+        self._mux = mux
+        self._c = c
+        self._buf = bytearray()
+        self._pos = 0
+
+    def _take(self, n):
+        data = bytes(self._buf[self._pos:self._pos + n])
+        self._pos += len(data)
+        if self._pos > 65536 and self._pos * 2 > len(self._buf):
+            del self._buf[:self._pos]
+            self._pos = 0
+        return data
+
+    def read_bytes(self, n=-1):
+        while (n < 0 or len(self._buf) - self._pos < n) and self._mux._fill(self._c):
+            pass
+        return self._take(len(self._buf) - self._pos if n < 0 else n)
+
+    def read(self, n=-1):
+        return self.read_bytes(n).decode()
+
+    def readline(self):
+        while True:
+            i = self._buf.find(b'\n', self._pos)
+            if i != -1:
+                return self._take(i + 1 - self._pos).decode()
+            if not self._mux._fill(self._c):
+                return self._take(len(self._buf) - self._pos).decode()
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        line = self.readline()
+        if not line:
+            raise StopIteration
+        return line
+    next = __next__
+
+    def close(self):
+        pass
+
+class _IoscMux(object):
+    def __init__(self, fd):
+        self._f = os.fdopen(fd, 'rb')
+        self._channels = {}
+        self._eof = False
+
+    def __getitem__(self, c):
+        if c not in self._channels:
+            self._channels[c] = _IoscChannel(self, c)
+        return self._channels[c]
+
+    # Read frames until one arrives for channel c; False at the end of the stream
+    def _fill(self, c):
+        while not self._eof:
+            header = self._f.read(8)
+            if len(header) < 8:
+                self._eof = True
+                break
+            ch, n = _iosc_struct.unpack('=II', header)
+            self[ch]._buf += self._f.read(n)
+            if ch == c:
+                return True
+        return False
+)";
+
+// Reassembles an object sent with Process::send_striped, reading its channels concurrently into one
+// preallocated buffer.  (File reads release the GIL.)
+static constexpr const char* pythonStriped = R"(
+def iosc_recv_striped(first, k, n, chunk=1048576):
+    import threading
+    buf = bytearray(n)
+    view = memoryview(buf)
+    errors = []
+    def recv(t):
+        try:
+            f = iosc_in[first + t].buffer
+            for start in range(t * chunk, n, k * chunk):
+                part = view[start:min(start + chunk, n)]
+                while len(part):
+                    r = f.readinto(part)
+                    if not r:
+                        raise EOFError('channel %d ended early' % (first + t))
+                    part = part[r:]
+        except Exception as e:
+            errors.append(e)
+    threads = [threading.Thread(target=recv, args=(t,)) for t in range(1, k)]
+    for thread in threads:
+        thread.start()
+    recv(0)
+    for thread in threads:
+        thread.join()
+    if errors:
+        raise errors[0]
+    return buf
+)";
+
+// As pythonStriped, for multiplexed channels: the frames arrive in order on one pipe anyway
+static constexpr const char* pythonStripedMux = R"(
+def iosc_recv_striped(first, k, n, chunk=1048576):
+    buf = bytearray(n)
+    for i, start in enumerate(range(0, n, chunk)):
+        part = iosc_in[first + i % k].read_bytes(min(chunk, n - start))
+        if len(part) < min(chunk, n - start):
+            raise EOFError('channel %d ended early' % (first + i % k))
+        buf[start:start + len(part)] = part
+    return buf
+)";
+
+// Reads a value written by serialize() (serialize.h): a schema line, then the records, as a numpy array.
+// Encoded series (encode.h) are decoded back to their original dtype, and files (mapped.h) are mapped.
+// Reads the binary layer of a channel's file, so don't mix with text reads on the same channel.
+// Every import is inside the functions, so only runs that read a value need numpy.  (The definitions can't
+// wait for serialize() instead: it's called after the snippet's code that reads the value.)
+static constexpr const char* pythonSerialize = R"(
+def iosc_read(c):
+    import ast
+    import numpy
+    f = iosc_in[c]
+    if hasattr(f, 'read_bytes'):
+        readline, read = f.readline, f.read_bytes
+    else:
+        readline, read = lambda: f.buffer.readline().decode(), f.buffer.read
+    line = readline()
+    mapped = encoding = frame = None
+    if line.startswith('@'):
+        offset, path = line[1:].rstrip('\n').split(' ', 1)
+        mapped, line = (ast.literal_eval(path), int(offset)), readline()
+    if line.startswith('!'):
+        encoding, line = line[1:].split('|', 1)
+    elif line.startswith('~'):
+        frame, line = line[1:].split('|', 1)
+    dtype, shape = line.rstrip('\n').rsplit('|', 1)
+    dtype, shape = numpy.dtype(ast.literal_eval(dtype)), [int(k) for k in shape.split(',')]
+    if shape == [-1]:
+        return numpy.frombuffer(read(dtype.itemsize), dtype=dtype)[0]
+    count = 1
+    for k in shape:
+        count *= k
+    if mapped:
+        data = numpy.memmap(mapped[0], dtype=dtype, mode='r', offset=mapped[1], shape=(count,)) if count else numpy.zeros(0, dtype)
+    elif encoding:
+        data = _iosc_decode(encoding.split(), read, count)
+        # Integers round to nearest, as maxError() assumes, rather than truncating
+        if dtype.kind in 'iu' and data.dtype.kind == 'f':
+            data = numpy.rint(data)
+        data = data.astype(dtype)
+    elif frame:
+        data = _iosc_patch(frame.split(), read, dtype, count)
+    else:
+        data = numpy.frombuffer(read(dtype.itemsize * count), dtype=dtype)
+    return data.reshape(shape) if len(shape) > 1 else data
+
+def _iosc_decode(encoding, read, count):
+    import numpy
+    kind, args = encoding[0], encoding[1:]
+    if kind == 'f16':
+        return numpy.frombuffer(read(2 * count), dtype='=f2')
+    if kind == 'bf16':
+        return (numpy.frombuffer(read(2 * count), dtype='=u2').astype('=u4') << 16).view('=f4')
+    if kind == 'q':
+        width, lo, step = int(args[0]), float(args[1]), float(args[2])
+        return lo + numpy.frombuffer(read(width * count), dtype='=u%d' % width) * step
+    # delta: zigzag varints, 7 bits a byte with the high bit set on all but the last byte of each
+    b = numpy.frombuffer(read(int(args[0])), dtype=numpy.uint8)
+    if count == 0:
+        return numpy.zeros(0, dtype=numpy.int64)
+    ends = numpy.flatnonzero(b < 0x80)
+    starts = numpy.concatenate(([0], ends[:-1] + 1))
+    shift = 7 * (numpy.arange(len(b)) - numpy.repeat(starts, ends - starts + 1))
+    z = numpy.add.reduceat((b & 0x7f).astype(numpy.uint64) << shift.astype(numpy.uint64), starts)
+    d = (z >> numpy.uint64(1)).astype(numpy.int64) ^ -(z & numpy.uint64(1)).astype(numpy.int64)
+    return numpy.cumsum(d)
+
+# The copies delta frames patch, kept where they outlive a run's globals
+def _iosc_retained():
+    import sys, types
+    if '_iosc_frames' not in sys.modules:
+        sys.modules['_iosc_frames'] = types.ModuleType('_iosc_frames')
+        sys.modules['_iosc_frames'].retained = {}
+    return sys.modules['_iosc_frames'].retained
+
+# A delta frame: the whole series, or the indices of the chunks that changed and then their bytes
+def _iosc_patch(frame, read, dtype, count):
+    import numpy
+    slot, generation, chunk, changed = frame[0], int(frame[1]), int(frame[2]), int(frame[3])
+    retained = _iosc_retained()
+    size = dtype.itemsize * count
+    if changed < 0:
+        buf = bytearray(read(size))
+    else:
+        starts = numpy.frombuffer(read(4 * changed), dtype='=u4').astype(numpy.int64) * chunk
+        ends = numpy.minimum(starts + chunk, size)
+        data = memoryview(read(int((ends - starts).sum())))
+        buf, last = retained.get(slot, (None, -1))
+        if buf is None or last != generation - 1 or len(buf) != size:
+            raise RuntimeError('iosc_read: delta frame %d of %s has no copy to patch' % (generation, slot))
+        pos = 0
+        for start, end in zip(starts.tolist(), ends.tolist()):
+            buf[start:end] = data[pos:pos + end - start]
+            pos += end - start
+    retained[slot] = (buf, generation)
+    return numpy.frombuffer(buf, dtype=dtype)
+)";
+
 // See README.md and examples_process.cpp for details
+// (Also usable by hand for other runtimes that run Python, as the benchmarks do)
 struct PythonHeader
 {
-    void operator()(Process<Python>& python) const
+    template <typename P>
+    void operator()(Process<P>& python) const
     {
         python.out()
             << "# This header has been added by Script. See ioscript.h\n"
-            << "import os\n"
+            << "import os\n";
+
+        // Binary output back to C++, e.g. plt.savefig(iosc_out, format='png')
+        if (python.fd_out() != -1)
+            python.out() << "iosc_out = os.fdopen(" << python.fd_out() << ", 'wb')\n";
+
+        // Snippet timings back to C++ (see snippet_timer<Python>)
+        if (python.fd_timing() != -1)
+            python.out()
+                << "from time import perf_counter_ns as _iosc_clock\n"
+                << "_iosc_timing = os.fdopen(" << python.fd_timing() << ", 'w')\n";
+
+        if (python.multiplexed()) {
+            python.out()
+                << pythonDemux
+                << "os.close(" << python.fd_w(0) << ")\n"
+                << "iosc_in = _IoscMux(" << python.fd_r(0) << ")\n"
+                << pythonStripedMux
+                << pythonSerialize
+                << "\n";
+            return;
+        }
+
+        python.out()
             << "iosc_in = list()\n"
             << "\n";
 
-        for (int i=0; i<python.numChannels(); i++) {
+        for (unsigned i=0; i<python.numChannels(); i++) {
             python.out()
                 << "os.close(" << python.fd_w(i) << ")\n"
                 << "iosc_in.append(os.fdopen(" << python.fd_r(i) << ", 'r'))\n"
                 << "\n";
         }
+        python.out() << pythonStriped << pythonSerialize;
+    }
+};
+
+// The marks around a snippet's code: the times are written at exit, when the file's buffer is flushed
+template <>
+struct snippet_timer<Python> {
+    static constexpr bool supported = true;
+    static void begin(Process<Python>& python, unsigned) {
+        python.out() << "_iosc_t0 = _iosc_clock()\n";
+    }
+    static void end(Process<Python>& python, unsigned id) {
+        python.out() << "_iosc_timing.write('" << id << " %d\\n' % (_iosc_clock() - _iosc_t0))\n";
     }
 };
 
@@ -36,4 +376,638 @@ void addPrivateHeader(Script<Python,S>& python)
     python.addToHeader(PythonHeader{});
 }
 
+
+#ifdef WITH_EMBEDDED_PYTHON
+
+// Python in this process rather than a subprocess: see Process<EmbeddedPython> below
+struct EmbeddedPython { static constexpr const char* cmd = "python"; };
+
+template <>
+struct persistent_interpreter<EmbeddedPython> : std::true_type {};
+
+namespace detail {
+
+// Holds the GIL for its scope, from any thread
+class python_gil
+{
+public:
+    python_gil() : state_(PyGILState_Ensure()) {}
+    ~python_gil() { PyGILState_Release(state_); }
+
+    python_gil(const python_gil&) = delete;
+    python_gil& operator=(const python_gil&) = delete;
+
+private:
+    PyGILState_STATE state_;
+};
+
+// Starts the interpreter the first time it's needed, unless the application already has, and leaves
+// the GIL released so that any thread can take it.  It's never finalized.
+inline void python_initialize()
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        if (!Py_IsInitialized()) {
+            Py_InitializeEx(0);     // No signal handlers: SIGINT stays the application's
+            PyEval_SaveThread();
+        }
+    });
+}
+
+// Code objects by their source, so that code sent again by every run (the header, snippet definitions)
+// is compiled once per application.  Flushed when full, as code carrying inline data never repeats.
+class python_code_cache
+{
+public:
+    static python_code_cache& instance()
+    {
+        static python_code_cache* cache = new python_code_cache;   // Outlives static destruction
+        return *cache;
+    }
+
+    // A new reference, or null with the exception set.  Call with the GIL held.
+    PyObject* compile(const std::string& code)
+    {
+        constexpr std::size_t capacity = 256;
+        constexpr std::size_t largest = 1 << 16;    // Bytes of source worth keeping
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = codes_.find(code);
+            if (it != codes_.end()) {
+                Py_INCREF(it->second);
+                return it->second;
+            }
+        }
+
+        // May run other threads' Python code meanwhile
+        PyObject* compiled = Py_CompileString(code.c_str(), "<ioscript>", Py_file_input);
+        if (!compiled || code.size() > largest)
+            return compiled;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (codes_.size() >= capacity) {
+            for (auto& entry : codes_)
+                Py_DECREF(entry.second);
+            codes_.clear();
+        }
+        auto inserted = codes_.emplace(code, compiled);
+        if (!inserted.second) {
+            Py_DECREF(compiled);
+            compiled = inserted.first->second;
+        }
+        Py_INCREF(compiled);
+        return compiled;
+    }
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<std::string, PyObject*> codes_;
+};
+
+// The bytes written to a data channel since they were last taken
+class python_channel_buf : public std::streambuf
+{
+public:
+    explicit python_channel_buf(unsigned channel) : channel_(channel) {}
+
+    // While set, writes go to `held` instead
+    void hold(HeldRun* held) { held_ = held; }
+
+    std::vector<char> take() { return std::move(bytes_); }
+
+protected:
+    virtual int_type overflow(int_type c)
+    {
+        if (c != traits_type::eof()) {
+            char z = c;
+            xsputn(&z, 1);
+        }
+        return c;
+    }
+
+    virtual std::streamsize xsputn(const char* s, std::streamsize n)
+    {
+        if (held_)
+            held_->data(channel_, s, n);
+        else
+            bytes_.insert(bytes_.end(), s, s + n);
+        return n;
+    }
+
+private:
+    unsigned channel_;
+    std::vector<char> bytes_;
+    HeldRun* held_ = nullptr;
+};
+
+class python_channel_ostream : public std::ostream
+{
+public:
+    explicit python_channel_ostream(unsigned channel) : std::ostream(0), buf_(channel) { rdbuf(&buf_); }
+
+    void hold(HeldRun* held) { buf_.hold(held); }
+    std::vector<char> take() { return buf_.take(); }
+    bool drain() { return true; }
+
+private:
+    python_channel_buf buf_;
+};
+
+} // namespace detail
+
+// The channels of an embedded interpreter: segments of memory handed over from C++ before each chunk of
+// code runs.  Reads of a segment's bytes return views of that memory rather than copies where they can.
+static constexpr const char* pythonEmbeddedChannels = R"(
+import collections as _iosc_collections
+import re as _iosc_re
+
+_iosc_newline = _iosc_re.compile(b'\n')
+
+class _IoscBuffer(object):
+    def __init__(self):
+        self._segments = _iosc_collections.deque()
+        self._pos = 0
+
+    def _feed(self, segment):
+        self._segments.append(memoryview(segment))
+
+    def _advance(self, n):
+        self._pos += n
+        if self._pos == len(self._segments[0]):
+            self._segments.popleft()
+            self._pos = 0
+
+    def read(self, n=-1):
+        if self._segments and 0 <= n <= len(self._segments[0]) - self._pos:
+            data = self._segments[0][self._pos:self._pos + n]
+            self._advance(n)
+            return data
+        parts = []
+        while self._segments and n != 0:
+            segment = self._segments[0]
+            k = len(segment) - self._pos if n < 0 else min(n, len(segment) - self._pos)
+            parts.append(segment[self._pos:self._pos + k])
+            self._advance(k)
+            n -= k if n > 0 else 0
+        return b''.join(parts)
+
+    def readline(self):
+        parts = []
+        while self._segments:
+            segment = self._segments[0]
+            m = _iosc_newline.search(segment, self._pos)
+            k = (m.end() if m else len(segment)) - self._pos
+            parts.append(segment[self._pos:self._pos + k])
+            self._advance(k)
+            if m:
+                break
+        return b''.join(parts)
+
+    def readinto(self, b):
+        data = self.read(min(len(b), len(self._segments[0]) - self._pos) if self._segments else 0)
+        b[:len(data)] = data
+        return len(data)
+
+class _IoscChannel(object):
+    def __init__(self):
+        self.buffer = _IoscBuffer()
+        self._feed = self.buffer._feed
+        self.read_bytes = self.buffer.read
+
+    def read(self, n=-1):
+        return bytes(self.buffer.read(n)).decode()
+
+    def readline(self):
+        return self.buffer.readline().decode()
+
+    def __iter__(self):
+        return self
+
+    def __next__(self):
+        line = self.readline()
+        if not line:
+            raise StopIteration
+        return line
+
+    def close(self):
+        pass
+)";
+
+// Runs Python inside the application, behind the interface of a Process: code is written with <<
+// and data with data_out(c), and snippets written for Process<P> work unchanged as a Script<EmbeddedPython,
+// MyTypes>.  There's no fork or exec, no pipes, and imports persist from one run to the next.
+//
+// Code runs at each commit() (Script commits after every snippet, each a complete block of code) and at
+// wait(), with the data written by then already available to it.  Data written with data_out(c) is
+// copied once, into a bytes object; send(c, data, n) copies nothing, as Python reads the buffer itself
+// through a memoryview.  Such a buffer must stay valid and unchanged until the ticket is done, at the
+// end of the run.  Code is compiled once per application, and each Process runs it in a fresh globals
+// dict, so a Script's runs are as independent as they are with subprocesses (apart from imported
+// modules, and anything kept in them).
+//
+// The interpreter is shared by every Process<EmbeddedPython>, and Python code runs under the GIL, so
+// Processes on several threads interleave rather than run in parallel (unless the code releases the GIL,
+// as numpy and file I/O do).  Each Process belongs to one thread at a time.  An application that embeds
+// Python itself must have released the GIL (PyEval_SaveThread) before using a Process from another thread.
+//
+// ProcessOptions::output is supported, with `iosc_out` a BytesIO; the other options, recording and
+// timing, which concern subprocesses, are not.
+template <>
+class Process<EmbeddedPython>
+{
+public:
+    Process(unsigned numChannels, const ProcessOptions& options = ProcessOptions{}) :
+        options_(options),
+        counter_(std::make_shared<pipe_counter>())
+    {
+        for (unsigned i=0; i<numChannels; i++) {
+            channels_.push_back(std::make_unique<detail::python_channel_ostream>(i));
+            pending_.emplace_back();
+        }
+
+        detail::python_initialize();
+        detail::python_gil gil;
+        globals_ = PyDict_New();
+        PyObject* builtins = PyImport_ImportModule("builtins");
+        PyObject* name = PyUnicode_FromString("__main__");
+        PyDict_SetItemString(globals_, "__builtins__", builtins);
+        PyDict_SetItemString(globals_, "__name__", name);
+        Py_XDECREF(builtins);
+        Py_XDECREF(name);
+    }
+
+    ~Process()
+    {
+        wait();
+        detail::python_gil gil;
+        Py_DECREF(globals_);
+    }
+
+    // Run any code not yet run, and end the run: its globals are cleared, and buffers given to send()
+    // are no longer referred to
+    void wait()
+    {
+        if (ended_)
+            return;
+        commit();
+        ended_ = true;
+
+        detail::python_gil gil;
+        if (options_.output) {
+            PyObject* out = PyDict_GetItemString(globals_, "iosc_out");   // Borrowed
+            PyObject* value = out ? PyObject_CallMethod(out, "getvalue", nullptr) : nullptr;
+            if (value && PyBytes_Check(value)) {
+                const byte* p = reinterpret_cast<const byte*>(PyBytes_AS_STRING(value));
+                output_.assign(p, p + PyBytes_GET_SIZE(value));
+            }
+            Py_XDECREF(value);
+            PyErr_Clear();
+        }
+        PyDict_Clear(globals_);
+
+        // Anything still referring to a buffer may only be garbage not yet collected
+        bool collected = false;
+        for (PyObject* view : views_) {
+            PyObject* r = PyObject_CallMethod(view, "release", nullptr);
+            if (!r && !collected) {
+                PyErr_Clear();
+                PyGC_Collect();
+                collected = true;
+                r = PyObject_CallMethod(view, "release", nullptr);
+            }
+            if (!r) {
+                PyErr_Clear();
+                std::cerr << "(ioscript) A buffer passed to send() is still referred to from Python after the run" << std::endl;
+            }
+            Py_XDECREF(r);
+            Py_DECREF(view);
+        }
+        views_.clear();
+        counter_->closed.store(true, std::memory_order_release);
+
+        usage_.exitCode = status_;
+        if (status_ != 0)
+            std::cerr << "(ioscript) embedded interpreter returned with exit code: " << status_ << std::endl;
+    }
+
+    // As the exit status of a subprocess: nonzero if the code raised an exception or called sys.exit(n)
+    int status() const { return status_; }
+
+    // What running the code cost the thread that ran it (Linux), summed over the run.  The peak resident
+    // set is the application's own, as the interpreter's memory is.
+    const ResourceUsage& usage() const { return usage_; }
+
+    // What the code wrote to `iosc_out` (with ProcessOptions::output): complete once wait() has returned
+    std::vector<byte>& output() { return output_; }
+    std::vector<byte>& timings() { return timings_; }
+
+    template <typename U>
+    friend Process& operator<<(Process& process, U&& rhs) {
+        process.code_ << std::forward<U>(rhs);
+        return process;
+    }
+
+    using m1 = std::ostream&(*)(std::ostream&);
+    using m2 = std::basic_ios<std::ostream::char_type,std::ostream::traits_type>&
+                    (*)(std::basic_ios<std::ostream::char_type,std::ostream::traits_type>&);
+    using m3 = std::ios_base&(*)(std::ios_base&);
+
+    friend Process& operator<<(Process& process, m1 rhs) { process.code_ << rhs; return process; }
+    friend Process& operator<<(Process& process, m2 rhs) { process.code_ << rhs; return process; }
+    friend Process& operator<<(Process& process, m3 rhs) { process.code_ << rhs; return process; }
+
+    Process(const Process&) = delete;
+    Process& operator=(const Process&) = delete;
+
+    std::ostream& out() { return code_; }
+
+    detail::python_channel_ostream& data_out(unsigned c)
+    {
+        if (c >= channels_.size())
+            assert(false); // todo
+        return *channels_[c];
+    }
+
+    unsigned numChannels() { return channels_.size(); }
+
+    // Run the code written since the last commit.  After an exception (or sys.exit) the rest of the
+    // run's code is skipped, as the rest of a script would be.
+    void commit()
+    {
+        std::string code = code_.str();
+        code_.str(std::string());
+        if (holding_) {
+            held_->code(code.data(), code.size());
+            held_->commit();
+            return;
+        }
+        if (ended_)
+            return;
+
+        detail::python_gil gil;
+        feed();
+        if (code.empty() || status_ != 0 || exited_)
+            return;
+
+#ifdef RUSAGE_THREAD
+        struct rusage before, after;
+        getrusage(RUSAGE_THREAD, &before);
+#endif
+        PyObject* compiled = detail::python_code_cache::instance().compile(code);
+        PyObject* result = compiled ? PyEval_EvalCode(compiled, globals_, globals_) : nullptr;
+        if (!result)
+            fail();
+        Py_XDECREF(result);
+        Py_XDECREF(compiled);
+#ifdef RUSAGE_THREAD
+        getrusage(RUSAGE_THREAD, &after);
+        ResourceUsage spent = ResourceUsage::of(0, after);
+        ResourceUsage start = ResourceUsage::of(0, before);
+        usage_.measured = true;
+        usage_.userSeconds += spent.userSeconds - start.userSeconds;
+        usage_.systemSeconds += spent.systemSeconds - start.systemSeconds;
+        usage_.maxRssKb = spent.maxRssKb;
+        usage_.minorFaults += spent.minorFaults - start.minorFaults;
+        usage_.majorFaults += spent.majorFaults - start.majorFaults;
+        usage_.voluntarySwitches += spent.voluntarySwitches - start.voluntarySwitches;
+        usage_.involuntarySwitches += spent.involuntarySwitches - start.involuntarySwitches;
+#endif
+    }
+
+    // Code and data are in memory already
+    void batch(bool) {}
+
+    int fd_out() const { return -1; }
+    int fd_timing() const { return -1; }
+
+    const ProcessOptions& options() const { return options_; }
+    bool multiplexed() const { return false; }
+
+    // As Process::define
+    bool define(const std::string& key, const std::string& code)
+    {
+        if (!defined_.insert(key).second)
+            return false;
+        code_ << code;
+        return true;
+    }
+
+    void defined(std::unordered_set<std::string> keys) { defined_ = std::move(keys); }
+
+    // Hand `n` bytes at `data` to channel c without copying them: the buffer must be left unchanged until
+    // the ticket is done, when the run ends
+    send_ticket send(unsigned c, const void* data, std::size_t n)
+    {
+        const char* p = static_cast<const char*>(data);
+        if (holding_) {
+            held_->data(c, p, n);
+            return send_ticket{};
+        }
+        hold(c);
+        pending_[c].push_back(Segment{{}, p, n});
+        return sent(c);
+    }
+
+    send_ticket sent(unsigned) { return ended_ ? send_ticket{} : send_ticket(counter_, 1); }
+
+    // As Process::send_file, though always by reading the file
+    bool send_file(unsigned c, int fd, off_t offset, std::size_t n)
+    {
+        std::vector<char> buffer(std::min<std::size_t>(n, 1 << 20));
+        while (n) {
+            ssize_t r = pread(fd, buffer.data(), std::min(n, buffer.size()), offset);
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                return false;
+            data_out(c).write(buffer.data(), r);
+            offset += r;
+            n -= r;
+        }
+        return true;
+    }
+
+    void record(Recorder* recorder)
+    {
+        if (recorder)
+            std::cerr << "(ioscript) Runs of an embedded interpreter aren't recorded" << std::endl;
+    }
+
+    Recorder* recorder() { return nullptr; }
+
+    void deltaFrames(DeltaFrames* frames) { deltaFrames_ = frames; }
+    DeltaFrames* deltaFrames() const { return deltaFrames_; }
+
+    // As Process::digest
+    void digest(RunDigest* digest, std::size_t maxHeld = std::size_t(-1))
+    {
+        if (digest) {
+            definedBefore_ = defined_;
+            held_ = std::make_unique<HeldRun>(digest, maxHeld);
+        }
+        else if (holding_) {
+            std::string code = code_.str();
+            held_->code(code.data(), code.size());
+            code_.str(std::string());
+        }
+        holding_ = digest != nullptr;
+        for (auto& channel : channels_)
+            channel->hold(holding_ ? held_.get() : nullptr);
+    }
+
+    bool digesting() const { return holding_; }
+    bool heldAll() const { return held_ && held_->complete(); }
+
+    void digestOnly(unsigned c, const std::string& bytes)
+    {
+        if (holding_)
+            held_->digestOnly(c, bytes.data(), bytes.size());
+    }
+
+    void sendHeld()
+    {
+        if (!held_ || holding_)
+            return;
+        std::unique_ptr<HeldRun> held = std::move(held_);
+        for (const HeldRun::Event& event : held->events()) {
+            if (event.kind == HeldRun::Code)
+                code_ << event.bytes;
+            else if (event.kind == HeldRun::Commit)
+                commit();
+            else
+                data_out(event.channel).write(event.bytes.data(), event.bytes.size());
+        }
+    }
+
+    void dropHeld()
+    {
+        if (!held_ || holding_)
+            return;
+        held_.reset();
+        defined_.swap(definedBefore_);
+    }
+
+private:
+    // Bytes to hand to a channel: written to data_out(c), or a buffer given to send()
+    struct Segment {
+        std::vector<char> bytes;
+        const char* p;
+        std::size_t n;
+    };
+
+    // Move what was written to channel c so far behind the buffers sent before it
+    void hold(unsigned c)
+    {
+        std::vector<char> bytes = data_out(c).take();
+        if (!bytes.empty())
+            pending_[c].push_back(Segment{std::move(bytes), nullptr, 0});
+    }
+
+    // Hand everything written so far to the channels, once the header has created them.  With the GIL held.
+    void feed()
+    {
+        PyObject* channels = PyDict_GetItemString(globals_, "iosc_in");   // Borrowed
+        if (!channels)
+            return;
+
+        for (unsigned c=0; c<channels_.size(); c++)
+        {
+            hold(c);
+            if (pending_[c].empty())
+                continue;
+            PyObject* channel = PySequence_GetItem(channels, c);
+            for (Segment& segment : pending_[c]) {
+                PyObject* obj;
+                if (segment.p) {
+                    obj = PyMemoryView_FromMemory(const_cast<char*>(segment.p), segment.n, PyBUF_READ);
+                    if (obj) {
+                        Py_INCREF(obj);
+                        views_.push_back(obj);
+                    }
+                }
+                else {
+                    obj = PyBytes_FromStringAndSize(segment.bytes.data(), segment.bytes.size());
+                }
+                PyObject* r = channel && obj ? PyObject_CallMethod(channel, "_feed", "O", obj) : nullptr;
+                if (!r)
+                    PyErr_Print();
+                Py_XDECREF(r);
+                Py_XDECREF(obj);
+            }
+            Py_XDECREF(channel);
+            pending_[c].clear();
+        }
+    }
+
+    // With the exception set.  sys.exit(n) ends the run with status n, without a traceback.
+    void fail()
+    {
+        if (!PyErr_ExceptionMatches(PyExc_SystemExit)) {
+            PyErr_PrintEx(0);   // Without keeping the traceback (and so the run's objects) in sys.last_traceback
+            status_ = 1;
+            return;
+        }
+
+        PyObject *type, *value, *trace;
+        PyErr_Fetch(&type, &value, &trace);
+        PyErr_NormalizeException(&type, &value, &trace);
+        PyObject* code = value ? PyObject_GetAttrString(value, "code") : nullptr;
+        status_ = !code || code == Py_None ? 0 : PyLong_Check(code) ? int(PyLong_AsLong(code)) : 1;
+        exited_ = true;
+        Py_XDECREF(code);
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(trace);
+        PyErr_Clear();
+    }
+
+    ProcessOptions options_;
+    PyObject* globals_ = nullptr;
+    std::ostringstream code_;
+    std::vector<std::unique_ptr<detail::python_channel_ostream>> channels_;
+    std::vector<std::vector<Segment>> pending_;
+    std::vector<PyObject*> views_;              // Of buffers given to send(), released at the end of the run
+    std::shared_ptr<pipe_counter> counter_;     // Closed at the end of the run, for the send_tickets
+    std::vector<byte> output_;
+    std::vector<byte> timings_;
+    std::unordered_set<std::string> defined_;
+    std::unordered_set<std::string> definedBefore_;
+    std::unique_ptr<HeldRun> held_;
+    bool holding_ = false;
+    DeltaFrames* deltaFrames_ = nullptr;
+    int status_ = 0;
+    ResourceUsage usage_;
+    bool exited_ = false;
+    bool ended_ = false;
+};
+
+// As PythonHeader, with channels and `iosc_out` in memory
+struct EmbeddedPythonHeader
+{
+    void operator()(Process<EmbeddedPython>& python) const
+    {
+        python.out()
+            << "# This header has been added by Script. See ioscript.h\n"
+            << "import os\n";
+
+        if (python.options().output)
+            python.out() << "import io as _iosc_io\n"
+                         << "iosc_out = _iosc_io.BytesIO()\n";
+
+        python.out()
+            << pythonEmbeddedChannels
+            << "iosc_in = [_IoscChannel() for _ in range(" << python.numChannels() << ")]\n"
+            << pythonStriped
+            << pythonSerialize;
+    }
+};
+
+template <typename S>
+void addPrivateHeader(Script<EmbeddedPython,S>& python)
+{
+    python.addToHeader(EmbeddedPythonHeader{});
+}
+
+#endif
+
 } // namespace iosc
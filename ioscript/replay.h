@@ -0,0 +1,246 @@
+#pragma once
+
+#include "ioscript.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <sys/stat.h>
+
+namespace iosc {
+
+/// "replay.h" ///
+
+// Reads bundles written by `Recorder` (see `Script::record`) and feeds them to a fresh interpreter.
+// Replaying only exercises the interpreter side of a run, so its cost can be measured and profiled
+// deterministically without the C++ application that produced it.
+class BundleReader
+{
+public:
+    struct Run {
+        std::string cmd;
+        std::vector<ChannelFd> layout;
+        bool multiplexed = false;
+        int outputFd = -1;      // Where the output pipe was, if open
+        int timingFd = -1;      // Likewise the timing pipe
+        bool incremental = false;
+    };
+
+    struct Event {
+        Recorder::Kind kind;
+        unsigned stream;
+        std::uint64_t timeNs;
+        std::string bytes;
+    };
+
+    BundleReader(const std::string& path)
+    {
+        // Keep our own descriptor well clear of those the recorded run expects, and out of the subprocess
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            fd_ = fcntl(fd, F_DUPFD_CLOEXEC, 256);
+            close(fd);
+        }
+
+        struct stat st;
+        if (fd_ != -1 && fstat(fd_, &st) == 0 && S_ISREG(st.st_mode))
+            size_ = std::uint64_t(st.st_size);
+
+        char magic[8];
+        if (fd_ == -1 || !readAll(magic, 8) || std::string(magic, 8) != "IOSCREC1") {
+            std::cerr << "(ioscript) " << path << " is not an ioscript bundle" << std::endl;
+            closeFd();
+        }
+    }
+    ~BundleReader() { closeFd(); }
+
+    BundleReader(const BundleReader&) = delete;
+    BundleReader& operator=(const BundleReader&) = delete;
+
+    bool good() const { return fd_ != -1; }
+
+    // Skips forward to the next run
+    bool nextRun(Run& run)
+    {
+        Event ev;
+        while (readEvent(ev)) {
+            if (ev.kind != Recorder::RunBegin)
+                continue;
+
+            std::size_t pos = ev.bytes.find('\0');
+            if (pos == std::string::npos)
+                return corrupt();
+            run.cmd = ev.bytes.substr(0, pos);
+            pos++;
+
+            std::uint32_t n = 0;
+            readPod(ev.bytes, pos, n);
+            if (pos > ev.bytes.size() || n > (ev.bytes.size() - pos) / (2 * sizeof(std::int32_t)))
+                return corrupt();
+            run.layout.clear();
+            for (std::uint32_t i=0; i<n; i++) {
+                std::int32_t r = -1, w = -1;
+                readPod(ev.bytes, pos, r);
+                readPod(ev.bytes, pos, w);
+                run.layout.push_back({r, w});
+            }
+
+            std::uint32_t flags = 0;
+            readPod(ev.bytes, pos, flags);
+            run.multiplexed = flags & 1;
+            run.incremental = flags & 4;
+            run.outputFd = -1;
+            if (flags & 2) {
+                std::int32_t fd = -1;
+                readPod(ev.bytes, pos, fd);
+                run.outputFd = fd;
+            }
+            run.timingFd = -1;
+            if (flags & 8) {
+                std::int32_t fd = -1;
+                readPod(ev.bytes, pos, fd);
+                run.timingFd = fd;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // The next event of the current run, or false at its end
+    bool nextEvent(Event& ev)
+    {
+        return readEvent(ev) && ev.kind != Recorder::RunEnd;
+    }
+
+private:
+    bool readAll(void* buf, std::size_t n)
+    {
+        char* p = static_cast<char*>(buf);
+        while (n) {
+            ssize_t r = read(fd_, p, n);
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                return false;
+            p += r;
+            n -= r;
+            pos_ += r;
+        }
+        return true;
+    }
+
+    // Stops reading: nothing after a bad record can be trusted
+    bool corrupt()
+    {
+        std::cerr << "(ioscript) bundle is truncated or corrupt at offset " << pos_ << std::endl;
+        closeFd();
+        return false;
+    }
+
+    bool readEvent(Event& ev)
+    {
+        if (fd_ == -1)
+            return false;
+
+        // The end of the file may only fall between records
+        unsigned char kind;
+        std::uint32_t stream;
+        std::uint64_t len;
+        if (!readAll(&kind, 1))
+            return false;
+        if (!readAll(&stream, sizeof(stream)) || !readAll(&ev.timeNs, sizeof(ev.timeNs)) || !readAll(&len, sizeof(len)))
+            return corrupt();
+
+        // A length is bounded by what's left of the file, so a bad one can't ask for any more memory
+        if (kind < Recorder::RunBegin || kind > Recorder::RunEnd || len > size_ - pos_)
+            return corrupt();
+
+        ev.kind = Recorder::Kind(kind);
+        ev.stream = stream;
+        ev.bytes.resize(len);
+        return readAll(&ev.bytes[0], len) || corrupt();
+    }
+
+    template <typename T>
+    static void readPod(const std::string& buf, std::size_t& pos, T& value)
+    {
+        if (pos + sizeof(T) <= buf.size())
+            std::copy(buf.data() + pos, buf.data() + pos + sizeof(T), reinterpret_cast<char*>(&value));
+        pos += sizeof(T);
+    }
+
+    void closeFd()
+    {
+        if (fd_ != -1)
+            close(fd_);
+        fd_ = -1;
+    }
+
+    int fd_ = -1;
+    std::uint64_t size_ = ~std::uint64_t(0);    // Of the file, if a regular one
+    std::uint64_t pos_ = 0;     // Read so far
+};
+
+// Replay the current run of `bundle` through a fresh `Process<P>`, with its channels on the same file
+// descriptors as when recorded.  With `realtime`, each write waits until its recorded time offset,
+// otherwise everything is sent as fast as the interpreter takes it.
+// Returns the wall time from the first write until the subprocess has exited.
+template <typename P>
+std::chrono::nanoseconds replayRun(BundleReader& bundle, const BundleReader::Run& run, bool realtime = false)
+{
+    // A run is recorded with the command spawned, so an incremental one with the runtime's bootstrap
+    const char* cmd = run.incremental && incremental_cmd<P>::cmd() ? incremental_cmd<P>::cmd() : P::cmd;
+    if (run.cmd != cmd)
+        std::clog << "(ioscript) Replaying a run recorded for '" << run.cmd << "' with '" << cmd << "'" << std::endl;
+
+    auto t0 = std::chrono::steady_clock::now();
+    {
+        ProcessOptions options;
+        options.multiplexed = run.multiplexed;
+        options.output = run.outputFd != -1;
+        options.incremental = run.incremental;
+        options.timing = run.timingFd != -1;
+        Process<P> process(run.layout, options, run.outputFd, run.timingFd);
+
+        BundleReader::Event ev;
+        while (bundle.nextEvent(ev))
+        {
+            if (realtime)
+                std::this_thread::sleep_until(t0 + std::chrono::nanoseconds(ev.timeNs));
+
+            switch (ev.kind)
+            {
+                case Recorder::Header:
+                case Recorder::Code:
+                    // As sent, so including any framing of incremental runs
+                    process.out_raw(ev.bytes.data(), ev.bytes.size());
+                    break;
+                case Recorder::Data:
+                    if (run.multiplexed || ev.stream < process.numChannels())
+                        process.data_out(ev.stream).write(ev.bytes.data(), ev.bytes.size());
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    return std::chrono::steady_clock::now() - t0;
+}
+
+// Replay every run in the bundle at `path`, one fresh subprocess each.  Returns the number of runs.
+template <typename P>
+unsigned replay(const std::string& path, bool realtime = false)
+{
+    BundleReader bundle(path);
+    BundleReader::Run run;
+    unsigned count = 0;
+    while (bundle.nextRun(run)) {
+        replayRun<P>(bundle, run, realtime);
+        count++;
+    }
+    return count;
+}
+
+} // namespace iosc
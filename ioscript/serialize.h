@@ -0,0 +1,267 @@
+#pragma once
+
+#include "ioscript.h"
+
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace iosc {
+
+/// "serialize.h" ///
+
+// Binary serialization of objects to a data channel, with a schema the reader uses to rebuild them:
+// in Python, `iosc_read(c)` (defined by the Script header) returns a numpy array, or structured array.
+//
+//     serialize(python, 0, points);     // std::vector<Point>
+//     python << "pts = iosc_read(0)\n"
+//               "plt.scatter(pts['x'], pts['y'])\n";
+//
+// On the wire a value is a schema line "<numpy dtype literal>|<count>\n" (count -1 for a single
+// value), then count records of the dtype's itemsize in host byte order.  The count may instead be a
+// shape, "<rows>,<cols>", for values read back as a 2D array (see view.h).
+//
+// Elements are described by `element_format<T>`: arithmetic types and std::pair are built in, and simple
+// aggregates of arithmetic members (like `struct Point { float x, y; }`) are decomposed automatically
+// with structured bindings (C++17).  Specialize element_format for other types, and `field_names` to
+// name an aggregate's fields (by default f0, f1, ...).
+//
+// Contiguous containers of trivially copyable elements (std::vector, std::array, C arrays) are sent as
+// a single block straight from memory; other containers are packed into one buffer first.
+
+// The numpy type for each arithmetic type
+template <typename T, typename U = void>
+struct arithmetic_dtype;
+
+template <>
+struct arithmetic_dtype<bool> { static std::string get() { return "?"; } };
+
+template <typename T>
+struct arithmetic_dtype<T, std::enable_if_t<std::is_integral<T>::value && !std::is_same<T,bool>::value>> {
+    static std::string get() { return (std::is_signed<T>::value ? "=i" : "=u") + std::to_string(sizeof(T)); }
+};
+
+template <typename T>
+struct arithmetic_dtype<T, std::enable_if_t<std::is_floating_point<T>::value>> {
+    static_assert(sizeof(T) <= 8, "long double has no portable numpy equivalent");
+    static std::string get() { return "=f" + std::to_string(sizeof(T)); }
+};
+
+
+// Names for the fields of an aggregate, with specializations in client code
+template <typename T>
+struct field_names {
+    static std::vector<std::string> get() { return {}; }
+};
+
+namespace detail {
+
+// A record type: fields of the given dtypes at the given offsets within `itemsize` bytes
+inline std::string record_dtype(const std::vector<std::string>& names, const std::vector<std::string>& formats,
+                                const std::vector<std::size_t>& offsets, std::size_t itemsize)
+{
+    std::ostringstream s;
+    s << "{'names': [";
+    for (std::size_t i=0; i<formats.size(); i++)
+        s << (i ? ", '" : "'") << (i < names.size() ? names[i] : "f" + std::to_string(i)) << "'";
+    s << "], 'formats': [";
+    for (std::size_t i=0; i<formats.size(); i++)
+        s << (i ? ", '" : "'") << formats[i] << "'";
+    s << "], 'offsets': [";
+    for (std::size_t i=0; i<offsets.size(); i++)
+        s << (i ? ", " : "") << offsets[i];
+    s << "], 'itemsize': " << itemsize << "}";
+    return s.str();
+}
+
+} // namespace detail
+
+
+// How an element is laid out in a record: its numpy dtype, its record size, and how to write one.
+// `raw` says a record is the element's own memory, so contiguous elements can be sent as they are.
+template <typename T, typename U = void>
+struct element_format;
+
+template <typename T>
+struct element_format<T, std::enable_if_t<std::is_arithmetic<T>::value>>
+{
+    static std::string dtype() { return arithmetic_dtype<T>::get(); }
+    static constexpr std::size_t size = sizeof(T);
+    static constexpr bool raw = true;
+    static void pack(char* out, const T& value) { std::memcpy(out, &value, sizeof(T)); }
+};
+
+template <typename A, typename B>
+struct element_format<std::pair<A,B>, std::enable_if_t<std::is_arithmetic<A>::value && std::is_arithmetic<B>::value>>
+{
+    static std::string dtype() {
+        return detail::record_dtype({"first", "second"}, {arithmetic_dtype<A>::get(), arithmetic_dtype<B>::get()},
+                                    {0, sizeof(A)}, size);
+    }
+    static constexpr std::size_t size = sizeof(A) + sizeof(B);   // Packed
+    static constexpr bool raw = false;
+    static void pack(char* out, const std::pair<A,B>& value) {
+        std::memcpy(out, &value.first, sizeof(A));
+        std::memcpy(out + sizeof(A), &value.second, sizeof(B));
+    }
+};
+
+#if __cplusplus >= 201703L
+
+namespace detail {
+
+// Counts the fields of an aggregate by the most initializers it accepts
+struct any_field {
+    template <typename T, std::enable_if_t<std::is_arithmetic<T>::value, int> = 0>
+    operator T() const;
+};
+
+template <typename T, typename Is, typename U = void>
+struct brace_constructible : std::false_type {};
+
+template <typename T, std::size_t... Is>
+struct brace_constructible<T, std::index_sequence<Is...>, void_t<decltype(T{ (void(Is), any_field{})... })>> : std::true_type {};
+
+template <typename T, std::size_t N = 8>
+struct field_count : std::conditional_t<brace_constructible<T, std::make_index_sequence<N>>::value,
+                                        std::integral_constant<std::size_t, N>, field_count<T, N-1>> {};
+
+template <typename T>
+struct field_count<T, 0> : std::integral_constant<std::size_t, 0> {};
+
+template <typename T, typename F>
+void for_each_field(T& obj, F&& f)
+{
+    constexpr std::size_t n = field_count<std::remove_const_t<T>>::value;
+    if constexpr (n == 1) { auto& [a] = obj; f(a); }
+    else if constexpr (n == 2) { auto& [a,b] = obj; f(a); f(b); }
+    else if constexpr (n == 3) { auto& [a,b,c] = obj; f(a); f(b); f(c); }
+    else if constexpr (n == 4) { auto& [a,b,c,d] = obj; f(a); f(b); f(c); f(d); }
+    else if constexpr (n == 5) { auto& [a,b,c,d,e] = obj; f(a); f(b); f(c); f(d); f(e); }
+    else if constexpr (n == 6) { auto& [a,b,c,d,e,g] = obj; f(a); f(b); f(c); f(d); f(e); f(g); }
+    else if constexpr (n == 7) { auto& [a,b,c,d,e,g,h] = obj; f(a); f(b); f(c); f(d); f(e); f(g); f(h); }
+    else if constexpr (n == 8) { auto& [a,b,c,d,e,g,h,i] = obj; f(a); f(b); f(c); f(d); f(e); f(g); f(h); f(i); }
+}
+
+} // namespace detail
+
+// Aggregates of up to 8 arithmetic members, sent as their in-memory records (padding and all)
+template <typename T>
+struct element_format<T, std::enable_if_t<std::is_aggregate<T>::value && !std::is_array<T>::value &&
+                                          std::is_trivially_copyable<T>::value &&
+                                          detail::field_count<T>::value != 0>>
+{
+    static std::string dtype()
+    {
+        T obj{};
+        std::vector<std::string> formats;
+        std::vector<std::size_t> offsets;
+        detail::for_each_field(obj, [&](auto& field) {
+            formats.push_back(arithmetic_dtype<std::decay_t<decltype(field)>>::get());
+            offsets.push_back(reinterpret_cast<const char*>(&field) - reinterpret_cast<const char*>(&obj));
+        });
+        return detail::record_dtype(field_names<T>::get(), formats, offsets, sizeof(T));
+    }
+    static constexpr std::size_t size = sizeof(T);
+    static constexpr bool raw = true;
+    static void pack(char* out, const T& value) { std::memcpy(out, &value, sizeof(T)); }
+};
+
+#endif
+
+template <typename T, typename U = void>
+struct has_element_format : std::false_type {};
+
+template <typename T>
+struct has_element_format<T, void_t<decltype(element_format<T>::dtype())>> : std::true_type {};
+
+
+template <typename F, typename U = void>
+struct is_raw_format : std::false_type {};
+
+template <typename F>
+struct is_raw_format<F, std::enable_if_t<F::raw>> : std::true_type {};
+
+
+// Whether a container's elements can be sent straight from its memory
+template <typename C, typename U = void>
+struct is_contiguous_block : std::false_type {};
+
+template <typename T, typename A>
+struct is_contiguous_block<std::vector<T,A>, std::enable_if_t<!std::is_same<T,bool>::value>> : std::true_type {};
+
+template <typename T, std::size_t N>
+struct is_contiguous_block<std::array<T,N>> : std::true_type {};
+
+template <typename T, std::size_t N>
+struct is_contiguous_block<T[N]> : std::true_type {};
+
+
+namespace detail {
+
+// `shape` is the count, or the dimensions separated by commas
+template <typename P>
+void write_schema(Process<P>& process, unsigned c, const std::string& dtype, const std::string& shape)
+{
+    // The schema is a Python literal: a plain type string is quoted
+    if (!dtype.empty() && (dtype[0] == '{' || dtype[0] == '['))
+        process.data_out(c) << dtype << '|' << shape << '\n';
+    else
+        process.data_out(c) << '\'' << dtype << "'|" << shape << '\n';
+}
+
+template <typename P>
+void write_schema(Process<P>& process, unsigned c, const std::string& dtype, long long count)
+{
+    write_schema(process, c, dtype, std::to_string(count));
+}
+
+} // namespace detail
+
+// A single element
+template <typename P, typename T, std::enable_if_t<has_element_format<T>::value, int> = 0>
+void serialize(Process<P>& process, unsigned c, const T& value)
+{
+    using F = element_format<T>;
+    char record[F::size];
+    F::pack(record, value);
+    detail::write_schema(process, c, F::dtype(), -1);
+    process.data_out(c).write(record, F::size);
+    process.data_out(c).flush();
+}
+
+// A container of elements
+template <typename P, typename C, typename T = std::decay_t<decltype(*std::begin(std::declval<const C&>()))>,
+          std::enable_if_t<!has_element_format<C>::value && has_element_format<T>::value, int> = 0>
+void serialize(Process<P>& process, unsigned c, const C& container)
+{
+    using F = element_format<T>;
+    std::size_t n = std::distance(std::begin(container), std::end(container));
+    detail::write_schema(process, c, F::dtype(), n);
+
+    // An empty container has only its schema, and no first element to take the address of
+    if (n != 0) {
+        if (is_contiguous_block<C>::value && is_raw_format<F>::value) {
+            // One block, straight from memory
+            process.data_out(c).write(reinterpret_cast<const char*>(&*std::begin(container)), n * sizeof(T));
+        }
+        else {
+            std::vector<char> buffer(n * F::size);
+            char* out = buffer.data();
+            for (const auto& value : container) {
+                F::pack(out, value);
+                out += F::size;
+            }
+            process.data_out(c).write(buffer.data(), buffer.size());
+        }
+    }
+    process.data_out(c).flush();
+}
+
+} // namespace iosc
@@ -0,0 +1,498 @@
+#pragma once
+
+#include "ioscript.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <poll.h>    // for poll
+
+namespace iosc {
+
+/// "server.h" ///
+
+// A server that runs the code of many applications' processes on one bounded pool of warm interpreters,
+// so that a host running 40 workers doesn't carry 40 interpreters, nor pay for their start-up each run.
+// `ioscriptd` (examples/ioscriptd.cpp) serves it on a UNIX socket; applications then set
+// ProcessOptions::server to its path, and everything else stays the same.
+//
+// A Process connecting to the server hands over the subprocess's end of its pipes with SCM_RIGHTS,
+// along with the descriptor number each one has in the code (see Process::connectServer).  Once the
+// application starts writing, the request is queued for the pool - in turn between applications, so a
+// busy one can't starve the others - and the next free interpreter runs it, in a fork of itself with the
+// descriptors in place, so that every run starts from the same state.  The wait status of the run goes
+// back to the Process, which returns it from wait() as usual, along with what the run consumed.
+//
+// Each pool interpreter runs `server_cmd<P>` with the server's end of a socket on descriptor 3 and the
+// `preload` code on stdin, which it runs once before taking requests (e.g. imports).  It then reads
+// messages of i32 flags (bit 0: the code is framed, see ProcessOptions::incremental) followed by i32
+// descriptor numbers, with the descriptors attached, and replies to each with a server_report of the run.
+struct ServerOptions
+{
+    unsigned pool = 4;          // Interpreters, and so the most runs at once
+    std::string preload;        // Code each interpreter runs once when started
+};
+
+// Receive a message and any descriptors sent with it (see sendFds), closed on exec.  Returns the length
+// of the message, 0 at the end of the stream or -1 on error.
+inline ssize_t recvFds(int sock, void* data, std::size_t n, std::vector<int>& fds)
+{
+    iovec iov = { data, n };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    std::vector<char> control(CMSG_SPACE(253 * sizeof(int)));   // SCM_MAX_FD
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    ssize_t r;
+    while ((r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {}
+
+    fds.clear();
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); r > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            std::size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* p = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+            fds.insert(fds.end(), p, p + count);
+        }
+    }
+    return r;
+}
+
+template <typename P>
+class InterpreterServer
+{
+public:
+    // Listens on `path`, replacing anything already there
+    InterpreterServer(const std::string& path, const ServerOptions& options = ServerOptions{}) :
+        path_(path), options_(options), pool_(std::max(options.pool, 1u))
+    {
+        if (!server_cmd<P>::cmd()) {
+            std::cerr << "(ioscript) the runtime " << P::cmd << " can't be served (see server_cmd)" << std::endl;
+            return;
+        }
+
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, path_.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(path_.c_str());
+
+        listen_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (listen_ == -1 || bind(listen_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+            listen(listen_, 128) == -1) {
+            std::cerr << "(ioscript) ioscriptd could not listen on " << path_ << std::endl;
+            if (listen_ != -1)
+                close(listen_);
+            listen_ = -1;
+            return;
+        }
+
+        if (pipe(wake_) == -1) {
+            std::cerr << "(ioscript) pipe() returned with error" << std::endl;
+            assert(false);
+        }
+        fcntl(wake_[0], F_SETFD, FD_CLOEXEC);
+        fcntl(wake_[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    ~InterpreterServer()
+    {
+        stop();
+        if (serverPid_ > 0)
+            while (waitpid(serverPid_, nullptr, 0) == -1 && errno == EINTR) {}
+
+        if (listen_ != -1) {
+            close(listen_);
+            unlink(path_.c_str());
+            close(wake_[0]);
+            close(wake_[1]);
+        }
+    }
+
+    InterpreterServer(const InterpreterServer&) = delete;
+    InterpreterServer& operator=(const InterpreterServer&) = delete;
+
+    bool good() const { return listen_ != -1; }
+
+    // Serve until stop().  The pool is started first, and stopped at the end
+    void serve()
+    {
+        if (!good())
+            return;
+        for (auto& interpreter : pool_)
+            startInterpreter(interpreter);
+
+        std::vector<pollfd> fds;
+        std::vector<std::pair<Source, std::uint64_t>> sources;
+        auto watch = [&](int fd, Source source, std::uint64_t id) {
+            fds.push_back(pollfd{fd, POLLIN, 0});
+            sources.emplace_back(source, id);
+        };
+
+        while (!stop_.load(std::memory_order_acquire))
+        {
+            fds.clear();
+            sources.clear();
+            watch(wake_[0], Wake, 0);
+            for (std::size_t i=0; i<pool_.size(); i++)
+                watch(pool_[i].sock, Pool, i);
+            for (auto& entry : clients_) {
+                const Client& client = entry.second;
+                if (client.requested && !client.ready) {
+                    for (std::uint32_t k=0; k<client.watch; k++)
+                        watch(client.fds[k], Input, entry.first);
+                }
+            }
+            for (auto& entry : clients_)
+                watch(entry.second.fd, Connection, entry.first);
+            watch(listen_, Listen, 0);
+
+            if (poll(fds.data(), fds.size(), -1) == -1) {
+                if (errno == EINTR)
+                    continue;
+                std::cerr << "(ioscript) ioscriptd: poll() returned with error" << std::endl;
+                return;
+            }
+
+            // Clients are looked up by id, as one handled earlier in the loop may be gone
+            for (std::size_t i=0; i<fds.size(); i++)
+            {
+                if (!fds[i].revents)
+                    continue;
+                std::uint64_t id = sources[i].second;
+                switch (sources[i].first)
+                {
+                    case Wake:
+                        stop_.store(true, std::memory_order_release);
+                        break;
+                    case Pool:
+                        finished(pool_[id]);
+                        break;
+                    case Input:
+                        // The application has started writing (or closed its end): the run can begin
+                        if (clients_.count(id))
+                            clients_[id].ready = true;
+                        break;
+                    case Connection:
+                        if (clients_.count(id))
+                            readClient(id);
+                        break;
+                    case Listen:
+                        accept();
+                        break;
+                }
+            }
+            dispatch();
+        }
+
+        // Requests still waiting see the connection close
+        while (!clients_.empty())
+            dropClient(clients_.begin()->first);
+        for (auto& interpreter : pool_)
+            stopInterpreter(interpreter);
+    }
+
+    // Serve from a child process, as a stand-in for ioscriptd in tests.  (Not a thread: descriptors
+    // received in this process would take the numbers the application's next pipes expect.)
+    void start()
+    {
+        if (!good())
+            return;
+        std::cout.flush();
+        std::cerr.flush();
+
+        serverPid_ = fork();
+        if (serverPid_ == -1) {
+            std::cerr << "(ioscript) fork() returned with error" << std::endl;
+            assert(false);  // todo
+        }
+        if (serverPid_ == 0) {
+            // Nothing of the application's may be held open here, such as the write end of a pipe
+            int maxFd = std::min<long>(sysconf(_SC_OPEN_MAX), 1 << 16);
+            for (int fd=3; fd<maxFd; fd++) {
+                if (fd != listen_ && fd != wake_[0] && fd != wake_[1])
+                    close(fd);
+            }
+            serve();
+            _exit(0);
+        }
+    }
+
+    // Async-signal-safe
+    void stop()
+    {
+        stop_.store(true, std::memory_order_release);
+        if (listen_ != -1) {
+            ssize_t r = write(wake_[1], "x", 1);
+            (void)r;
+        }
+    }
+
+private:
+    enum Source { Wake, Pool, Input, Connection, Listen };
+
+    struct Client {
+        int fd = -1;
+        pid_t app = 0;              // Requests are queued per application
+        bool requested = false;
+        bool ready = false;         // Something to read on one of its inputs
+        bool running = false;
+        std::uint32_t watch = 0;    // The first `watch` fds are its inputs
+        std::uint32_t flags = 0;    // Passed on to the interpreter
+        std::vector<int> fds;
+        std::vector<std::int32_t> targets;
+    };
+
+    struct Interpreter {
+        pid_t pid = -1;
+        int sock = -1;
+        bool busy = false;
+        std::uint64_t client = 0;   // The client waiting on the current run, 0 if none (or it left)
+    };
+
+    void accept()
+    {
+        int fd = accept4(listen_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1)
+            return;
+
+        Client client;
+        client.fd = fd;
+        client.app = fd;
+#ifdef SO_PEERCRED
+        ucred cred = {};
+        socklen_t len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+            client.app = cred.pid;
+#endif
+        clients_[++lastId_] = std::move(client);
+    }
+
+    // The client's request, or its leaving
+    void readClient(std::uint64_t id)
+    {
+        Client& client = clients_[id];
+        std::vector<char> message(4096);
+        std::vector<int> fds;
+        ssize_t r = client.requested ? 0 : recvFds(client.fd, message.data(), message.size(), fds);
+
+        std::size_t cmdEnd = r > 0 ? std::find(message.begin(), message.begin() + r, '\0') - message.begin() : 0;
+        // The command, then u32 watch and flags, then the i32 targets
+        std::uint32_t watch = 0, flags = 0;
+        const std::size_t header = cmdEnd + 1 + sizeof(watch) + sizeof(flags);
+        if (r > 0 && header <= std::size_t(r)) {
+            std::memcpy(&watch, &message[cmdEnd + 1], sizeof(watch));
+            std::memcpy(&flags, &message[cmdEnd + 1 + sizeof(watch)], sizeof(flags));
+        }
+
+        std::size_t count = r > 0 && header <= std::size_t(r) ? (r - header) / sizeof(std::int32_t) : 0;
+        bool valid = r > 0 && std::string(message.data(), cmdEnd) == P::cmd && count == fds.size() &&
+                     watch <= count && !fds.empty();
+        if (r > 0 && !valid)
+            std::cerr << "(ioscript) ioscriptd: rejected a request for '" << std::string(message.data(), cmdEnd)
+                      << "' with " << fds.size() << " descriptors" << std::endl;
+
+        if (!valid) {
+            for (int fd : fds)
+                close(fd);
+            dropClient(id);
+            return;
+        }
+
+        client.requested = true;
+        client.watch = watch;
+        client.flags = flags;
+        client.fds = std::move(fds);
+        client.targets.resize(count);
+        std::memcpy(client.targets.data(), &message[header], count * sizeof(std::int32_t));
+        queues_[client.app].push_back(id);
+    }
+
+    // Closes the connection and anything the client's request still holds
+    void dropClient(std::uint64_t id)
+    {
+        Client& client = clients_[id];
+        for (int fd : client.fds)
+            close(fd);
+        close(client.fd);
+
+        auto queue = queues_.find(client.app);
+        if (queue != queues_.end()) {
+            auto it = std::find(queue->second.begin(), queue->second.end(), id);
+            if (it != queue->second.end())
+                queue->second.erase(it);
+            if (queue->second.empty())
+                queues_.erase(queue);
+        }
+        for (auto& interpreter : pool_) {
+            if (interpreter.client == id)
+                interpreter.client = 0;
+        }
+        clients_.erase(id);
+    }
+
+    // Start ready requests on free interpreters, taking applications in turn
+    void dispatch()
+    {
+        for (auto& interpreter : pool_)
+        {
+            if (interpreter.busy || interpreter.sock == -1)
+                continue;
+
+            std::uint64_t id = nextReady();
+            if (!id)
+                return;
+
+            Client& client = clients_[id];
+            std::vector<std::int32_t> message(1, std::int32_t(client.flags));
+            message.insert(message.end(), client.targets.begin(), client.targets.end());
+            if (!sendFds(interpreter.sock, message.data(), message.size() * sizeof(std::int32_t), client.fds)) {
+                std::cerr << "(ioscript) ioscriptd: could not hand a request to interpreter " << interpreter.pid << std::endl;
+                restart(interpreter);
+                continue;
+            }
+            for (int fd : client.fds)
+                close(fd);
+            client.fds.clear();
+            client.running = true;
+            interpreter.busy = true;
+            interpreter.client = id;
+        }
+    }
+
+    // The first ready request of the next application after the last served, round robin
+    std::uint64_t nextReady()
+    {
+        if (queues_.empty())
+            return 0;
+
+        auto start = queues_.upper_bound(lastApp_);
+        for (std::size_t n=0, size=queues_.size(); n<size; n++)
+        {
+            if (start == queues_.end())
+                start = queues_.begin();
+            auto& queue = start->second;
+            for (auto it = queue.begin(); it != queue.end(); ++it) {
+                if (clients_[*it].ready) {
+                    std::uint64_t id = *it;
+                    lastApp_ = start->first;
+                    queue.erase(it);
+                    if (queue.empty())
+                        queues_.erase(start);
+                    return id;
+                }
+            }
+            ++start;
+        }
+        return 0;
+    }
+
+    // An interpreter reported the status of its run, or exited
+    void finished(Interpreter& interpreter)
+    {
+        server_report report;
+        ssize_t r;
+        while ((r = recv(interpreter.sock, &report, sizeof(report), 0)) == -1 && errno == EINTR) {}
+        const bool lost = r < ssize_t(sizeof(report.status));
+        if (lost) {
+            std::cerr << "(ioscript) ioscriptd: interpreter " << interpreter.pid << " exited, restarting it" << std::endl;
+            report.status = -1;
+            r = sizeof(report.status);
+        }
+
+        if (interpreter.client && clients_.count(interpreter.client)) {
+            send(clients_[interpreter.client].fd, &report, std::size_t(r), MSG_NOSIGNAL);
+            dropClient(interpreter.client);
+        }
+        interpreter.busy = false;
+        interpreter.client = 0;
+
+        if (lost)
+            restart(interpreter);
+    }
+
+    void startInterpreter(Interpreter& interpreter)
+    {
+        int sv[2], in[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1 || pipe(in) == -1) {
+            std::cerr << "(ioscript) ioscriptd: could not open a pipe to an interpreter" << std::endl;
+            assert(false);
+            return;
+        }
+        fcntl(in[0], F_SETFD, FD_CLOEXEC);
+        fcntl(in[1], F_SETFD, FD_CLOEXEC);
+
+        interpreter.pid = fork();
+        if (interpreter.pid == -1) {
+            std::cerr << "(ioscript) fork() returned with error" << std::endl;
+            assert(false);  // todo
+        }
+
+        if (interpreter.pid == 0)
+        {
+            dup2(in[0], 0);
+            if (sv[1] == 3)
+                fcntl(3, F_SETFD, 0);
+            else
+                dup2(sv[1], 3);
+            execl("/bin/sh", "sh", "-c", server_cmd<P>::cmd(), static_cast<char*>(nullptr));
+            _exit(127);
+        }
+
+        close(in[0]);
+        close(sv[1]);
+        interpreter.sock = sv[0];
+        interpreter.busy = false;
+        interpreter.client = 0;
+
+        const char* p = options_.preload.data();
+        std::size_t n = options_.preload.size();
+        while (n) {
+            ssize_t r = write(in[1], p, n);
+            if (r == -1 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                break;
+            p += r;
+            n -= r;
+        }
+        close(in[1]);
+    }
+
+    void stopInterpreter(Interpreter& interpreter)
+    {
+        if (interpreter.sock != -1)
+            close(interpreter.sock);   // It exits at the end of its requests
+        if (interpreter.pid > 0)
+            while (waitpid(interpreter.pid, nullptr, 0) == -1 && errno == EINTR) {}
+        interpreter.sock = -1;
+        interpreter.pid = -1;
+    }
+
+    void restart(Interpreter& interpreter)
+    {
+        if (interpreter.client && clients_.count(interpreter.client))
+            dropClient(interpreter.client);
+        stopInterpreter(interpreter);
+        startInterpreter(interpreter);
+    }
+
+    std::string path_;
+    ServerOptions options_;
+    int listen_ = -1;
+    int wake_[2] = { -1, -1 };
+    std::atomic<bool> stop_{false};
+    pid_t serverPid_ = -1;      // Serving from a child process, see start()
+
+    std::vector<Interpreter> pool_;
+    std::map<std::uint64_t, Client> clients_;
+    std::map<pid_t, std::deque<std::uint64_t>> queues_;    // Waiting requests, per application
+    std::uint64_t lastId_ = 0;
+    pid_t lastApp_ = 0;
+};
+
+} // namespace iosc
@@ -0,0 +1,247 @@
+#pragma once
+
+#include "ioscript.h"
+#include "serialize.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace iosc {
+
+/// "view.h" ///
+
+// Non-owning views of elements spaced at a fixed stride in memory someone else owns, as std::mdspan
+// would describe them: a column of a matrix, a window of a large grid, a grid transposed.  Bind them like
+// any other type, so that plotting a 512x512 window of a 32k x 32k grid sends only the window's values,
+// with no copy made first:
+//
+//     template <typename T> struct binds_to<grid_view<T>> { using type = variant<HeatMap>; };
+//
+//     script.run(grid_view<double>(big.data(), 32768, 32768).window(1024, 2048, 512, 512));
+//
+// Strides are counted in elements and may be negative (e.g. to flip a grid).  A view must not outlive the
+// storage it refers to.  serialize() sends a view straight from that storage, row by row, gathering
+// the values of rows that aren't contiguous.
+
+template <typename T>
+class strided_view
+{
+public:
+    using value_type = T;
+
+    class iterator
+    {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        iterator() {}
+        iterator(const T* p, std::ptrdiff_t stride) : p_(p), stride_(stride) {}
+
+        const T& operator*() const { return *p_; }
+        const T* operator->() const { return p_; }
+        const T& operator[](std::ptrdiff_t n) const { return p_[n * stride_]; }
+
+        iterator& operator++() { p_ += stride_; return *this; }
+        iterator operator++(int) { iterator it = *this; p_ += stride_; return it; }
+        iterator& operator--() { p_ -= stride_; return *this; }
+        iterator operator--(int) { iterator it = *this; p_ -= stride_; return it; }
+        iterator& operator+=(std::ptrdiff_t n) { p_ += n * stride_; return *this; }
+        iterator& operator-=(std::ptrdiff_t n) { p_ -= n * stride_; return *this; }
+        iterator operator+(std::ptrdiff_t n) const { return iterator(p_ + n * stride_, stride_); }
+        iterator operator-(std::ptrdiff_t n) const { return iterator(p_ - n * stride_, stride_); }
+        std::ptrdiff_t operator-(const iterator& rhs) const { return stride_ ? (p_ - rhs.p_) / stride_ : 0; }
+
+        bool operator==(const iterator& rhs) const { return p_ == rhs.p_; }
+        bool operator!=(const iterator& rhs) const { return p_ != rhs.p_; }
+        bool operator<(const iterator& rhs) const { return *this - rhs < 0; }
+
+    private:
+        const T* p_ = nullptr;
+        std::ptrdiff_t stride_ = 1;
+    };
+
+    strided_view() {}
+    strided_view(const T* data, std::size_t size, std::ptrdiff_t stride = 1) : data_(data), size_(size), stride_(stride) {}
+
+    std::size_t size() const { return size_; }
+    std::ptrdiff_t stride() const { return stride_; }
+    bool contiguous() const { return stride_ == 1 || size_ <= 1; }
+
+    const T& operator[](std::size_t i) const { return data_[std::ptrdiff_t(i) * stride_]; }
+    const T* first() const { return data_; }   // Where element 0 is
+
+    iterator begin() const { return iterator(data_, stride_); }
+    iterator end() const { return iterator(data_ + std::ptrdiff_t(size_) * stride_, stride_); }
+
+    // n elements from `first`, taking every `step`'th
+    strided_view sub(std::size_t first, std::size_t n, std::size_t step = 1) const
+    {
+        return strided_view(data_ + std::ptrdiff_t(first) * stride_, n, stride_ * std::ptrdiff_t(step));
+    }
+
+    strided_view reversed() const
+    {
+        return size_ ? strided_view(data_ + std::ptrdiff_t(size_ - 1) * stride_, size_, -stride_) : *this;
+    }
+
+private:
+    const T* data_ = nullptr;
+    std::size_t size_ = 0;
+    std::ptrdiff_t stride_ = 1;
+};
+
+// Row major by default.  Also indexes like a 2D array (grid[i][j], grid.size(), grid[0].size()), so
+// snippets written for those take a view unchanged.
+template <typename T>
+class grid_view
+{
+public:
+    using value_type = strided_view<T>;
+
+    grid_view() {}
+    grid_view(const T* data, std::size_t rows, std::size_t cols) : grid_view(data, rows, cols, cols, 1) {}
+    grid_view(const T* data, std::size_t rows, std::size_t cols, std::ptrdiff_t rowStride, std::ptrdiff_t colStride) :
+        data_(data), rows_(rows), cols_(cols), rowStride_(rowStride), colStride_(colStride) {}
+
+    // A nested std::array, whose rows lie back to back
+    template <std::size_t M, std::size_t N>
+    grid_view(const std::array<std::array<T,M>,N>& grid) : grid_view(N ? grid[0].data() : nullptr, N, M)
+    {
+        static_assert(sizeof(std::array<T,M>) == M * sizeof(T), "std::array is padded: rows aren't evenly spaced");
+    }
+
+    std::size_t rows() const { return rows_; }
+    std::size_t cols() const { return cols_; }
+    std::ptrdiff_t rowStride() const { return rowStride_; }
+    std::ptrdiff_t colStride() const { return colStride_; }
+
+    const T& operator()(std::size_t i, std::size_t j) const
+    {
+        return data_[std::ptrdiff_t(i) * rowStride_ + std::ptrdiff_t(j) * colStride_];
+    }
+
+    strided_view<T> row(std::size_t i) const { return strided_view<T>(&(*this)(i, 0), cols_, colStride_); }
+    strided_view<T> column(std::size_t j) const { return strided_view<T>(&(*this)(0, j), rows_, rowStride_); }
+
+    std::size_t size() const { return rows_; }
+    strided_view<T> operator[](std::size_t i) const { return row(i); }
+
+    // `rows` x `cols` from (row, col)
+    grid_view window(std::size_t row, std::size_t col, std::size_t rows, std::size_t cols) const
+    {
+        return grid_view(&(*this)(row, col), rows, cols, rowStride_, colStride_);
+    }
+
+    // Every `rowStep`'th row and `colStep`'th column, as decimate_stride samples a grid
+    grid_view every(std::size_t rowStep, std::size_t colStep) const
+    {
+        rowStep = std::max<std::size_t>(rowStep, 1);
+        colStep = std::max<std::size_t>(colStep, 1);
+        return grid_view(data_, (rows_ + rowStep - 1) / rowStep, (cols_ + colStep - 1) / colStep,
+                         rowStride_ * std::ptrdiff_t(rowStep), colStride_ * std::ptrdiff_t(colStep));
+    }
+
+    grid_view transposed() const { return grid_view(data_, cols_, rows_, colStride_, rowStride_); }
+
+    // Whether the elements of each row lie back to back
+    bool rowsContiguous() const { return colStride_ == 1 || cols_ <= 1; }
+
+private:
+    const T* data_ = nullptr;
+    std::size_t rows_ = 0;
+    std::size_t cols_ = 0;
+    std::ptrdiff_t rowStride_ = 0;
+    std::ptrdiff_t colStride_ = 1;
+};
+
+// A view of every `step`'th element of a contiguous container
+template <typename C, typename T = std::remove_cv_t<std::remove_pointer_t<decltype(std::declval<const C&>().data())>>>
+strided_view<T> view(const C& container, std::size_t step = 1)
+{
+    step = std::max<std::size_t>(step, 1);
+    return strided_view<T>(container.data(), (container.size() + step - 1) / step, std::ptrdiff_t(step));
+}
+
+// A matrix stored row major in a contiguous container
+template <typename C, typename T = std::remove_cv_t<std::remove_pointer_t<decltype(std::declval<const C&>().data())>>>
+grid_view<T> view(const C& container, std::size_t rows, std::size_t cols)
+{
+    return grid_view<T>(container.data(), rows, cols);
+}
+
+
+namespace detail {
+
+// Send a grid's records row by row: contiguous rows of raw elements straight from memory when they're
+// long enough to be worth a write of their own, everything else packed into a buffer of bounded size,
+// however long the row
+template <typename P, typename T>
+void write_rows(Process<P>& process, unsigned c, const grid_view<T>& grid)
+{
+    using F = element_format<T>;
+    constexpr std::size_t direct = 1 << 14;     // Bytes
+    const std::size_t rowBytes = grid.cols() * F::size;
+    const bool raw = is_raw_format<F>::value && grid.rowsContiguous();
+
+    auto& out = process.data_out(c);
+    std::vector<char> buffer(std::min<std::size_t>(grid.rows() * rowBytes, std::max<std::size_t>(direct * 4, F::size)));
+    std::size_t used = 0;
+
+    for (std::size_t i=0; i<grid.rows(); i++)
+    {
+        strided_view<T> row = grid.row(i);
+        if (raw && rowBytes >= direct) {
+            out.write(reinterpret_cast<const char*>(row.first()), rowBytes);
+            continue;
+        }
+        for (std::size_t j=0; j<row.size(); )
+        {
+            if (used + F::size > buffer.size()) {
+                out.write(buffer.data(), used);
+                used = 0;
+            }
+            // As many of the row's elements as fit
+            const std::size_t n = std::min(row.size() - j, (buffer.size() - used) / F::size);
+            if (raw) {
+                std::copy_n(reinterpret_cast<const char*>(row.first()) + j * F::size, n * F::size, buffer.data() + used);
+            }
+            else {
+                for (std::size_t k=0; k<n; k++)
+                    F::pack(buffer.data() + used + k * F::size, row[j + k]);
+            }
+            used += n * F::size;
+            j += n;
+        }
+    }
+    out.write(buffer.data(), used);
+    out.flush();
+}
+
+} // namespace detail
+
+// With the schema of a container of T (see serialize.h)
+template <typename P, typename T, std::enable_if_t<has_element_format<T>::value, int> = 0>
+void serialize(Process<P>& process, unsigned c, const strided_view<T>& view)
+{
+    detail::write_schema(process, c, element_format<T>::dtype(), view.size());
+    detail::write_rows(process, c, grid_view<T>(view.first(), 1, view.size(), 0, view.stride()));
+}
+
+// With a schema giving the grid's shape, so that in Python `iosc_read(c)` returns a rows x cols array
+template <typename P, typename T, std::enable_if_t<has_element_format<T>::value, int> = 0>
+void serialize(Process<P>& process, unsigned c, const grid_view<T>& grid)
+{
+    detail::write_schema(process, c, element_format<T>::dtype(),
+                         std::to_string(grid.rows()) + "," + std::to_string(grid.cols()));
+    detail::write_rows(process, c, grid);
+}
+
+} // namespace iosc